@@ -0,0 +1,415 @@
+/*
+
+  VLSI Solution generic microcontroller example player / recorder for
+  VS1063: test and benchmark for the recording decoders.
+
+  VSTestDecodeRecording() in playerdecode.c reads RIFF WAV files and
+  hands the samples to HostG711Decode() and HostImaDecode() in
+  playerhost.c. This program checks those two bit for bit against
+  known values and straightforward reference decoders, then decodes
+  the recordings in testdata/ with VSTestDecodeRecording() and
+  compares the files with the expected ones, and finally measures the
+  throughput of the decoders. Compile with and without the vector
+  instructions, and run in this directory:
+
+    cc -O2 -mavx2 -DPLAYER_HOST decodetest.c playerdecode.c \
+      playerriff.c playerendian.c playerhost.c -lpthread
+    cc -O2 -DPLAYER_HOST decodetest.c playerdecode.c \
+      playerriff.c playerendian.c playerhost.c -lpthread
+
+  The recordings in testdata/ were made with the "ulaw", "alaw" and
+  "ima" encoder profiles, with the VS1063 simulated, from a frequency
+  sweep with noise that clips in the middle. The expected PCM files
+  were checked against the reference decoders below.
+
+  Returns 0 if all results match.
+
+*/
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef PLAYER_HOST
+#define PLAYER_HOST
+#endif
+#include "player1063.h"
+
+#define BENCH_BYTES (4*1024*1024) /* Input bytes per timing */
+#define BENCH_ROUNDS 20
+#define TEST_DIR "testdata/"
+#define TEST_OUT "decodetest.wav" /* Removed after the test */
+#define MAX_FILE (64*1024)
+
+static int errors = 0;
+
+
+/*
+  Reference decoders. The G.711 ones are the classic ones from the
+  public domain Sun g711.c, IMA ADPCM is decoded as in the IMA
+  Recommended Practices, one nibble at a time.
+*/
+
+static s_int16 RefUlaw(u_int8 u) {
+  int t;
+
+  u = ~u;
+  t = ((u & 0x0F) << 3) + 0x84;
+  t <<= (u & 0x70) >> 4;
+  return (s_int16)((u & 0x80) ? (0x84 - t) : (t - 0x84));
+}
+
+static s_int16 RefAlaw(u_int8 a) {
+  int t, seg;
+
+  a ^= 0x55;
+  t = (a & 0x0F) << 4;
+  seg = (a & 0x70) >> 4;
+  switch (seg) {
+  case 0:
+    t += 8;
+    break;
+  case 1:
+    t += 0x108;
+    break;
+  default:
+    t += 0x108;
+    t <<= seg - 1;
+  }
+  return (s_int16)((a & 0x80) ? t : -t);
+}
+
+static const int refStep[89] = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41,
+  45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190,
+  209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724,
+  796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272,
+  2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132,
+  7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500,
+  20350, 22385, 24623, 27086, 29794, 32767
+};
+
+struct RefIma {
+  int pred, index;
+};
+
+static s_int16 RefImaNibble(struct RefIma *s, int nibble) {
+  static const int indexTable[8] = {-1, -1, -1, -1, 2, 4, 6, 8};
+  int step = refStep[s->index];
+  int diff = step >> 3;
+
+  if (nibble & 4) {
+    diff += step;
+  }
+  if (nibble & 2) {
+    diff += step >> 1;
+  }
+  if (nibble & 1) {
+    diff += step >> 2;
+  }
+  s->pred += (nibble & 8) ? -diff : diff;
+  if (s->pred > 32767) {
+    s->pred = 32767;
+  } else if (s->pred < -32768) {
+    s->pred = -32768;
+  }
+  s->index += indexTable[nibble & 7];
+  if (s->index < 0) {
+    s->index = 0;
+  } else if (s->index > 88) {
+    s->index = 88;
+  }
+  return (s_int16)s->pred;
+}
+
+/* Decodes a whole stream of blocks, returns the number of frames */
+static u_int32 RefImaDecode(s_int16 *out, const u_int8 *in, u_int32 blocks,
+                            u_int16 blockAlign, int channels) {
+  u_int32 b, f = 0;
+
+  for (b=0; b<blocks; b++, in += blockAlign) {
+    struct RefIma s[2];
+    const u_int8 *d = in + 4*channels;
+    int c, j;
+
+    for (c=0; c<channels; c++) {
+      s[c].pred = (s_int16)(in[4*c] | in[4*c+1] << 8);
+      s[c].index = (in[4*c+2] > 88) ? 88 : in[4*c+2];
+      out[f*channels+c] = (s_int16)s[c].pred;
+    }
+    f++;
+    /* Each channel in turn has 4 bytes, 8 samples, low nibble first */
+    for (; d < in + blockAlign; d += 4*channels, f += 8) {
+      for (c=0; c<channels; c++) {
+        for (j=0; j<8; j++) {
+          int nibble = (d[4*c + j/2] >> (4*(j & 1))) & 0xF;
+
+          out[(f+j)*channels+c] = RefImaNibble(&s[c], nibble);
+        }
+      }
+    }
+  }
+  return f;
+}
+
+
+static u_int32 rndState = 2463534242U;
+
+static u_int32 Rnd(void) {
+  rndState ^= rndState << 13;
+  rndState ^= rndState >> 17;
+  rndState ^= rndState << 5;
+  return rndState;
+}
+
+static double Now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* VSTestDecodeRecording() times itself with this */
+u_int32 GetMicroseconds(void) {
+  return (u_int32)(Now() * 1e6);
+}
+
+
+/*
+  G.711: a few values from the ITU-T G.711 tables, scaled to 16 bits,
+  then all codes at every position of a vector and in the scalar tail.
+*/
+
+static void TestG711(void) {
+  static const struct {
+    u_int8 code;
+    int alaw;
+    s_int16 value;
+  } known[] = {
+    {0x00, 0, -32124}, {0x80, 0, 32124}, {0x7F, 0, 0}, {0xFF, 0, 0},
+    {0x7E, 0, -8}, {0xFE, 0, 8}, {0x0F, 0, -16764}, {0x8F, 0, 16764},
+    {0x55, 1, -8}, {0xD5, 1, 8}, {0x2A, 1, -32256}, {0xAA, 1, 32256},
+    {0x54, 1, -24}, {0xD4, 1, 24}, {0x45, 1, -264}, {0xC5, 1, 264}
+  };
+  static u_int8 in[256+64];
+  static s_int16 out[256+64];
+  u_int32 i, n, off;
+  int alaw;
+
+  for (i=0; i<sizeof(known)/sizeof(known[0]); i++) {
+    s_int16 v;
+
+    HostG711Decode(&v, &known[i].code, 1, known[i].alaw);
+    if (v != known[i].value) {
+      printf("%s 0x%02x: %d, should be %d\n", known[i].alaw ? "A-law" :
+             "u-law", known[i].code, v, known[i].value);
+      errors++;
+    }
+  }
+
+  for (alaw=0; alaw<2; alaw++) {
+    for (off=0; off<32; off++) {
+      for (n=0; n<=256; n += (n < 40) ? 1 : 27) {
+        for (i=0; i<n; i++) {
+          in[off+i] = (u_int8)(i*7 + off);
+        }
+        HostG711Decode(out+off, in+off, n, alaw);
+        for (i=0; i<n; i++) {
+          u_int8 c = in[off+i];
+
+          if (out[off+i] != (alaw ? RefAlaw(c) : RefUlaw(c))) {
+            if (errors++ < 10) {
+              printf("%s 0x%02x at %lu of %lu: %d\n",
+                     alaw ? "A-law" : "u-law", c, (unsigned long)i,
+                     (unsigned long)n, out[off+i]);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+
+/*
+  IMA ADPCM: random blocks, mono and stereo, with several block sizes,
+  block counts and thread counts.
+*/
+
+static void TestIma(void) {
+  static const u_int16 align[] = {8, 12, 36, 256, 512, 1024, 2048};
+  static const int threads[] = {1, 2, 3, 7, 0};
+  static const u_int32 blockCount[] = {0, 1, 2, 5, 17, 64};
+  u_int8 *in = malloc(64*2048);
+  s_int16 *out = malloc(64*4096*sizeof(s_int16));
+  s_int16 *ref = malloc(64*4096*sizeof(s_int16));
+  u_int32 i, a, b, t;
+  int ch;
+
+  for (i=0; i<64*2048; i++) {
+    in[i] = (u_int8)Rnd();
+  }
+  for (ch=1; ch<=2; ch++) {
+    for (a=0; a<sizeof(align)/sizeof(align[0]); a++) {
+      u_int16 blockAlign = align[a]*ch;
+
+      if (blockAlign > 2048) {
+        continue;
+      }
+      for (b=0; b<sizeof(blockCount)/sizeof(blockCount[0]); b++) {
+        for (t=0; t<sizeof(threads)/sizeof(threads[0]); t++) {
+          u_int32 blocks = blockCount[b];
+          u_int32 f1, f2;
+
+          memset(out, 0x55, 64*4096*sizeof(s_int16));
+          f1 = HostImaDecode(out, in, blocks, blockAlign, ch, threads[t]);
+          f2 = RefImaDecode(ref, in, blocks, blockAlign, ch);
+          if (f1 != f2 || memcmp(out, ref, f2*ch*sizeof(s_int16))) {
+            if (errors++ < 10) {
+              printf("IMA ADPCM mismatch: %d channels, blockAlign %u, "
+                     "%lu blocks, %d threads\n", ch, blockAlign,
+                     (unsigned long)blocks, threads[t]);
+            }
+          }
+        }
+      }
+    }
+  }
+  /* Invalid block sizes are refused */
+  if (HostImaDecode(out, in, 1, 10, 1, 1) ||
+      HostImaDecode(out, in, 1, 12, 2, 1) ||
+      HostImaDecode(out, in, 1, 4, 1, 1)) {
+    printf("IMA ADPCM: invalid blockAlign accepted\n");
+    errors++;
+  }
+  free(in);
+  free(out);
+  free(ref);
+}
+
+
+/*
+  Recordings: each one in testdata/ is decoded with one thread and with
+  all CPUs, and the resulting file, header included, must be the same
+  as the expected one.
+*/
+
+/* Reads at most MAX_FILE bytes of fileName to buf, returns the size */
+static long ReadFile(const char *fileName, u_int8 *buf) {
+  FILE *fp = fopen(fileName, "rb");
+  long n;
+
+  if (!fp) {
+    printf("Failed opening %s for reading\n", fileName);
+    return -1;
+  }
+  n = (long)fread(buf, 1, MAX_FILE, fp);
+  fclose(fp);
+  return n;
+}
+
+static void TestRecordings(void) {
+  static const char *const name[] = {"ulaw", "alaw", "ima"};
+  static const int threads[] = {1, 0};
+  static u_int8 got[MAX_FILE], expected[MAX_FILE];
+  char inName[64], expName[64];
+  long gotBytes, expBytes;
+  u_int32 i, t;
+
+  for (i=0; i<sizeof(name)/sizeof(name[0]); i++) {
+    sprintf(inName, TEST_DIR "%s.wav", name[i]);
+    sprintf(expName, TEST_DIR "%s-pcm.wav", name[i]);
+    if ((expBytes = ReadFile(expName, expected)) < 0) {
+      errors++;
+      continue;
+    }
+    for (t=0; t<sizeof(threads)/sizeof(threads[0]); t++) {
+      if (VSTestDecodeRecording(inName, TEST_OUT, threads[t]) ||
+          (gotBytes = ReadFile(TEST_OUT, got)) != expBytes ||
+          memcmp(got, expected, expBytes)) {
+        printf("%s: decoded file differs from %s, %d threads\n",
+               inName, expName, threads[t]);
+        errors++;
+      }
+    }
+  }
+  remove(TEST_OUT);
+}
+
+
+/*
+  Throughput, in input MB/s and output samples per second.
+*/
+
+static void Report(const char *name, double t, u_int32 bytes,
+                   u_int32 samples) {
+  printf("%-26s %8.1f MB/s %8.1f Msamples/s\n", name,
+         (double)bytes*BENCH_ROUNDS/t/1e6,
+         (double)samples*BENCH_ROUNDS/t/1e6);
+}
+
+static void Bench(void) {
+  static const int threads[] = {1, 2, 4, 0};
+  u_int8 *in = malloc(BENCH_BYTES);
+  s_int16 *out = malloc(2*BENCH_BYTES*sizeof(s_int16));
+  u_int32 blocks = BENCH_BYTES/2048, i, r;
+  char name[40];
+  double t;
+  int alaw;
+
+  for (i=0; i<BENCH_BYTES; i++) {
+    in[i] = (u_int8)Rnd();
+  }
+
+  for (alaw=0; alaw<2; alaw++) {
+    t = Now();
+    for (r=0; r<BENCH_ROUNDS; r++) {
+      HostG711Decode(out, in, BENCH_BYTES, alaw);
+    }
+    Report(alaw ? "HostG711Decode A-law" : "HostG711Decode u-law",
+           Now()-t, BENCH_BYTES, BENCH_BYTES);
+    t = Now();
+    for (r=0; r<BENCH_ROUNDS; r++) {
+      for (i=0; i<BENCH_BYTES; i++) {
+        out[i] = alaw ? RefAlaw(in[i]) : RefUlaw(in[i]);
+      }
+      __asm__ __volatile__("" : : : "memory");
+    }
+    Report(alaw ? "  reference A-law" : "  reference u-law",
+           Now()-t, BENCH_BYTES, BENCH_BYTES);
+  }
+
+  /* Stereo, blockAlign 2048: 2041 frames per block */
+  for (i=0; i<sizeof(threads)/sizeof(threads[0]); i++) {
+    t = Now();
+    for (r=0; r<BENCH_ROUNDS; r++) {
+      HostImaDecode(out, in, blocks, 2048, 2, threads[i]);
+    }
+    sprintf(name, threads[i] ? "HostImaDecode %d threads" :
+            "HostImaDecode all CPUs", threads[i]);
+    Report(name, Now()-t, BENCH_BYTES, blocks*2041*2);
+  }
+  t = Now();
+  for (r=0; r<BENCH_ROUNDS; r++) {
+    RefImaDecode(out, in, blocks, 2048, 2);
+  }
+  Report("  reference", Now()-t, BENCH_BYTES, blocks*2041*2);
+
+  free(in);
+  free(out);
+}
+
+
+int main(void) {
+  TestG711();
+  TestIma();
+  TestRecordings();
+  if (errors) {
+    printf("%d mismatches\n", errors);
+    return 1;
+  }
+  printf("All decoded samples bit-exact\n");
+  Bench();
+  return 0;
+}
@@ -0,0 +1,218 @@
+/*
+
+  VLSI Solution generic microcontroller example player / recorder for
+  VS1063: test for the recording meter.
+
+  Feeds recordings to MeterPut() in playermeter.c, both in one piece
+  and in chunks of odd numbers of samples, like SCI bursts of an odd
+  number of words, and checks that the published levels are the same.
+  The peak and RMS levels are also checked against levels computed
+  here sample by sample. Compile once with and once without the vector
+  instructions:
+
+    cc -O2 -mavx2 -DPLAYER_HOST metertest.c playermeter.c -lm
+    cc -O2 -DPLAYER_HOST metertest.c playermeter.c -lm
+
+  On 64-bit ARM, NEON is always enabled. Returns 0 if all levels match.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#ifndef PLAYER_HOST
+#define PLAYER_HOST
+#endif
+#include "player1063.h"
+
+#define TEST_RATE   48000
+#define TEST_FRAMES (TEST_RATE*21/20) /* A partial block at the end */
+#define MAX_BLOCKS  16
+
+struct Levels {
+  u_int32 sampleCounter;
+  s_int16 peak[2], rms[2], loudness;
+};
+
+static u_int8 rec[RIFF_HEADER_SIZE + 4*TEST_FRAMES];
+static struct Levels got[MAX_BLOCKS];
+static int blocks;
+
+static int errors = 0;
+
+
+/*
+  MeterPut() publishes the levels of each block through this, so it
+  replaces the one in playertelemetry.c.
+*/
+void TelemetryPublish(struct Telemetry *t) {
+  if (blocks < MAX_BLOCKS) {
+    got[blocks].sampleCounter = t->sampleCounter;
+    got[blocks].peak[0] = t->peakLeft;
+    got[blocks].peak[1] = t->peakRight;
+    got[blocks].rms[0] = t->rmsLeft;
+    got[blocks].rms[1] = t->rmsRight;
+    got[blocks].loudness = t->loudness;
+  }
+  blocks++;
+}
+
+
+static u_int32 rndState = 1234567U;
+
+static u_int32 Rnd(void) {
+  rndState ^= rndState << 13;
+  rndState ^= rndState >> 17;
+  rndState ^= rndState << 5;
+  return rndState;
+}
+
+
+/*
+  Makes a recording of frames: the left channel is noise of a different
+  level in each block, the right one is held at 1000 for the first
+  blocks, then noise with full scale samples mixed in.
+*/
+static void MakeRecording(int channels) {
+  u_int32 blockFrames = TEST_RATE * METER_BLOCK_MS / 1000;
+  u_int32 i, n = channels*TEST_FRAMES;
+
+  memset(rec, 0, RIFF_HEADER_SIZE);
+  for (i=0; i<n; i++) {
+    u_int32 b = i/channels/blockFrames;
+    s_int32 x;
+
+    if (channels == 1 || !(i & 1)) {
+      x = (s_int16)Rnd() >> (b % 8);
+    } else if (b < 4) {
+      x = 1000;
+    } else {
+      u_int32 r = Rnd();
+      x = ((r & 63) == 0) ? -32768 : ((r & 63) == 1) ? 32767 :
+        (s_int16)r >> 2;
+    }
+    rec[RIFF_HEADER_SIZE+2*i] = (u_int8)(x & 0xFF);
+    rec[RIFF_HEADER_SIZE+2*i+1] = (u_int8)((x >> 8) & 0xFF);
+  }
+}
+
+
+/*
+  Meters the recording in chunks of the given sizes, repeated, or in
+  one piece if chunks is 0. Returns the number of blocks published.
+*/
+static int Meter(u_int16 recMode, int channels, const u_int32 *chunk,
+                 int chunks) {
+  static struct Meter m;
+  struct Telemetry t;
+  u_int32 pos = 0, bytes = RIFF_HEADER_SIZE + 2*channels*TEST_FRAMES;
+  int k = 0;
+
+  memset(&t, 0, sizeof(t));
+  memset(got, 0, sizeof(got));
+  blocks = 0;
+  MeterInit(&m, recMode, TEST_RATE);
+  while (pos < bytes) {
+    u_int32 n = chunks ? min(chunk[k++ % chunks], bytes - pos) : bytes;
+
+    MeterPut(&m, rec+pos, n, &t);
+    pos += n;
+  }
+  return blocks;
+}
+
+
+static s_int16 RefDb(double power) {
+  double db = 100.0 * log10(power + 1e-30);
+
+  return (s_int16)((db < METER_FLOOR) ? METER_FLOOR : floor(db + 0.5));
+}
+
+/* Checks the peak and RMS levels of one-shot metering sample by sample */
+static void CheckLevels(int channels, int n) {
+  u_int32 blockFrames = TEST_RATE * METER_BLOCK_MS / 1000;
+  const u_int8 *d = rec + RIFF_HEADER_SIZE;
+  int b, c;
+
+  for (b=0; b<n; b++) {
+    for (c=0; c<channels; c++) {
+      double sumSq = 0.0;
+      u_int32 peak = 0, i;
+
+      for (i=0; i<blockFrames; i++) {
+        const u_int8 *p = d + 2*((b*blockFrames+i)*channels+c);
+        s_int32 x = (s_int16)(p[0] | (p[1] << 8));
+
+        sumSq += (double)x*x;
+        peak = max(peak, (u_int32)((x < 0) ? -x : x));
+      }
+      if (got[b].peak[c] != RefDb((double)peak*peak/(32768.0*32768.0)) ||
+          got[b].rms[c] != RefDb(sumSq/(32768.0*32768.0*blockFrames))) {
+        if (errors++ < 10) {
+          printf("%d channels, block %d, channel %d: peak %d, rms %d\n",
+                 channels, b, c, got[b].peak[c], got[b].rms[c]);
+        }
+      }
+    }
+  }
+}
+
+
+static void Test(u_int16 recMode, int channels) {
+  static const u_int32 pattern[][4] = {
+    {34}, {2}, {6}, {30, 34, 4, 1000}, {4098, 18}
+  };
+  static const int patterns[] = {1, 1, 1, 4, 2};
+  struct Levels oneShot[MAX_BLOCKS];
+  int n, p, i;
+
+  MakeRecording(channels);
+  n = Meter(recMode, channels, NULL, 0);
+  if (n != TEST_FRAMES / (TEST_RATE * METER_BLOCK_MS / 1000)) {
+    printf("%d channels: %d blocks\n", channels, n);
+    errors++;
+    return;
+  }
+  CheckLevels(channels, n);
+  if (channels == 2 && got[0].rms[1] != -303) {
+    printf("Right channel held at 1000: rms %d, should be -303\n",
+           got[0].rms[1]);
+    errors++;
+  }
+  memcpy(oneShot, got, sizeof(oneShot));
+
+  for (p=0; p<(int)(sizeof(patterns)/sizeof(patterns[0])); p++) {
+    if (Meter(recMode, channels, pattern[p], patterns[p]) != n ||
+        memcmp(got, oneShot, sizeof(oneShot))) {
+      i = 0;
+      while (i < n-1 && !memcmp(&got[i], &oneShot[i], sizeof(got[i]))) {
+        i++;
+      }
+      if (errors++ < 10) {
+        printf("%d channels, chunks of %lu bytes: block %d differs, "
+               "rms %d/%d, should be %d/%d\n", channels,
+               (unsigned long)pattern[p][0], i, got[i].rms[0],
+               got[i].rms[1], oneShot[i].rms[0], oneShot[i].rms[1]);
+      }
+    }
+  }
+}
+
+
+int main(void) {
+#if defined(__AVX2__)
+  printf("Vector kernels: AVX2\n");
+#elif defined(__ARM_NEON)
+  printf("Vector kernels: NEON\n");
+#else
+  printf("Vector kernels: none\n");
+#endif
+  Test(RM_63_FORMAT_PCM | RM_63_ADC_MODE_JOINT_AGC_STEREO, 2);
+  Test(RM_63_FORMAT_PCM | RM_63_ADC_MODE_MONO, 1);
+  if (errors) {
+    printf("%d mismatches\n", errors);
+    return 1;
+  }
+  printf("All levels match\n");
+  return 0;
+}
@@ -0,0 +1,303 @@
+/*
+
+  VLSI Solution generic microcontroller example player / recorder for
+  VS1063: test and benchmark for the PCM input sample conversions.
+
+  Checks that PcmFloatToS16(), PcmS32ToS16(), PcmS24ToS32() and
+  PcmInterleave() in playerpcmconv.c give exactly the same results as
+  plain C versions of the same conversions, then times both. Compile
+  once with and once without the vector instructions:
+
+    cc -O2 -mavx2 -DPCM_INPUT pcmbench.c playerpcmconv.c -lm
+    cc -O2 -DPCM_INPUT pcmbench.c playerpcmconv.c -lm
+
+  Without them the kernels run their scalar loops, so comparing the
+  kernel times of the two programs shows what the vector loops give.
+  On 64-bit ARM, NEON is always enabled. Returns 0 if all results match.
+
+*/
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#ifndef PCM_INPUT
+#define PCM_INPUT
+#endif
+#include "player1063.h"
+
+#define BENCH_SAMPLES   4096      /* Samples per call when timing */
+#define BENCH_TOTAL     100000000 /* Samples converted per timing */
+#define MAX_SAMPLES     (BENCH_SAMPLES+4) /* Room for unaligned offsets */
+
+static float fIn[MAX_SAMPLES], fDither[MAX_SAMPLES];
+static int32_t sIn[MAX_SAMPLES], sDither[MAX_SAMPLES];
+static u_int8 bIn[3*MAX_SAMPLES];
+static s_int16 left[MAX_SAMPLES], right[MAX_SAMPLES];
+static s_int16 out1[2*MAX_SAMPLES], out2[2*MAX_SAMPLES];
+static int32_t wide1[MAX_SAMPLES], wide2[MAX_SAMPLES];
+
+static int errors = 0;
+
+
+/*
+  Reference conversions. These are written from the definitions of the
+  conversions, not from the kernels, so they don't share their tricks.
+*/
+
+static s_int16 RefFloat(float in, float dither) {
+  float v = in*32768.0f + dither; // The product is exact
+  double r, frac;
+
+  if (isnan(v) || v <= -32768.0f) {
+    return -32768;
+  }
+  if (v >= 32767.0f) {
+    return 32767;
+  }
+  /* Round to nearest, ties to even */
+  r = floor(v);
+  frac = v - r;
+  if (frac > 0.5 || (frac == 0.5 && fmod(r, 2.0) != 0.0)) {
+    r += 1.0;
+  }
+  return (s_int16)r;
+}
+
+static int64_t FloorDiv(int64_t a, int64_t b) {
+  int64_t q = a / b;
+
+  return (q*b != a && a < 0) ? q-1 : q;
+}
+
+static void RefS32(s_int16 *out, const int32_t *in, u_int32 n,
+                   const int32_t *dither) {
+  u_int32 i;
+
+  for (i=0; i<n; i++) {
+    int64_t v = FloorDiv(FloorDiv(in[i], 2) + FloorDiv(dither[i], 2) +
+                         0x4000, 32768);
+
+    out[i] = (s_int16)((v > 32767) ? 32767 : (v < -32768) ? -32768 : v);
+  }
+}
+
+static void RefS24(int32_t *out, const u_int8 *in, u_int32 n) {
+  u_int32 i;
+
+  for (i=0; i<n; i++) {
+    int32_t v = in[3*i] | in[3*i+1] << 8 | in[3*i+2] << 16;
+
+    if (v >= 0x800000) {
+      v -= 0x1000000;
+    }
+    out[i] = v * 256;
+  }
+}
+
+static void RefInterleave(s_int16 *out, const s_int16 *l, const s_int16 *r,
+                          u_int32 n) {
+  u_int32 i;
+
+  for (i=0; i<n; i++) {
+    out[2*i] = l[i];
+    out[2*i+1] = r[i];
+  }
+}
+
+static void RefFloatToS16(s_int16 *out, const float *in, u_int32 n,
+                          const float *dither) {
+  u_int32 i;
+
+  for (i=0; i<n; i++) {
+    out[i] = RefFloat(in[i], dither[i]);
+  }
+}
+
+
+/*
+  Test data: random samples and dither, with edge cases sprinkled in.
+*/
+
+static u_int32 rndState = 12345;
+
+static u_int32 Rnd(void) {
+  rndState ^= rndState << 13;
+  rndState ^= rndState >> 17;
+  rndState ^= rndState << 5;
+  return rndState;
+}
+
+static void MakeData(void) {
+  static const float fEdge[] = {
+    1.0f, -1.0f, 0.0f, -0.0f, 1.5f, -1.5f, 1e30f, -1e30f,
+    0.5f/32768, 1.5f/32768, 2.5f/32768, -0.5f/32768, -1.5f/32768,
+    32767.5f/32768, -32768.5f/32768, 32766.5f/32768
+  };
+  static const int32_t sEdge[] = {
+    INT32_MAX, INT32_MIN, INT32_MAX-1, INT32_MIN+1, 0, -1, 1,
+    0x7FFF8000, -0x7FFF8000, 0x4000, -0x4000, 0xC000, -0xC000
+  };
+  u_int32 i;
+
+  for (i=0; i<MAX_SAMPLES; i++) {
+    u_int32 r = Rnd();
+
+    switch (r & 7) {
+    case 0:
+      fIn[i] = fEdge[(r >> 3) % (sizeof(fEdge)/sizeof(fEdge[0]))];
+      break;
+    case 1:
+      fIn[i] = (float)((int)(Rnd() & 0x1FFFF) - 0x10000) / 65536; // Ties
+      break;
+    case 2:
+      fIn[i] = (r & 8) ? NAN : ((r & 16) ? INFINITY : -INFINITY);
+      break;
+    default:
+      fIn[i] = (float)((int32_t)Rnd()) / 1.5e9f;
+      break;
+    }
+    switch ((r >> 8) & 3) {
+    case 0:
+      fDither[i] = 0.0f;
+      break;
+    case 1:
+      fDither[i] = (r & 0x1000) ? 1.0f : -1.0f;
+      break;
+    default:
+      fDither[i] = (float)((int32_t)Rnd()) / 2147483648.0f;
+      break;
+    }
+
+    sIn[i] = ((r >> 12) & 3) ? (int32_t)Rnd() :
+      sEdge[(r >> 14) % (sizeof(sEdge)/sizeof(sEdge[0]))];
+    sDither[i] = ((r >> 20) & 1) ? (int32_t)(fDither[i] * 65535.0f) :
+      ((r & 0x200000) ? 65535 : -65535);
+
+    bIn[3*i] = (u_int8)Rnd();
+    bIn[3*i+1] = (u_int8)Rnd();
+    bIn[3*i+2] = (u_int8)((r & 0x400000) ? 0x80 : Rnd());
+    left[i] = (s_int16)Rnd();
+    right[i] = (s_int16)Rnd();
+  }
+}
+
+
+/*
+  Bit-exactness. Every length up to a few vector widths is tried, with
+  the data starting at all small offsets, so that the vector loops, the
+  scalar tails and unaligned accesses are all covered.
+*/
+
+static void Check(const char *name, const void *a, const void *b,
+                  size_t bytes, u_int32 n, u_int32 off) {
+  if (memcmp(a, b, bytes)) {
+    if (errors++ < 10) {
+      printf("%s: mismatch with n %lu, offset %lu\n",
+             name, (unsigned long)n, (unsigned long)off);
+    }
+  }
+}
+
+static void TestExact(void) {
+  static const u_int32 big[] = {255, 1000, 1023, 1025, BENCH_SAMPLES};
+  u_int32 n, off, k;
+
+  for (k=0; k<70+sizeof(big)/sizeof(big[0]); k++) {
+    n = (k < 70) ? k : big[k-70];
+    for (off=0; off<4; off++) {
+      memset(out1, 0x55, sizeof(out1));
+      memset(out2, 0x55, sizeof(out2));
+      PcmFloatToS16(out1, fIn+off, n, fDither+off);
+      RefFloatToS16(out2, fIn+off, n, fDither+off);
+      Check("PcmFloatToS16", out1, out2, sizeof(out1), n, off);
+
+      memset(out1, 0x55, sizeof(out1));
+      memset(out2, 0x55, sizeof(out2));
+      PcmS32ToS16(out1, sIn+off, n, sDither+off);
+      RefS32(out2, sIn+off, n, sDither+off);
+      Check("PcmS32ToS16", out1, out2, sizeof(out1), n, off);
+
+      memset(wide1, 0x55, sizeof(wide1));
+      memset(wide2, 0x55, sizeof(wide2));
+      PcmS24ToS32(wide1, bIn+off, n);
+      RefS24(wide2, bIn+off, n);
+      Check("PcmS24ToS32", wide1, wide2, sizeof(wide1), n, off);
+
+      memset(out1, 0x55, sizeof(out1));
+      memset(out2, 0x55, sizeof(out2));
+      PcmInterleave(out1, left+off, right+off, n);
+      RefInterleave(out2, left+off, right+off, n);
+      Check("PcmInterleave", out1, out2, sizeof(out1), n, off);
+    }
+  }
+}
+
+
+/*
+  Timing. Each conversion is run over BENCH_SAMPLES samples, which fit
+  in the cache, until BENCH_TOTAL samples have been converted.
+*/
+
+static double Now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define TIME(t, call) do {                                      \
+    u_int32 done_;                                              \
+    double start_ = Now();                                      \
+    for (done_=0; done_<BENCH_TOTAL; done_ += BENCH_SAMPLES) {  \
+      call;                                                     \
+      __asm__ __volatile__("" : : : "memory");                  \
+    }                                                           \
+    t = (Now() - start_) * 1e9 / BENCH_TOTAL;                   \
+  } while (0)
+
+static void Report(const char *name, double kernel, double ref) {
+  printf("%-14s %7.3f ns/sample, reference %7.3f ns/sample, %5.2fx\n",
+         name, kernel, ref, ref/kernel);
+}
+
+static void Bench(void) {
+  double t1, t2;
+
+  TIME(t1, PcmFloatToS16(out1, fIn, BENCH_SAMPLES, fDither));
+  TIME(t2, RefFloatToS16(out2, fIn, BENCH_SAMPLES, fDither));
+  Report("PcmFloatToS16", t1, t2);
+  TIME(t1, PcmS32ToS16(out1, sIn, BENCH_SAMPLES, sDither));
+  TIME(t2, RefS32(out2, sIn, BENCH_SAMPLES, sDither));
+  Report("PcmS32ToS16", t1, t2);
+  TIME(t1, PcmS24ToS32(wide1, bIn, BENCH_SAMPLES));
+  TIME(t2, RefS24(wide2, bIn, BENCH_SAMPLES));
+  Report("PcmS24ToS32", t1, t2);
+  TIME(t1, PcmInterleave(out1, left, right, BENCH_SAMPLES));
+  TIME(t2, RefInterleave(out2, left, right, BENCH_SAMPLES));
+  Report("PcmInterleave", t1, t2);
+}
+
+
+int main(void) {
+#if defined(__AVX2__)
+  printf("Vector kernels: AVX2\n");
+#elif defined(__SSSE3__)
+  printf("Vector kernels: SSSE3, 24-bit expansion only\n");
+#elif defined(__ARM_NEON)
+  printf("Vector kernels: NEON\n");
+#else
+  printf("Vector kernels: none\n");
+#endif
+  MakeData();
+  TestExact();
+  if (errors) {
+    printf("%d mismatches\n", errors);
+    return 1;
+  }
+  printf("All conversions bit-exact\n");
+  Bench();
+  return 0;
+}
@@ -13,15 +13,131 @@
 
 #include "vs10xx_uc.h"
 
+/* One segment of a WriteSdiv() gather list. If data is NULL, the
+   segment consists of bytes copies of the fill byte. */
+struct SdiSegment {
+  const u_int8 *data;
+  u_int32 bytes;
+  u_int8 fill;
+};
+
+/* A packet of recorded data: an Ogg page, an MP3 frame, or RIFF WAV
+   blocks. samplePos is the position after the packet in samples, and
+   wraps around. readTime is GetMicroseconds() when the last byte was
+   read. Header packets are needed before any other packets. */
+struct RecordPacket {
+  const u_int8 *data;
+  u_int32 bytes;
+  u_int32 samplePos;
+  u_int32 sampleRate;
+  u_int32 readTime;
+  int header;
+};
+
+/* Sample formats for VSTestPcmWrite(). pcmS24 is packed little-endian,
+   the others are in host byte order. pcmFloat is full scale at +-1.0. */
+enum PcmFormat {
+  pcmS16,
+  pcmS24,
+  pcmS32,
+  pcmFloat,
+};
+
+typedef void RecordPacketFunc(const struct RecordPacket *p, void *arg);
+
+/* Snapshot of VS10xx state, see VSTestGetTelemetry(). time is
+   GetMicroseconds() when the snapshot was taken, and count tells how
+   many snapshots have been taken. positionMsec is 0xFFFFFFFF if not
+   known. sdiFree is in bytes and audioFill in stereo samples.
+   peak and rms levels (0.1 dBFS) and short-term loudness (0.1 LUFS)
+   are measured by the host from PCM recordings, see RECORD_METER in
+   player1063.h. Then only the levels, sampleRate, channels and
+   sampleCounter are set. Otherwise the levels are TELEMETRY_NO_LEVEL. */
+#define TELEMETRY_NO_LEVEL (-32768)
+
+struct Telemetry {
+  u_int32 time;
+  u_int32 count;
+  u_int32 sampleCounter;
+  u_int32 positionMsec;
+  u_int32 bitRate;      /* bits/s */
+  u_int16 sampleRate;
+  u_int16 channels;
+  u_int16 decodeTime;   /* seconds */
+  u_int16 mode;
+  u_int16 status;
+  u_int16 hdat0;        /* 0 when recording */
+  u_int16 hdat1;
+  u_int16 config1;
+  u_int16 playSpeed;
+  u_int16 playMode;
+  u_int16 endFillByte;
+  u_int16 sdiFree;
+  u_int16 audioFill;
+  u_int8 vuLeft;        /* dB, if PAR_PLAY_MODE_VU_METER_ENA is set */
+  u_int8 vuRight;
+  s_int16 peakLeft;
+  s_int16 peakRight;
+  s_int16 rmsLeft;
+  s_int16 rmsRight;
+  s_int16 loudness;
+};
+
+/* Commands for PostPlayerCommand(). Redundant commands are merged
+   before they are applied. */
+enum PlayerCommand {
+  pcVolume,     /* arg: change in attenuation, in -0.5 dB steps */
+  pcPause,      /* arg: 0 = resume, 1 = pause, -1 = toggle */
+  pcSpeedShift, /* arg: change in 1/16384 steps, 0 = SpeedShifter off */
+  pcRateTune,   /* arg: samplerate fine tuning in ppm */
+  pcEq,         /* arg: SCI_BASS value */
+  pcCancel,     /* arg: not used */
+  pcSeek,       /* arg: file position in bytes */
+  pcSplit,      /* arg: not used, starts a new recording segment */
+  pcMix         /* arg: cached sound to mix, -1 = stop mixing */
+};
+
 int VSTestInitHardware(void);
 int VSTestInitSoftware(void);
 int VSTestHandleFile(const char *fileName, int record);
+int VSTestHandleFileRt(const char *fileName, int record, int cpu,
+                       int priority); /* Requires PLAYER_HOST */
+int VSTestSetEncoderProfile(const char *name);
+int VSTestHandleDuplex(const char *playName, const char *recName,
+                       const char *profileName, int aec);
+void VSTestSetRecordPacketHandler(RecordPacketFunc *func, void *arg);
+int VSTestAddRecordSink(int fd); /* Requires PLAYER_HOST */
+int VSTestRecordSegments(const char *namePattern, u_int32 maxBytes,
+                         u_int32 maxSeconds); /* Requires PLAYER_HOST
+                                                 and RECORD_HOST_RIFF */
+int PostPlayerCommand(int cmd, s_int32 arg);
+int VSTestGetTelemetry(struct Telemetry *t);
+void VSTestSetTelemetryInterval(u_int32 us);
+void VSTestSetRateControl(u_int32 targetMs); /* Requires PLAYER_HOST */
+/* Require PCM_MIXER */
+int VSTestAddSound(const s_int16 *pcm, u_int32 samples, u_int16 rate);
+int VSTestLoadSound(const char *fileName);
+void VSTestSetMixerVolume(int attenuation);
+int VSTestPlaySound(int id); /* Also requires PLAYER_HOST */
+/* Require PCM_INPUT */
+int VSTestPcmStart(u_int16 sampleRate, int channels, int dither);
+int VSTestPcmWrite(const void *left, const void *right, u_int32 frames,
+                   int format);
+int VSTestPcmEnd(void);
+int VSTestDecodeRecording(const char *inName, const char *outName,
+                          int threads); /* Requires PLAYER_HOST */
 
 void WriteSci(u_int8 addr, u_int16 data);
 u_int16 ReadSci(u_int8 addr);
+void ReadSciBurst(u_int8 addr, u_int8 *data, u_int16 words);
+void WordsToBigEndian(u_int8 *data, u_int32 words);
+void WriteSciBurst(u_int8 addr, const u_int16 *data, u_int16 words);
+void SetSpiSpeed(u_int32 hz);
 int WriteSdi(const u_int8 *data, u_int8 bytes);
+int WriteSdiv(const struct SdiSegment *seg, int segments);
 void SaveUIState(void);
 void RestoreUIState(void);
 int GetUICommand(void);
+u_int32 GetMicroseconds(void);
 
 #endif
@@ -14,60 +14,14 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
-#include "player.h"
+#include "player1063.h"
 /* Download the latest VS1063a Patches package and its vs1063a-patches.plg.
    The patches package is available at
    http://www.vlsi.fi/en/support/software/vs10xxpatches.html */
 #include "vs1063a-patches.plg"
 
-#define FILE_BUFFER_SIZE 512
-#define SDI_MAX_TRANSFER_SIZE 32
-#define SDI_END_FILL_BYTES_FLAC 12288
-#define SDI_END_FILL_BYTES       2050
-#define REC_BUFFER_SIZE 512
 
-
-#define SPEED_SHIFT_CHANGE 128
-
-/* How many transferred bytes between collecting data.
-   A value between 1-8 KiB is typically a good value.
-   If REPORT_ON_SCREEN is defined, a report is given on screen each time
-   data is collected. */
-#define REPORT_INTERVAL 4096
-#if 1
-#define REPORT_ON_SCREEN
-#endif
-
-/* Define PLAYER_USER_INTERFACE if you want to have a user interface in your
-   player. */
-#if 1
-#define PLAYER_USER_INTERFACE
-#endif
-
-/* Define RECORDER_USER_INTERFACE if you want to have a user interface in your
-   player. */
-#if 1
-#define RECORDER_USER_INTERFACE
-#endif
-
-
-#define min(a,b) (((a)<(b))?(a):(b))
-
-
-
-enum AudioFormat {
-  afUnknown,
-  afRiff,
-  afOggVorbis,
-  afMp1,
-  afMp2,
-  afMp3,
-  afAacMp4,
-  afAacAdts,
-  afAacAdif,
-  afFlac,
-  afWma,
-} audioFormat = afUnknown;
+enum AudioFormat audioFormat = afUnknown;
 
 const char *afName[] = {
   "unknown",
@@ -84,6 +38,16 @@ const char *afName[] = {
 };
 
 
+/*
+  Combines a 32-bit increasing counter from its LSB and its MSB read
+  both before and after the LSB. If the LSB is small, it may just
+  have wrapped around, and the MSB read after it is the right one.
+*/
+u_int32 Counter32(u_int16 msbBefore, u_int16 lsb, u_int16 msbAfter) {
+  return ((u_int32)(lsb < 0x8000U ? msbAfter : msbBefore) << 16) | lsb;
+}
+
+
 /*
   Read 32-bit increasing counter value from addr.
   Because the 32-bit value can change while reading it,
@@ -91,19 +55,14 @@ const char *afName[] = {
 */
 u_int32 ReadVS10xxMem32Counter(u_int16 addr) {
   u_int16 msbV1, lsb, msbV2;
-  u_int32 res;
 
   WriteSci(SCI_WRAMADDR, addr+1);
   msbV1 = ReadSci(SCI_WRAM);
   WriteSci(SCI_WRAMADDR, addr);
   lsb = ReadSci(SCI_WRAM);
   msbV2 = ReadSci(SCI_WRAM);
-  if (lsb < 0x8000U) {
-    msbV1 = msbV2;
-  }
-  res = ((u_int32)msbV1 << 16) | lsb;
-  
-  return res;
+
+  return Counter32(msbV1, lsb, msbV2);
 }
 
 
@@ -145,56 +104,1466 @@ void WriteVS10xxMem32(u_int16 addr, u_int32 data) {
 }
 
 
+/* Define HAVE_WRITE_SDIV if your SDI transport provides its own
+   WriteSdiv(), e.g. one that builds DMA descriptor chains directly
+   from the segment list. */
+#ifndef HAVE_WRITE_SDIV
+/*
+  Write a list of segments to SDI.
+
+  Segments can be of any size. They are cut into transfers of
+  SDI_MAX_TRANSFER_SIZE bytes, which is what VS10xx is guaranteed to
+  accept each time DREQ is high. Full transfers are sent directly from
+  the caller's memory; only the few bytes that straddle a segment
+  boundary are gathered through a small staging buffer.
+  Returns 0 on success, or the first non-zero value from WriteSdi().
+*/
+int WriteSdiv(const struct SdiSegment *seg, int segments) {
+  u_int8 stage[SDI_MAX_TRANSFER_SIZE];
+  u_int8 fillBuf[SDI_MAX_TRANSFER_SIZE];
+  int staged = 0;
+  int res;
+
+  while (segments-- > 0) {
+    const u_int8 *p = seg->data;
+    u_int32 left = seg->bytes;
+    int step = SDI_MAX_TRANSFER_SIZE;
+
+    if (!p) {                   /* Fill segment, don't advance pointer */
+      memset(fillBuf, seg->fill, sizeof(fillBuf));
+      p = fillBuf;
+      step = 0;
+    }
+    seg++;
+
+    /* Complete a transfer left over from the previous segment */
+    if (staged && left) {
+      int t = min((u_int32)(SDI_MAX_TRANSFER_SIZE-staged), left);
+      memcpy(stage+staged, p, t);
+      staged += t;
+      left -= t;
+      if (step) {
+        p += t;
+      }
+      if (staged < SDI_MAX_TRANSFER_SIZE) {
+        continue;
+      }
+      if ((res = WriteSdi(stage, SDI_MAX_TRANSFER_SIZE)) != 0) {
+        return res;
+      }
+      staged = 0;
+    }
+
+    while (left >= SDI_MAX_TRANSFER_SIZE) {
+      if ((res = WriteSdi(p, SDI_MAX_TRANSFER_SIZE)) != 0) {
+        return res;
+      }
+      p += step;
+      left -= SDI_MAX_TRANSFER_SIZE;
+    }
+
+    if (left) {
+      memcpy(stage, p, left);
+      staged = left;
+    }
+  }
+
+  if (staged) {
+    return WriteSdi(stage, staged);
+  }
+  return 0;
+}
+#endif /* !HAVE_WRITE_SDIV */
+
+
+/* Define HAVE_READ_SCI_BURST if your SCI transport provides its own
+   ReadSciBurst(), e.g. one that queues all the read frames back to
+   back into a single SPI / DMA transaction. If it receives the words in
+   host byte order, it can convert them with WordsToBigEndian(). */
+#ifndef HAVE_READ_SCI_BURST
+/*
+  Read words 16-bit values from the same SCI register into data. The
+  values are stored most significant byte first, which is the order in
+  which they come from the SCI bus, so a DMA-based implementation can
+  receive them straight into data. This is the byte order of recorded
+  data, too.
+
+  This default implementation does one ReadSci() per word. Like a DMA
+  transfer with 16-bit SPI frames, it lands the words in data in host
+  byte order, and WordsToBigEndian() then converts the whole burst.
+*/
+void ReadSciBurst(u_int8 addr, u_int8 *data, u_int16 words) {
+  u_int16 i;
+
+  for (i=0; i<words; i++) {
+    u_int16 w = ReadSci(addr);
+    memcpy(data+2*i, &w, 2);
+  }
+  WordsToBigEndian(data, words);
+}
+#endif /* !HAVE_READ_SCI_BURST */
+
+
+/* Define HAVE_WRITE_SCI_BURST if your SCI transport provides its own
+   WriteSciBurst(). */
+#ifndef HAVE_WRITE_SCI_BURST
+/*
+  Write words 16-bit values from data to the same SCI register.
+*/
+void WriteSciBurst(u_int8 addr, const u_int16 *data, u_int16 words) {
+  while (words--) {
+    WriteSci(addr, *data++);
+  }
+}
+#endif /* !HAVE_WRITE_SCI_BURST */
+
+
+/* Define HAVE_SET_SPI_SPEED if your SPI driver can change its clock.
+   SetSpiSpeed(0) returns to the speed used before the first call. */
+#ifndef HAVE_SET_SPI_SPEED
+void SetSpiSpeed(u_int32 hz) {
+  /* Fixed speed */
+  (void)hz;
+}
+#endif /* !HAVE_SET_SPI_SPEED */
+
+
+
+
+
+
+/*
+
+  Loads a plugin.
+
+  This is a slight modification of the LoadUserCode() example
+  provided in many of VLSI Solution's program packages.
+
+*/
+void LoadPlugin(const u_int16 *d, u_int16 len) {
+  int i = 0;
+
+  while (i<len) {
+    unsigned short addr, n, val;
+    addr = d[i++];
+    n = d[i++];
+    if (n & 0x8000U) { /* RLE run, replicate n samples */
+      n &= 0x7FFF;
+      val = d[i++];
+      while (n--) {
+        WriteSci(addr, val);
+      }
+    } else {           /* Copy run, copy n samples */
+      while (n--) {
+        val = d[i++];
+        WriteSci(addr, val);
+      }
+    }
+  }
+}
+
+
+
+
+
+
+
+
+
+enum PlayerStates playerState;
+
+int rtMode = 0;
+
+#ifdef PLAYER_HOST
+/* Set when the file being played is read by the prefetch thread */
+int rtReader = 0;
+#endif
+
+
+/*
+  File input for the player. When VSTestHandleFileRt() has started the
+  prefetch thread, data comes from its ring, so that the real-time
+  thread never waits for storage. Returns the number of bytes read,
+  0 if no data is available yet, or -1 at the end of the file.
+*/
+long PlayerRead(FILE *fp, u_int8 *buf, u_int32 bytes) {
+  size_t n;
+
+#ifdef PLAYER_HOST
+  if (rtReader) {
+    return HostReaderRead(buf, bytes);
+  }
+#endif
+  n = fread(buf, 1, bytes, fp);
+  return n ? (long)n : -1;
+}
+
+
+/*
+  Moves the read position of the player to pos. Returns 0 on success.
+*/
+int PlayerSeek(FILE *fp, long pos) {
+#ifdef PLAYER_HOST
+  if (rtReader) {
+    return HostReaderSeek(pos);
+  }
+#endif
+  return fseek(fp, pos, SEEK_SET);
+}
+
+
+#ifdef RATE_CONTROL
+/*
+  Returns how many bytes of the input have been queued but not yet
+  read by the player, or -1 if that is not known.
+*/
+long PlayerQueued(FILE *fp) {
+  if (rtReader) {
+    return HostReaderQueued();
+  }
+  return HostInputQueued(fp);
+}
+#endif
+
+
+
+
+/*
+
+  Host-side fast forward.
+
+  With playSpeed VS10xx skips frames by itself, but it still needs to
+  be sent all data. For MPEG audio (MP1, MP2, MP3) and AAC ADTS streams,
+  frame boundaries are easy to find from the host, so we can instead
+  drop the frames that would not be played, and send only those that
+  will be, cutting SDI traffic in proportion to the speed.
+
+  Layer III frames may borrow data from earlier frames (bit reservoir),
+  so frames are sent in runs of FF_KEEP_FRAMES_L3. The first frame in a
+  run may not decode correctly, but the second one will.
+
+  After losing sync, a frame is only sent when two consecutive frame
+  headers with the same fixed fields have been found.
+
+*/
+#define FF_HEADER_BYTES    7 /* Enough for both MPEG audio and ADTS headers */
+#define FF_KEEP_FRAMES     1
+#define FF_KEEP_FRAMES_L3  2
+#define FF_MAX_SPEED      16
+
+struct FastForward {
+  u_int32 speed;        // 1 = off, otherwise 2, 4, 8 or 16
+  u_int32 frame;        // Frame counter, used to select sent frames
+  u_int32 left;         // Bytes left in current frame
+  int sendFrame;        // Current frame is sent (1) or dropped (0)
+  int locked;           // 0 = no sync, 1 = candidate found, 2 = in sync
+  u_int16 key;          // Fixed header fields of the stream in sync
+  u_int8 hdr[FF_HEADER_BYTES]; // Header bytes carried between blocks
+  int hdrBytes;
+  u_int32 skippedMs;    // Duration of all dropped frames
+  u_int32 msRemainder;  // Fraction of a millisecond, in samples*1000
+};
+
+static const u_int16 mpegBitRate[2][3][16] = {
+  { /* MPEG 1: layer I, II, III */
+    {0,32,64,96,128,160,192,224,256,288,320,352,384,416,448,0},
+    {0,32,48,56, 64, 80, 96,112,128,160,192,224,256,320,384,0},
+    {0,32,40,48, 56, 64, 80, 96,112,128,160,192,224,256,320,0}
+  }, { /* MPEG 2 and 2.5: layer I, II, III */
+    {0,32,48,56, 64, 80, 96,112,128,144,160,176,192,224,256,0},
+    {0, 8,16,24, 32, 40, 48, 56, 64, 80, 96,112,128,144,160,0},
+    {0, 8,16,24, 32, 40, 48, 56, 64, 80, 96,112,128,144,160,0}
+  }
+};
+
+static const u_int16 mpegSampleRate[3] = {44100, 48000, 32000};
+
+static const u_int32 adtsSampleRate[16] = {
+  96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050,
+  16000, 12000, 11025,  8000,  7350,     0,     0,     0
+};
+
+
+/*
+  Parses an MPEG audio or ADTS frame header. Returns frame length in
+  bytes, or 0 if the header is not valid. Fills in the number of samples
+  in the frame, the samplerate, how many frames to send at a time, and
+  the fixed header fields that must not change within a stream.
+*/
+u_int32 FastForwardParseHeader(const u_int8 *h, u_int32 *samples,
+                               u_int32 *rate, u_int32 *keep, u_int16 *key) {
+  if (h[0] != 0xFF || (h[1] & 0xE0) != 0xE0) {
+    return 0;
+  }
+
+  if ((h[1] & 0xF6) == 0xF0) {
+    /* ADTS: 12-bit sync, layer 0 */
+    u_int32 len = ((u_int32)(h[3] & 3) << 11) | (h[4] << 3) | (h[5] >> 5);
+    if (!(*rate = adtsSampleRate[(h[2] >> 2) & 15]) || len < FF_HEADER_BYTES) {
+      return 0;
+    }
+    *samples = 1024 * ((h[6] & 3) + 1);
+    *keep = FF_KEEP_FRAMES;
+    *key = ((h[1] & 0xF6) << 8) | (h[2] & 0xFC);
+    return len;
+  } else {
+    /* MPEG audio: 11-bit sync, version 2.5 (0), 2 (2) or 1 (3) */
+    int ver = (h[1] >> 3) & 3;
+    int layer = 4 - ((h[1] >> 1) & 3);  // 1, 2, 3, or 4 (invalid)
+    int brIdx = h[2] >> 4;
+    int srIdx = (h[2] >> 2) & 3;
+    int pad = (h[2] >> 1) & 1;
+    u_int32 br;
+
+    if (ver == 1 || layer > 3 || !brIdx || brIdx == 15 || srIdx == 3) {
+      return 0;
+    }
+    br = 1000UL * mpegBitRate[ver != 3][layer-1][brIdx];
+    *rate = mpegSampleRate[srIdx] >> (ver == 3 ? 0 : (ver == 2 ? 1 : 2));
+    *keep = (layer == 3) ? FF_KEEP_FRAMES_L3 : FF_KEEP_FRAMES;
+    *key = ((h[1] & 0xFE) << 8) | (h[2] & 0x0C);
+    if (layer == 1) {
+      *samples = 384;
+      return (12 * br / *rate + pad) * 4;
+    }
+    *samples = (layer == 3 && ver != 3) ? 576 : 1152;
+    return *samples / 8 * br / *rate + pad;
+  }
+}
+
+
+/*
+  Starts a new frame at h, or returns 0 if there is no valid frame
+  header there.
+*/
+int FastForwardNextFrame(struct FastForward *ff, const u_int8 *h) {
+  u_int32 samples, rate;
+  u_int32 keep;
+  u_int16 key;
+  u_int32 len = FastForwardParseHeader(h, &samples, &rate, &keep, &key);
+
+  if (!len || (ff->locked && key != ff->key)) {
+    ff->locked = 0;
+    return 0;
+  }
+
+  if (ff->locked) {
+    ff->locked = 2;
+    ff->sendFrame = (ff->frame++ % (ff->speed*keep)) < keep;
+  } else {
+    ff->locked = 1;
+    ff->key = key;
+    ff->sendFrame = 0;
+  }
+
+  if (!ff->sendFrame) {
+    ff->msRemainder += samples * 1000;
+    ff->skippedMs += ff->msRemainder / rate;
+    ff->msRemainder %= rate;
+  }
+  ff->left = len;
+  return 1;
+}
+
+
+/*
+  Filters a block of data in place so that only the frames to be played
+  remain. There must be FF_HEADER_BYTES of free space before *data,
+  because header bytes carried over from the previous block are put
+  there. Updates *data and returns the number of bytes to send.
+  When speed has been set back to 1, the current frame is finished
+  before everything is let through again.
+*/
+u_int32 FastForwardFilter(struct FastForward *ff, u_int8 **data,
+                          u_int32 bytes) {
+  u_int8 *p = *data - ff->hdrBytes;
+  u_int8 *end = *data + bytes;
+  u_int8 *o = p;
+
+  memcpy(p, ff->hdr, ff->hdrBytes);
+  ff->hdrBytes = 0;
+  *data = o;
+
+  while (p < end) {
+    if (ff->left) {
+      u_int32 t = min(ff->left, (u_int32)(end-p));
+      if (ff->sendFrame) {
+        memmove(o, p, t);
+        o += t;
+      }
+      p += t;
+      ff->left -= t;
+    } else if (ff->speed <= 1) {
+      memmove(o, p, end-p);
+      o += end-p;
+      p = end;
+    } else if (end-p < FF_HEADER_BYTES) {
+      ff->hdrBytes = end-p;
+      memcpy(ff->hdr, p, ff->hdrBytes);
+      p = end;
+    } else if (!FastForwardNextFrame(ff, p)) {
+      p++;                      // Resync, drop a byte at a time
+    }
+  }
+
+  return o - *data;
+}
+
+
+/*
+  Returns play position in milliseconds at the time of snapshot t.
+  positionMsec is only known for some formats. For others, it is
+  estimated from DECODE_TIME and the amount of audio skipped by
+  host-side fast forward.
+*/
+u_int32 PlayPositionMsec(const struct FastForward *ff,
+                         const struct Telemetry *t) {
+  u_int32 msec = t->positionMsec;
+
+  if (msec == 0xFFFFFFFFU) {
+    msec = t->decodeTime*1000UL + ff->skippedMs;
+  }
+  return msec;
+}
+
+
+
+
+
+/*
+
+  SDI feeder scheduling.
+
+  Without FEEDER_TICKLESS data is sent in SDI_MAX_TRANSFER_SIZE pieces
+  and WriteSdi() waits for DREQ before each of them.
+
+  With FEEDER_TICKLESS, the feeder keeps track of how much VS10xx can
+  take (credit). When that runs out, the consumption rate is estimated
+  from bitRatePer100 and the time until sdiFree reaches
+  FEEDER_REFILL_BYTES is slept on a timer. Then all of the free space
+  is filled in one burst. If the bitrate is not known yet, we fall
+  back to DREQ polling.
+
+  Every time the feeder checks sdiFree, it also reads audioFill. A
+  true underrun is when the audio buffer has run dry while the SDI
+  FIFO is empty, too: VS10xx had nothing left to play. Then the feeder
+  doubles how much it reads from the file at a time, in case storage
+  was too slow, and halves refillBytes, so that it wakes up earlier
+  and keeps the FIFO fuller, in case it slept too long. When there has
+  been no underrun for FEEDER_RELAX_TIME and the FIFO has stayed at
+  least half full, both are taken one step back.
+
+  struct Feeder is in player1063.h, as the PCM input uses it too.
+
+*/
+void FeederInit(struct Feeder *f) {
+  memset(f, 0, sizeof(*f));
+  f->speed = 1;
+  f->startTime = GetMicroseconds();
+#ifdef PLAYER_HOST
+  f->startCpu = HostCpuMicroseconds();
+#endif
+  f->readAhead = FILE_BUFFER_SIZE;
+  f->refillBytes = FEEDER_REFILL_BYTES;
+  f->minSdiFill = f->minAudioFill = f->windowMin = 0xFFFFFFFFU;
+  f->windowStart = f->startTime;
+}
+
+
+/*
+  Reads sdiFree and audioFill in one go, counts underruns, and adapts
+  read-ahead and refill level. Returns sdiFree in bytes.
+*/
+u_int32 FeederSample(struct Feeder *f) {
+  u_int32 sdiFree, audioFill, sdiFill, now;
+
+  WriteSci(SCI_WRAMADDR, REG_READ_ADDR(REG_PAR_SDI_FREE));
+  sdiFree = 2*ReadSci(SCI_WRAM);
+  audioFill = ReadSci(SCI_WRAM);        // PAR_AUDIO_FILL follows
+  f->unsampled = 0;
+
+  if (sdiFree > f->sdiSize) {
+    f->sdiSize = sdiFree;
+  }
+  if (audioFill && !f->started) {
+    f->started = 1;
+  }
+  if (f->started <= 0) {
+    return sdiFree;             // Not playing, nothing to measure
+  }
+
+  sdiFill = f->sdiSize - sdiFree;
+  if (sdiFill < f->minSdiFill) {
+    f->minSdiFill = sdiFill;
+  }
+  if (sdiFill < f->windowMin) {
+    f->windowMin = sdiFill;
+  }
+  if (audioFill < f->minAudioFill) {
+    f->minAudioFill = audioFill;
+  }
+
+  now = GetMicroseconds();
+  if (!audioFill && !sdiFill) {
+    if (!f->starving) {
+      f->starving = 1;
+      f->underruns++;
+      f->readAhead = min(2*f->readAhead, FEEDER_READAHEAD_MAX);
+      f->refillBytes /= 2;
+      if (f->refillBytes < FEEDER_REFILL_MIN) {
+        f->refillBytes = FEEDER_REFILL_MIN;
+      }
+      f->windowStart = now;
+      f->windowMin = 0xFFFFFFFFU;
+    }
+  } else {
+    f->starving = 0;
+  }
+
+  if (now - f->windowStart >= FEEDER_RELAX_TIME) {
+    if (f->windowMin >= f->sdiSize/2) {
+      f->refillBytes = min(2*f->refillBytes, FEEDER_REFILL_BYTES);
+      f->readAhead /= 2;
+      if (f->readAhead < FILE_BUFFER_SIZE) {
+        f->readAhead = FILE_BUFFER_SIZE;
+      }
+    }
+    f->windowStart = now;
+    f->windowMin = 0xFFFFFFFFU;
+  }
+
+  return sdiFree;
+}
+
+
+/*
+  Returns how many bytes, at most maxBytes, to send next.
+*/
+u_int32 FeederBurst(struct Feeder *f, u_int32 maxBytes) {
+#ifdef FEEDER_TICKLESS
+  u_int32 t;
+
+  if (f->credit < SDI_MAX_TRANSFER_SIZE) {
+    u_int32 freeBytes = FeederSample(f);
+
+    if (freeBytes < f->refillBytes) {
+      /* Bytes per second = bitRatePer100 * 100 / 8 */
+      u_int32 rate = ReadVS10xxReg(REG_PAR_BITRATE_PER_100) * 25UL / 2 * f->speed;
+
+      if (rate) {
+        u_int32 us = (f->refillBytes-freeBytes) * 1000000UL / rate;
+        HostSleep(min(us, f->maxSleep ? f->maxSleep : FEEDER_MAX_SLEEP));
+        f->wakeups++;
+        freeBytes = FeederSample(f);
+      }
+    }
+    f->credit = freeBytes;
+  }
+
+  if (f->credit < SDI_MAX_TRANSFER_SIZE) {
+    /* Couldn't estimate, let WriteSdi() wait for DREQ */
+    return min(SDI_MAX_TRANSFER_SIZE, maxBytes);
+  }
+  t = min(f->credit, maxBytes);
+  f->credit -= t;
+  return t;
+#else
+  if (f->unsampled >= FEEDER_SAMPLE_BYTES) {
+    FeederSample(f);
+  }
+  f->unsampled += min(SDI_MAX_TRANSFER_SIZE, maxBytes);
+  return min(SDI_MAX_TRANSFER_SIZE, maxBytes);
+#endif
+}
+
+
+/*
+  Called instead of sending data when playback is paused.
+*/
+void FeederIdle(struct Feeder *f) {
+#ifdef FEEDER_TICKLESS
+  HostSleep(FEEDER_PAUSE_SLEEP);
+  f->wakeups++;
+#else
+  (void)f;
+#endif
+}
+
+
+void PrintFeederStats(const struct Feeder *f) {
+  u_int32 ms = (GetMicroseconds() - f->startTime) / 1000;
+
+  if (!ms) {
+    ms = 1;
+  }
+  LogPrintf("  wakeups %lu (%lu/s)", f->wakeups, f->wakeups * 1000 / ms);
+#ifdef PLAYER_HOST
+  {
+    u_int32 cpu = (HostCpuMicroseconds() - f->startCpu) / 1000;
+    LogPrintf(", CPU %lu ms (%lu.%lu%%)", cpu, cpu*100/ms, cpu*1000/ms%10);
+  }
+#endif
+  LogPrintf("\n  underruns %lu", f->underruns);
+  if (f->minSdiFill != 0xFFFFFFFFU) {
+    LogPrintf(", min fill SDI %lu/%lu bytes, audio %lu samples",
+              f->minSdiFill, f->sdiSize, f->minAudioFill);
+  }
+  LogPrintf(", read-ahead %lu, refill %lu\n", f->readAhead, f->refillBytes);
+}
+
+
+
+#ifdef RATE_CONTROL
+/*
+
+  Clock drift compensation for live streams.
+
+  When a live stream is played, the sender's clock decides how fast
+  data arrives and the VS10xx clock how fast it is played. Even a
+  small difference makes the jitter buffer run full or empty sooner
+  or later. The jitter buffer here is everything between the sender
+  and the DAC: data waiting in the pipe or socket and in stdio (see
+  HostInputQueued()), in the player's own buffer, in the SDI FIFO, and
+  in the audio buffer. It is converted into milliseconds with the
+  bitrate and samplerate.
+
+  Each telemetry snapshot adds one level sample. Every
+  RATE_CONTROL_PERIOD seconds, measured with PAR_SAMPLE_COUNTER so
+  that the host scheduling doesn't matter, a PI controller turns the
+  average level's distance from the target into PAR_RATE_TUNE. The
+  change per update is limited to RATE_CONTROL_SLEW_PPM, so that pitch
+  never jumps, and the integral is limited so that it can't wind up
+  while the output is at RATE_CONTROL_MAX_PPM. Once locked, rateTune
+  is the clock difference between the sender and VS10xx.
+
+*/
+struct RateControl {
+  u_int32 targetMs;     // Wanted jitter buffer depth, 0 = off
+  int active;           // Input is a live stream
+  double integral;      // Integral of error, in ms*s
+  int started;          // lastSamples is valid
+  u_int32 lastSamples;  // sampleCounter at the last update
+  u_int32 levelSum;     // Sum of levels since the last update, in ms
+  u_int32 levels;       // Number of levels in levelSum
+  u_int32 levelMs;      // Average level in the latest period
+  u_int32 updates;
+};
+
+u_int32 rateControlTargetMs = 0;
+
+
+/*
+  Adds a level sample from telemetry snapshot t. queuedBytes is the
+  amount of data the host has not yet sent to VS10xx, and sdiSize the
+  SDI FIFO size. Returns the new rateTune, which is ppm if there was
+  nothing to update.
+*/
+s_int32 RateControlStep(struct RateControl *rc, const struct Telemetry *t,
+                        u_int32 queuedBytes, u_int32 sdiSize, s_int32 ppm) {
+  u_int32 sdiFill = (t->sdiFree < sdiSize) ? sdiSize - t->sdiFree : 0;
+  u_int32 samples;
+  double err, dt, out, limit;
+
+  if (!t->bitRate || !t->sampleRate) {
+    return ppm;
+  }
+  rc->levelSum += (u_int32)((double)(queuedBytes + sdiFill) * 8000.0 /
+                            t->bitRate) +
+    t->audioFill * 1000UL / t->sampleRate;
+  rc->levels++;
+
+  if (!rc->started) {
+    rc->started = 1;
+    rc->lastSamples = t->sampleCounter;
+    rc->levelSum = rc->levels = 0;
+    return ppm;
+  }
+  samples = t->sampleCounter - rc->lastSamples;
+  if (samples < (u_int32)RATE_CONTROL_PERIOD * t->sampleRate) {
+    return ppm;
+  }
+  rc->lastSamples = t->sampleCounter;
+  dt = (double)samples / t->sampleRate;
+  rc->levelMs = rc->levelSum / rc->levels;
+  rc->levelSum = rc->levels = 0;
+  rc->updates++;
+
+  /* Buffer too full means the sender is faster: play faster */
+  err = (double)rc->levelMs - rc->targetMs;
+  limit = RATE_CONTROL_MAX_PPM / RATE_CONTROL_KI;
+  rc->integral += err * dt;
+  if (rc->integral > limit) {
+    rc->integral = limit;
+  } else if (rc->integral < -limit) {
+    rc->integral = -limit;
+  }
+  out = RATE_CONTROL_KP * err + RATE_CONTROL_KI * rc->integral;
+
+  if (out > RATE_CONTROL_MAX_PPM) {
+    out = RATE_CONTROL_MAX_PPM;
+  } else if (out < -RATE_CONTROL_MAX_PPM) {
+    out = -RATE_CONTROL_MAX_PPM;
+  }
+  if (out > ppm + RATE_CONTROL_SLEW_PPM) {
+    out = ppm + RATE_CONTROL_SLEW_PPM;
+  } else if (out < ppm - RATE_CONTROL_SLEW_PPM) {
+    out = ppm - RATE_CONTROL_SLEW_PPM;
+  }
+  return (s_int32)out;
+}
+
+
+/*
+  Makes the player steer PAR_RATE_TUNE so that the jitter buffer of a
+  live stream stays at targetMs milliseconds. 0 turns it off. Only
+  affects pipes and sockets, not regular files.
+*/
+void VSTestSetRateControl(u_int32 targetMs) {
+  rateControlTargetMs = targetMs;
+}
+#endif /* RATE_CONTROL */
+
+
+
+
+
+/*
+
+  Loop timing histograms.
+
+  For each loop iteration, jitter is the difference between the time
+  since the previous iteration and the same for the iteration before
+  it. Transfer time is the time it takes to send a burst to SDI (this
+  includes waiting for DREQ) or to read a batch of recorded data.
+  Bucket n counts times of 2^(n-1) to 2^n-1 microseconds.
+
+*/
+struct LatencyHistogram {
+  u_int32 bucket[LOOP_TIMING_BUCKETS];
+  u_int32 max;
+};
+
+struct LoopTiming {
+  u_int32 iterations;
+  u_int32 lastStart;
+  u_int32 lastInterval;
+  struct LatencyHistogram jitter;
+  struct LatencyHistogram xfer;
+};
+
+
+void HistogramAdd(struct LatencyHistogram *h, u_int32 us) {
+  int n = 0;
+
+  if (us > h->max) {
+    h->max = us;
+  }
+  while (us && n < LOOP_TIMING_BUCKETS-1) {
+    us >>= 1;
+    n++;
+  }
+  h->bucket[n]++;
+}
+
+
+void PrintHistogram(const char *name, const struct LatencyHistogram *h) {
+  int i;
+
+  LogPrintf("  %s (us):", name);
+  for (i=0; i<LOOP_TIMING_BUCKETS; i++) {
+    if (h->bucket[i]) {
+      LogPrintf(" <%lu:%lu", 1UL<<i, h->bucket[i]);
+    }
+  }
+  LogPrintf(" max %lu\n", h->max);
+}
+
+
+/*
+  Called at the start of each loop iteration. Returns current time.
+*/
+u_int32 LoopTimingStart(struct LoopTiming *t) {
+#ifdef LOOP_TIMING
+  u_int32 now = GetMicroseconds();
+  u_int32 interval = now - t->lastStart;
+
+  if (++t->iterations > 2) {
+    HistogramAdd(&t->jitter, (interval > t->lastInterval) ?
+                 interval - t->lastInterval : t->lastInterval - interval);
+  }
+  t->lastStart = now;
+  t->lastInterval = interval;
+  return now;
+#else
+  (void)t;
+  return 0;
+#endif
+}
+
+
+/*
+  Called after a transfer that was started at startTime.
+*/
+void LoopTimingXfer(struct LoopTiming *t, u_int32 startTime) {
+#ifdef LOOP_TIMING
+  HistogramAdd(&t->xfer, GetMicroseconds() - startTime);
+#else
+  (void)t;
+  (void)startTime;
+#endif
+}
+
+
+void PrintLoopTiming(const struct LoopTiming *t) {
+#ifdef LOOP_TIMING
+  PrintHistogram("jitter", &t->jitter);
+  PrintHistogram("transfer", &t->xfer);
+#else
+  (void)t;
+#endif
+}
+
+
+
+
+
+/*
+
+  Player commands.
+
+  Commands come from two sources: keys returned by GetUICommand(), and
+  with PLAYER_COMMAND_QUEUE, PostPlayerCommand() calls from other
+  threads. Both are first collected into struct PendingCommands, where
+  redundant commands are merged: ten volume steps become one volume
+  change, two pause toggles cancel each other, and only the last rate
+  tune, EQ and seek values are kept. Pending commands are applied
+  between SDI bursts, so that each register is written at most once.
+
+*/
+struct PlayerControls {
+  int volLevel;         // SCI_VOL attenuation, same for both channels
+  int playMode;         // Copy of PAR_PLAY_MODE
+  int speedShift;       // 16384 = normal speed
+  s_int32 rateTune;     // Samplerate fine tuning in ppm
+  s_int32 seekPos;      // File position to jump to, or -1
+};
+
+struct PendingCommands {
+  int commands;         // Number of commands merged
+  int volume;           // Change in attenuation, in -0.5 dB steps
+  int pause;            // -1 = no change, 0 = resume, 1 = pause
+  int pauseToggle;      // Toggle pause, if pause is -1
+  int speedShiftOff;    // Turn SpeedShifter off before speedShift
+  int speedShift;       // Change in speedShift
+  int rateTuneSet;
+  s_int32 rateTune;
+  int eqSet;
+  u_int16 eq;
+  int cancel;
+  s_int32 seekPos;      // -1 = no seek
+  int split;            // Start a new segment
+  int mixSet;
+  int mixSound;         // Sound to mix, -1 = stop mixing
+};
+
+
+void PendingInit(struct PendingCommands *p) {
+  memset(p, 0, sizeof(*p));
+  p->pause = -1;
+  p->seekPos = -1;
+}
+
+
+void PendingAdd(struct PendingCommands *p, int cmd, s_int32 arg) {
+  switch (cmd) {
+  case pcVolume:
+    p->volume += arg;
+    break;
+  case pcPause:
+    if (arg >= 0) {
+      p->pause = (arg != 0);
+      p->pauseToggle = 0;
+    } else if (p->pause >= 0) {
+      p->pause ^= 1;
+    } else {
+      p->pauseToggle ^= 1;
+    }
+    break;
+  case pcSpeedShift:
+    if (arg) {
+      p->speedShift += arg;
+    } else {
+      p->speedShiftOff = 1;
+      p->speedShift = 0;
+    }
+    break;
+  case pcRateTune:
+    p->rateTuneSet = 1;
+    p->rateTune = arg;
+    break;
+  case pcEq:
+    p->eqSet = 1;
+    p->eq = (u_int16)arg;
+    break;
+  case pcCancel:
+    p->cancel = 1;
+    break;
+  case pcSeek:
+    p->seekPos = arg;
+    break;
+  case pcSplit:
+    p->split = 1;
+    break;
+  case pcMix:
+    p->mixSet = 1;
+    p->mixSound = arg;
+    break;
+  default:
+    return;
+  }
+  p->commands++;
+}
+
+
+/*
+  Moves commands posted with PostPlayerCommand() to pending commands.
+*/
+void DrainPlayerCommands(struct PendingCommands *p) {
+#ifdef PLAYER_COMMAND_QUEUE
+  int cmd;
+  s_int32 arg;
+
+  while (HostCmdGet(&cmd, &arg)) {
+    PendingAdd(p, cmd, arg);
+  }
+#else
+  (void)p;
+#endif
+}
+
+
+/*
+  Posts a command to the player from another thread.
+  Returns 0 on success, or -1 if the queue is full or there is no
+  command queue (PLAYER_COMMAND_QUEUE is not defined).
+*/
+int PostPlayerCommand(int cmd, s_int32 arg) {
+#ifdef PLAYER_COMMAND_QUEUE
+  return HostCmdPost(cmd, arg);
+#else
+  (void)cmd;
+  (void)arg;
+  return -1;
+#endif
+}
+
+
+/*
+  Returns the next rateTune value when stepping down (up = 0) or up.
+*/
+s_int32 RateTuneStep(s_int32 rateTune, int up) {
+  if (up) {
+    if (rateTune <= 0) {
+      rateTune = (rateTune*0.95);
+    } else {
+      rateTune = (rateTune*1.05);
+    }
+    rateTune += 2;
+  } else {
+    if (rateTune >= 0) {
+      rateTune = (rateTune*0.95);
+    } else {
+      rateTune = (rateTune*1.05);
+    }
+    rateTune -= 2;
+    if (rateTune < -990000)
+      rateTune = -990000;
+  }
+  return rateTune;
+}
+
+
+/*
+  Changes volume by change steps of -0.5 dB, and returns the new
+  attenuation. SCI_VOL is only written if it changes.
+*/
+int ApplyVolume(int volLevel, int change) {
+  int newLevel = volLevel + change;
+
+  if (newLevel < 0) {
+    newLevel = 0;
+  } else if (newLevel > 255) {
+    newLevel = 255;
+  }
+  if (newLevel != volLevel) {
+    WriteSci(SCI_VOL, newLevel*0x101);
+  }
+  return newLevel;
+}
+
+
+#ifdef PCM_MIXER
+/*
+
+  PCM mixer.
+
+  While a file is being played, VS1063 can mix mono 16-bit PCM into
+  the output, e.g. announcements or chimes, without stopping playback.
+  Sounds are converted into mixer format once, when they are loaded
+  into the cache with VSTestLoadSound() or VSTestAddSound(), so that
+  playing them takes nothing but SCI writes.
+
+  The player streams a sound from the cache between SDI bursts: it
+  reads PAR_PCM_MIXER_FREE and writes that many samples in one burst
+  to SCI_AICTRL0. When the whole sound has been written and the mixer
+  FIFO is empty again, the mixer is turned off. While mixing, the
+  tickless feeder doesn't sleep longer than it takes the mixer to play
+  half of its FIFO. SCI_VOL attenuation is kept at 0x0404 or more, so
+  that the sum of the two has headroom. If it had to be raised for
+  that, the earlier volume is restored when the mixer is turned off.
+
+*/
+struct MixerSound {
+  u_int32 start;        // Offset in mixerPool
+  u_int32 samples;
+  u_int16 rate;
+};
+
+struct Mixer {
+  const s_int16 *data;  // Next sample to write
+  u_int32 left;         // Samples left to write
+  u_int16 rate;
+  u_int16 emptyFree;    // PAR_PCM_MIXER_FREE when the FIFO is empty
+  int active;           // Mixer is on
+  int volLowered;       // Volume was lowered from savedVolLevel
+  int savedVolLevel;
+  u_int32 sounds;       // Sounds started
+};
+
+static s_int16 mixerPool[MIXER_POOL_SAMPLES];
+u_int32 mixerPoolUsed = 0;
+struct MixerSound mixerSounds[MIXER_SOUNDS];
+int mixerSoundCount = 0;
+int mixerAttenuation = 0;       // PAR_PCM_MIXER_VOL
+struct Mixer mixer;             // Only used by the player
+
+
+/*
+  Adds samples mono samples at rate Hz to the sound cache.
+  Returns the sound number, or -1 if the cache is full.
+*/
+int VSTestAddSound(const s_int16 *pcm, u_int32 samples, u_int16 rate) {
+  struct MixerSound *s = &mixerSounds[mixerSoundCount];
+
+  if (mixerSoundCount >= MIXER_SOUNDS || !samples || rate > 48000 ||
+      samples > MIXER_POOL_SAMPLES - mixerPoolUsed) {
+    return -1;
+  }
+  s->start = mixerPoolUsed;
+  s->samples = samples;
+  s->rate = rate;
+  if (pcm) {
+    memcpy(mixerPool+s->start, pcm, samples*sizeof(pcm[0]));
+  }
+  mixerPoolUsed += samples;
+  return mixerSoundCount++;
+}
+
+
+/*
+  Loads a 16-bit linear PCM RIFF WAV file into the sound cache. Stereo
+  is mixed down to mono. Returns the sound number, or -1 on failure.
+*/
+int VSTestLoadSound(const char *fileName) {
+  FILE *fp = fopen(fileName, "rb");
+  u_int8 h[16];
+  u_int16 channels = 0, rate = 0;
+  int id = -1;
+
+  if (!fp) {
+    printf("Failed opening %s for reading\n", fileName);
+    return -1;
+  }
+  if (fread(h, 1, 12, fp) != 12 ||
+      memcmp(h, "RIFF", 4) || memcmp(h+8, "WAVE", 4)) {
+    printf("%s is not a RIFF WAV file\n", fileName);
+    fclose(fp);
+    return -1;
+  }
+  while (fread(h, 1, 8, fp) == 8) {
+    u_int32 size =
+      h[4] | (h[5] << 8) | ((u_int32)h[6] << 16) | ((u_int32)h[7] << 24);
+
+    if (!memcmp(h, "fmt ", 4) && size >= 16) {
+      if (fread(h, 1, 16, fp) != 16 || h[0] != 1 || h[1] || h[14] != 16) {
+        break;                  // Only 16-bit linear PCM
+      }
+      channels = h[2];
+      rate = h[4] | (h[5] << 8);
+      size -= 16;
+    } else if (!memcmp(h, "data", 4) && (channels == 1 || channels == 2)) {
+      u_int32 frameBytes = 2*channels;
+      u_int32 samples = size / frameBytes;
+
+      if ((id = VSTestAddSound(NULL, samples, rate)) >= 0) {
+        s_int16 *d = mixerPool + mixerSounds[id].start;
+        u_int32 left = samples;
+        u_int8 buf[512];
+
+        while (left) {
+          u_int32 n = min(left, sizeof(buf)/frameBytes);
+          u_int32 i;
+
+          if (fread(buf, frameBytes, n, fp) != n) {
+            break;
+          }
+          for (i=0; i<n; i++) {
+            const u_int8 *b = buf + i*frameBytes;
+            s_int32 sum = (s_int16)(b[0] | (b[1] << 8));
+            if (channels == 2) {
+              sum = (sum + (s_int16)(b[2] | (b[3] << 8))) / 2;
+            }
+            *d++ = (s_int16)sum;
+          }
+          left -= n;
+        }
+        /* A truncated file gives a shorter sound */
+        mixerSounds[id].samples -= left;
+        mixerPoolUsed -= left;
+      }
+      break;
+    }
+    fseek(fp, (size+1) & ~1UL, SEEK_CUR);
+  }
+  fclose(fp);
+  if (id < 0) {
+    printf("Couldn't load sound %s\n", fileName);
+  }
+  return id;
+}
+
+
+/*
+  Sets mixer attenuation, 0 (loudest) to MIXER_MAX_ATTENUATION, for
+  sounds started after this.
+*/
+void VSTestSetMixerVolume(int attenuation) {
+  if (attenuation < 0) {
+    attenuation = 0;
+  } else if (attenuation > MIXER_MAX_ATTENUATION) {
+    attenuation = MIXER_MAX_ATTENUATION;
+  }
+  mixerAttenuation = attenuation;
+}
+
+
+/*
+  Mixes cached sound id into the file being played. A sound that is
+  already being mixed is cut short. -1 stops mixing.
+  Returns 0 on success, -1 on failure.
+*/
+int VSTestPlaySound(int id) {
+  if (id >= mixerSoundCount) {
+    return -1;
+  }
+  return PostPlayerCommand(pcMix, id);
+}
+
+
+/*
+  Returns to the volume level the mixer lowered, unless the volume has
+  been changed since.
+*/
+void MixerRestoreVolume(struct Mixer *m, struct PlayerControls *c) {
+  if (m->volLowered && c->volLevel == MIXER_MIN_VOL_LEVEL) {
+    c->volLevel = ApplyVolume(c->volLevel, m->savedVolLevel-c->volLevel);
+  }
+  m->volLowered = 0;
+}
+
+
+/*
+  Starts mixing sound id, or stops mixing if id is negative.
+*/
+void MixerStart(struct Mixer *m, struct PlayerControls *c, int id) {
+  const struct MixerSound *s;
+
+  if (id < 0 || id >= mixerSoundCount) {
+    m->left = 0;                // Turned off when the FIFO is empty
+    return;
+  }
+  s = &mixerSounds[id];
+  if (!m->active) {
+    WriteVS10xxReg(REG_PAR_PCM_MIXER_RATE, s->rate);
+    c->playMode |= PAR_PLAY_MODE_PCM_MIXER_ENA;
+    WriteVS10xxReg(REG_PAR_PLAY_MODE, c->playMode);
+    m->emptyFree = (u_int16)ReadVS10xxReg(REG_PAR_PCM_MIXER_FREE);
+    m->active = 1;
+  } else if (s->rate != m->rate) {
+    WriteVS10xxReg(REG_PAR_PCM_MIXER_RATE, s->rate);
+  }
+  WriteVS10xxReg(REG_PAR_PCM_MIXER_VOL, mixerAttenuation);
+  if (c->volLevel < MIXER_MIN_VOL_LEVEL) {
+    if (!m->volLowered) {
+      m->savedVolLevel = c->volLevel;
+      m->volLowered = 1;
+    }
+    c->volLevel = ApplyVolume(c->volLevel, MIXER_MIN_VOL_LEVEL-c->volLevel);
+  }
+  m->data = mixerPool + s->start;
+  m->left = s->samples;
+  m->rate = s->rate;
+  m->sounds++;
+}
+
+
+/*
+  Writes as many samples to the mixer as it can take. Turns the mixer
+  off when everything has been played. Returns the longest time in
+  microseconds the caller may wait before calling this again, or 0 if
+  the mixer is off.
+*/
+u_int32 MixerFeed(struct Mixer *m, struct PlayerControls *c) {
+  u_int16 freeWords;
+
+  if (!m->active) {
+    return 0;
+  }
+  freeWords = (u_int16)ReadVS10xxReg(REG_PAR_PCM_MIXER_FREE);
+  if (freeWords > m->emptyFree) {
+    m->emptyFree = freeWords;
+  }
+  if (m->left) {
+    u_int16 n = min(freeWords, m->left);
+    WriteSciBurst(SCI_AICTRL0, (const u_int16 *)m->data, n);
+    m->data += n;
+    m->left -= n;
+  } else if (freeWords >= m->emptyFree) {
+    c->playMode &= ~PAR_PLAY_MODE_PCM_MIXER_ENA;
+    WriteVS10xxReg(REG_PAR_PLAY_MODE, c->playMode);
+    m->active = 0;
+    MixerRestoreVolume(m, c);
+    return 0;
+  }
+  return m->emptyFree * 500000UL / m->rate + 1;
+}
+#endif /* PCM_MIXER */
+
+
+/*
+  Applies pending playback commands to VS10xx and clears them.
+  A seek is only stored into c->seekPos, because it must be done
+  by the caller.
+*/
+void ApplyPlayerCommands(struct PendingCommands *p, struct PlayerControls *c) {
+  int oldPlayMode = c->playMode;
+
+  if (!p->commands) {
+    return;
+  }
+
+  c->volLevel = ApplyVolume(c->volLevel, p->volume);
+
+  if (p->pause >= 0 || p->pauseToggle) {
+    int pause = (c->playMode & PAR_PLAY_MODE_PAUSE_ENA) ? 1 : 0;
+    if (p->pause >= 0 ? (p->pause != pause) : p->pauseToggle) {
+      c->playMode ^= PAR_PLAY_MODE_PAUSE_ENA;
+      LogPrintf("\nPause mode %s\n", pause ? "off" : "on");
+    }
+  }
+
+  if (p->speedShiftOff) {
+    c->speedShift = 16384;
+    c->playMode &= ~PAR_PLAY_MODE_SPEED_SHIFTER_ENA;
+    LogPrintf("\nSpeedShifter off\n");
+  }
+  if (p->speedShift) {
+    int speedShift = c->speedShift + p->speedShift;
+    if (speedShift < SPEED_SHIFT_MIN) {
+      speedShift = SPEED_SHIFT_MIN;
+    } else if (speedShift > SPEED_SHIFT_MAX) {
+      speedShift = SPEED_SHIFT_MAX;
+    }
+    c->speedShift = speedShift;
+    WriteVS10xxReg(REG_PAR_SPEED_SHIFTER, speedShift);
+    c->playMode |= PAR_PLAY_MODE_SPEED_SHIFTER_ENA;
+    LogPrintf("\nSpeedShift at %d (%5.3f)\n",
+              speedShift, speedShift*(1.0/16384.0));
+  }
+
+  if (c->playMode != oldPlayMode) {
+    WriteVS10xxReg(REG_PAR_PLAY_MODE, c->playMode);
+  }
+
+  if (p->rateTuneSet && p->rateTune != c->rateTune) {
+    c->rateTune = p->rateTune;
+    WriteVS10xxReg(REG_PAR_RATE_TUNE, c->rateTune);
+    if (c->rateTune) {
+      LogPrintf("\nrateTune %ld ppm\n", c->rateTune);
+    } else {
+      LogPrintf("\nrateTune off\n");
+    }
+  }
+
+  if (p->eqSet) {
+    WriteSci(SCI_BASS, p->eq);
+  }
+
+  if (p->cancel && playerState == psPlayback) {
+    playerState = psUserRequestedCancel;
+  }
+
+  if (p->seekPos >= 0) {
+    c->seekPos = p->seekPos;
+  }
+
+#ifdef PCM_MIXER
+  if (p->mixSet) {
+    MixerStart(&mixer, c, p->mixSound);
+  }
+#endif
+
+  PendingInit(p);
+}
+
+
+/*
+  Applies pending commands to the encoder and clears them. Of the
+  player commands, only volume, pause and cancel affect recording.
+  A split request is passed on to the caller through *split.
+*/
+void ApplyRecorderCommands(struct PendingCommands *p, int *volLevel,
+                           int *split) {
+  if (!p->commands) {
+    return;
+  }
 
+  *volLevel = ApplyVolume(*volLevel, p->volume);
 
+  if (p->pause >= 0 || p->pauseToggle) {
+    int recMode = ReadSci(SCI_RECMODE);
+    int pause = (recMode & RM_63_PAUSE) ? 1 : 0;
+    if (p->pause >= 0 ? (p->pause != pause) : p->pauseToggle) {
+      WriteSci(SCI_RECMODE, recMode ^ RM_63_PAUSE);
+      LogPrintf("\nPause mode %s\n", pause ? "off" : "on");
+    }
+  }
 
+  if (p->cancel && playerState == psPlayback) {
+    WriteSci(SCI_MODE, ReadSci(SCI_MODE) | SM_CANCEL);
+    LogPrintf("\nSwitching encoder off...\n");
+    playerState = psUserRequestedCancel;
+  }
 
-/*
+  if (p->split) {
+    *split = 1;
+  }
 
-  Loads a plugin.
+  PendingInit(p);
+}
 
-  This is a slight modification of the LoadUserCode() example
-  provided in many of VLSI Solution's program packages.
 
+/*
+  Returns the result of GetUICommand(), but only calls it if at least
+  UI_POLL_INTERVAL microseconds have passed since *lastPoll. Otherwise
+  returns -1 (no command). In rtMode, GetUICommand() is polled by a
+  separate thread, and this only takes the keys it has collected.
 */
-void LoadPlugin(const u_int16 *d, u_int16 len) {
-  int i = 0;
+int PollUICommand(u_int32 *lastPoll) {
+  u_int32 now = GetMicroseconds();
 
-  while (i<len) {
-    unsigned short addr, n, val;
-    addr = d[i++];
-    n = d[i++];
-    if (n & 0x8000U) { /* RLE run, replicate n samples */
-      n &= 0x7FFF;
-      val = d[i++];
-      while (n--) {
-        WriteSci(addr, val);
-      }
-    } else {           /* Copy run, copy n samples */
-      while (n--) {
-        val = d[i++];
-        WriteSci(addr, val);
-      }
-    }
+  if (now - *lastPoll < UI_POLL_INTERVAL) {
+    return -1;
+  }
+  *lastPoll = now;
+#ifdef PLAYER_HOST
+  if (rtMode) {
+    return HostUiGet();
   }
+#endif
+  return GetUICommand();
 }
 
 
 
 
 
+/*
+
+  Finish playback of the current stream.
+
+  First sends up to endFillBytes bytes of endFillByte, then makes sure
+  the decoder has exited through SM_CANCEL. Fill bytes are sent with
+  WriteSdiv() in bursts as large as the VS10xx SDI FIFO can currently
+  take (PAR_SDI_FREE). At every burst boundary we check whether the
+  decoder has already exited, and if so, stop early. HDAT0/HDAT1 are
+  also zero before the decoder has recognized a format, so the fill
+  is only cut short if they have been seen non-zero first.
 
+  Returns the time it took in microseconds.
 
+*/
+u_int32 VS1063FinishStream(int endFillByte, u_int32 endFillBytes) {
+  u_int32 startTime = GetMicroseconds();
+  struct SdiSegment fill;
+  u_int32 sent = 0;
+  int decoding = ReadSci(SCI_HDAT1) || ReadSci(SCI_HDAT0);
+
+  fill.data = NULL;
+  fill.fill = (u_int8)endFillByte;
+
+  while (sent < endFillBytes) {
+    /* sdiFree is only updated when read through the parametric area
+       mirror at 0xc0c0..0xc0ff, which ReadVS10xxReg() takes care of. */
+    u_int32 burst = 2*ReadVS10xxReg(REG_PAR_SDI_FREE);
+
+    burst &= ~(SDI_MAX_TRANSFER_SIZE-1);
+    if (burst < SDI_MAX_TRANSFER_SIZE) {
+      burst = SDI_MAX_TRANSFER_SIZE;
+    }
+    fill.bytes = min(burst, endFillBytes-sent);
+    WriteSdiv(&fill, 1);
+    sent += fill.bytes;
 
+    if (playerState == psCancelSentToVS10xx) {
+      if (!(ReadSci(SCI_MODE) & SM_CANCEL)) {
+        playerState = psStopped;
+      }
+    } else if (ReadSci(SCI_HDAT1) || ReadSci(SCI_HDAT0)) {
+      decoding = 1;
+    } else if (decoding) {
+      /* HDAT0 and HDAT1 were cleared after a format had been decoded,
+         so the decoder has already exited and rest of fill is not
+         needed. */
+      break;
+    }
+  }
 
-enum PlayerStates {
-  psPlayback = 0,
-  psUserRequestedCancel,
-  psCancelSentToVS10xx,
-  psStopped
-} playerState;
+  /* If the file actually ended, and playback cancellation was not
+     done earlier, do it now. */
+  if (playerState == psPlayback || playerState == psUserRequestedCancel) {
+    WriteSci(SCI_MODE, ReadSci(SCI_MODE) | SM_CANCEL);
+    playerState = psCancelSentToVS10xx;
+  }
 
+  sent = 0;
+  fill.bytes = SDI_MAX_TRANSFER_SIZE;
+  while (playerState == psCancelSentToVS10xx) {
+    if (!(ReadSci(SCI_MODE) & SM_CANCEL)) {
+      playerState = psStopped;
+    } else if (sent >= SDI_CANCEL_MAX_BYTES) {
+      /* This should be extremely rare. */
+      LogPrintf("SM_CANCEL didn't clear, resetting VS10xx... ");
+      VSTestInitSoftware();
+      playerState = psStopped;
+    } else {
+      WriteSdiv(&fill, 1);
+      sent += fill.bytes;
+    }
+  }
 
+  return GetMicroseconds() - startTime;
+}
 
 
 
@@ -214,24 +1583,35 @@ enum PlayerStates {
   - Returns -1 for no operation
   - Returns -2 for cancel playback command
   - Returns any other for user input. For supported commands, see code.
+  - Is called at most once every UI_POLL_INTERVAL microseconds
+  u_int32 GetMicroseconds(void);
+  - Returns a free-running microsecond counter, which is allowed to wrap
 
 */
 void VS1063PlayFile(FILE *readFp) {
-  static u_int8 playBuf[FILE_BUFFER_SIZE];
-  u_int32 bytesInBuffer;        // How many bytes in buffer left
+  static u_int8 playBufSpace[FF_HEADER_BYTES+FEEDER_READAHEAD_MAX];
+  u_int8 *playBuf = playBufSpace+FF_HEADER_BYTES; // Room for fast forward
+  u_int8 *bufP = playBuf;       // Next byte to send
+  u_int32 bytesInBuffer = 0;    // How many bytes in buffer left
   u_int32 pos=0;                // File position
   int endFillByte = 0;          // What byte value to send after file
-  int endFillBytes = SDI_END_FILL_BYTES; // How many of those to send
-  int playMode = ReadVS10xxMem(PAR_PLAY_MODE);
+  u_int32 endFillBytes = SDI_END_FILL_BYTES; // How many of those to send
+  static struct PlayerControls ctl = {0, 0, 16384, 0, -1};
+  struct PendingCommands pending; // Commands not yet applied
   static int vuMeter = 0;       // VU meter active
   long nextReportPos=0; // File pointer where to next collect/report
-  int i;
+  u_int32 stopTime;             // How long ending the stream took, in us
+  struct FastForward ff;        // Host-side fast forward state
+  struct Feeder feeder;         // SDI feeder scheduling
+  struct LoopTiming timing;     // Loop jitter and transfer histograms
+  static struct Telemetry tm;   // Latest snapshot of VS10xx state
+#ifdef RATE_CONTROL
+  struct RateControl rc;        // Clock drift compensation
+#endif
 #ifdef PLAYER_USER_INTERFACE
   static int earSpeaker = 0;    // 0 = off, other values strength
-  static int speedShift = 16384;// 16384 = normal speed
-  int volLevel = ReadSci(SCI_VOL) & 0xFF; // Assume both channels at same level
   int c;
-  static int rateTune = 0;      // Samplerate fine tuning in ppm
+  u_int32 uiPollTime = GetMicroseconds(); // When UI was last polled
 #endif /* PLAYER_USER_INTERFACE */
 
 #ifdef PLAYER_USER_INTERFACE
@@ -239,35 +1619,106 @@ void VS1063PlayFile(FILE *readFp) {
 #endif /* PLAYER_USER_INTERFACE */
 
   playerState = psPlayback;             // Set state to normal playback
+  LogStart();
+
+  ctl.volLevel = ReadSci(SCI_VOL) & 0xFF; // Assume both channels same level
+  ctl.playMode = ReadVS10xxReg(REG_PAR_PLAY_MODE);
+  ctl.seekPos = -1;
+  PendingInit(&pending);
+  memset(&ff, 0, sizeof(ff));
+  ff.speed = 1;
+  FeederInit(&feeder);
+  memset(&timing, 0, sizeof(timing));
+#ifdef RATE_CONTROL
+  memset(&rc, 0, sizeof(rc));
+  rc.targetMs = rateControlTargetMs;
+  rc.active = rc.targetMs && PlayerQueued(readFp) >= 0;
+#endif
 
   WriteSci(SCI_DECODE_TIME, 0);         // Reset DECODE_TIME
 
 
   /* Main playback loop */
 
-  while ((bytesInBuffer = fread(playBuf, 1, FILE_BUFFER_SIZE, readFp)) > 0 &&
-         playerState != psStopped) {
-    u_int8 *bufP = playBuf;
+  while (playerState != psStopped) {
+
+    /* Jump to a new file position, if the decoder allows it now. */
+    if (ctl.seekPos >= 0 && playerState != psPlayback) {
+      ctl.seekPos = -1;
+    }
+    if (ctl.seekPos >= 0 && !(ReadSci(SCI_STATUS) & SS_DO_NOT_JUMP)) {
+      struct SdiSegment fill;
+
+      fill.data = NULL;
+      fill.bytes = SDI_SEEK_FILL_BYTES;
+      fill.fill = (u_int8)ReadVS10xxReg(REG_PAR_END_FILL_BYTE);
+      WriteSdiv(&fill, 1);
+      feeder.credit = 0;
+      feeder.started = feeder.starving = 0;
+      if (!PlayerSeek(readFp, ctl.seekPos)) {
+        LogEvent(lePlaySeek, ctl.seekPos);
+        pos = nextReportPos = ctl.seekPos;
+        bytesInBuffer = 0;
+        ff.left = 0;
+        ff.hdrBytes = 0;
+        ff.locked = 0;
+      }
+      ctl.seekPos = -1;
+    }
+
+    if (!bytesInBuffer) {
+      long n = PlayerRead(readFp, playBuf, feeder.readAhead);
+      if (n < 0) {
+        break;
+      }
+#ifdef PLAYER_HOST
+      if (!n) {
+        HostSleep(RT_READ_WAIT);        // Prefetch thread is behind
+      }
+#endif
+      bytesInBuffer = n;
+      bufP = playBuf;
+
+      /* In host-side fast forward, drop frames that wouldn't be played */
+      if (bytesInBuffer && (ff.speed > 1 || ff.left || ff.hdrBytes)) {
+        u_int32 fileBytes = bytesInBuffer;
+        bytesInBuffer = FastForwardFilter(&ff, &bufP, bytesInBuffer);
+        pos += fileBytes - bytesInBuffer;
+      }
+    }
 
     while (bytesInBuffer && playerState != psStopped) {
 
-      if (!(playMode & PAR_PLAY_MODE_PAUSE_ENA)) {
-        int t = min(SDI_MAX_TRANSFER_SIZE, bytesInBuffer);
+      if (!(ctl.playMode & PAR_PLAY_MODE_PAUSE_ENA)) {
+        struct SdiSegment seg;
+        u_int32 t = FeederBurst(&feeder, bytesInBuffer);
+        u_int32 xferStart = LoopTimingStart(&timing);
+
+        /* While cancelling, SM_CANCEL must be checked every 32 bytes */
+        if (playerState == psCancelSentToVS10xx) {
+          t = min(SDI_MAX_TRANSFER_SIZE, t);
+        }
+        seg.data = bufP;
+        seg.bytes = t;
 
         // This is the heart of the algorithm: on the following line
         // actual audio data gets sent to VS10xx.
-        WriteSdi(bufP, t);
+        WriteSdiv(&seg, 1);
+        LoopTimingXfer(&timing, xferStart);
 
         bufP += t;
         bytesInBuffer -= t;
         pos += t;
+      } else {
+        FeederIdle(&feeder);
       }
 
       /* If the user has requested cancel, set VS10xx SM_CANCEL bit */
       if (playerState == psUserRequestedCancel) {
         unsigned short oldMode;
         playerState = psCancelSentToVS10xx;
-        printf("\nSetting SM_CANCEL at file offset %ld\n", pos);
+        feeder.started = -1;
+        LogEvent(lePlayCancel, pos);
         oldMode = ReadSci(SCI_MODE);
         WriteSci(SCI_MODE, oldMode | SM_CANCEL);
       }
@@ -277,19 +1728,37 @@ void VS1063PlayFile(FILE *readFp) {
       if (playerState == psCancelSentToVS10xx) {
         unsigned short mode = ReadSci(SCI_MODE);
         if (!(mode & SM_CANCEL)) {
-          printf("SM_CANCEL has cleared at file offset %ld\n", pos);
+          LogEvent(lePlayCancelled, pos);
           playerState = psStopped;
         }
       }
 
 
+      if (TelemetryPoll(&tm)) {
+#ifdef RATE_CONTROL
+        long queued;
+        if (rc.active && playerState == psPlayback &&
+            !(ctl.playMode & PAR_PLAY_MODE_PAUSE_ENA) &&
+            (queued = PlayerQueued(readFp)) >= 0) {
+          s_int32 ppm = RateControlStep(&rc, &tm, queued + bytesInBuffer,
+                                        feeder.sdiSize, ctl.rateTune);
+          /* Written directly, so that it's not reported each time */
+          if (ppm != ctl.rateTune) {
+            ctl.rateTune = ppm;
+            WriteVS10xxReg(REG_PAR_RATE_TUNE, ppm);
+          }
+        }
+#endif
+      }
+#ifdef PCM_MIXER
+      feeder.maxSleep = MixerFeed(&mixer, &ctl);
+#endif
+
       /* If playback is going on as normal, see if we need to collect and
          possibly report */
       if (playerState == psPlayback && pos >= nextReportPos) {
 #ifdef REPORT_ON_SCREEN
-        u_int16 sampleRate;
-        u_int16 hehtoBitsPerSec;
-        u_int16 h1 = ReadSci(SCI_HDAT1);
+        u_int16 h1 = tm.hdat1;
 #endif
 
         nextReportPos += REPORT_INTERVAL;
@@ -297,7 +1766,7 @@ void VS1063PlayFile(FILE *readFp) {
            playback. If we need to later cancel playback or run into any
            trouble with e.g. a broken file, we need to be able to repeatedly
            send this byte until the decoder has been able to exit. */
-        endFillByte = ReadVS10xxMem(PAR_END_FILL_BYTE);
+        endFillByte = tm.endFillByte;
 
 #ifdef REPORT_ON_SCREEN
         if (h1 == 0x7665) {
@@ -335,31 +1804,35 @@ void VS1063PlayFile(FILE *readFp) {
           endFillBytes = SDI_END_FILL_BYTES_FLAC;
         }
 
-        sampleRate = ReadSci(SCI_AUDATA);
-        hehtoBitsPerSec = ReadVS10xxMem(PAR_BITRATE_PER_100);
-
-        printf("\r%ldKiB "
-               "%1ds %1.1f"
-               "kb/s %dHz %s %s"
-               " %04x   ",
-               pos/1024,
-               ReadSci(SCI_DECODE_TIME),
-               hehtoBitsPerSec * 0.1,
-               sampleRate & 0xFFFE, (sampleRate & 1) ? "stereo" : "mono",
-               afName[audioFormat], h1
-               );
-          
-        if (vuMeter) {
-          int vu, l, r;
-          vu = ReadVS10xxMem(PAR_VU_METER);
-          l = vu >> 8;
-          r = vu & 0xFF;
-          printf("%2d %2d ", l, r);
+        /* No stdio on the real-time path */
+        if (!rtMode) {
+          LogEvent(lePlayProgress, pos/1024,
+                   (int)(tm.decodeTime + ff.skippedMs/1000),
+                   tm.bitRate * 0.001,
+                   tm.sampleRate, (tm.channels == 2) ? "stereo" : "mono",
+                   afName[audioFormat], h1);
+
+          if (vuMeter) {
+            LogEvent(lePlayVu, tm.vuLeft, tm.vuRight);
+          }
         }
-        fflush(stdout);
 #endif /* REPORT_ON_SCREEN */
       }
-    } /* if (playerState == psPlayback && pos >= nextReportPos) */
+
+      /* Commands are applied at burst boundaries */
+      DrainPlayerCommands(&pending);
+      ApplyPlayerCommands(&pending, &ctl);
+
+      /* Leave to seek, or to poll the user interface */
+      if (ctl.seekPos >= 0) {
+        break;
+      }
+#ifdef PLAYER_USER_INTERFACE
+      if (GetMicroseconds() - uiPollTime >= UI_POLL_INTERVAL) {
+        break;
+      }
+#endif /* PLAYER_USER_INTERFACE */
+    } /* while (bytesInBuffer && playerState != psStopped) */
   
 
 
@@ -367,66 +1840,49 @@ void VS1063PlayFile(FILE *readFp) {
        basic playback would still work. */
 
 #ifdef PLAYER_USER_INTERFACE
-    /* GetUICommand should return -1 for no command and -2 for CTRL-C */
-    c = GetUICommand();
+    /* GetUICommand should return -1 for no command and -2 for CTRL-C.
+       Commands that change VS10xx state are collected into pending,
+       and applied after the switch. */
+    c = PollUICommand(&uiPollTime);
     switch (c) {
 
       /* Volume adjustment */
     case '-':
-      if (volLevel < 255) {
-        volLevel++;
-        WriteSci(SCI_VOL, volLevel*0x101);
-      }
+      PendingAdd(&pending, pcVolume, 1);
       break;
     case '+':
-      if (volLevel) {
-        volLevel--;
-        WriteSci(SCI_VOL, volLevel*0x101);
-      }
+      PendingAdd(&pending, pcVolume, -1);
       break;
 
       /* Speed shifter adjustment */
     case '*':
-      speedShift = 16384;
-      playMode &= ~PAR_PLAY_MODE_SPEED_SHIFTER_ENA;
-      WriteVS10xxMem(PAR_PLAY_MODE, playMode);
-      printf("\nSpeedShifter off\n");
+      PendingAdd(&pending, pcSpeedShift, 0);
       break;
     case ';':
-      if (speedShift > 11141) {
-        speedShift -= SPEED_SHIFT_CHANGE;
-      }
-      speedShift -= SPEED_SHIFT_CHANGE;
-      /* Intentional fall-though */
+      PendingAdd(&pending, pcSpeedShift, -SPEED_SHIFT_CHANGE);
+      break;
     case ':':
-      if (speedShift < 26869) {
-        speedShift += SPEED_SHIFT_CHANGE;
-        WriteVS10xxMem(PAR_SPEED_SHIFTER, speedShift);
-          
-        playMode |= PAR_PLAY_MODE_SPEED_SHIFTER_ENA;
-        WriteVS10xxMem(PAR_PLAY_MODE, playMode);
-      }
-      printf("\nSpeedShift at %d (%5.3f)\n",
-             speedShift, speedShift*(1.0/16384.0));
+      PendingAdd(&pending, pcSpeedShift, SPEED_SHIFT_CHANGE);
+      break;
+
+      /* Bass boost on/off */
+    case 'b':
+      PendingAdd(&pending, pcEq, ReadSci(SCI_BASS) ? 0 : BASS_BOOST);
       break;
 
       /* Show some interesting registers */
     case '_':
-      printf("\nvol %1.1fdB, MODE %04x, ST %04x, "
-             "HDAT1 %04x HDAT0 %04x\n",
-             -0.5*volLevel,
-             ReadSci(SCI_MODE),
-             ReadSci(SCI_STATUS),
-             ReadSci(SCI_HDAT1),
-             ReadSci(SCI_HDAT0));
-      printf("  sampleCounter %lu",
-             ReadVS10xxMem32Counter(PAR_SAMPLE_COUNTER));
-      printf(", sdiFree %u", ReadVS10xxMem(PAR_SDI_FREE));
-      printf(", audioFill %u", ReadVS10xxMem(PAR_AUDIO_FILL));
-      printf("\n  positionMSec %lu",
-             ReadVS10xxMem32Counter(PAR_POSITION_MSEC));
-      printf(", config1 0x%04x", ReadVS10xxMem(PAR_CONFIG1));
-      printf("\n");
+      TelemetryTake(&tm);
+      LogPrintf("\nvol %1.1fdB, MODE %04x, ST %04x, "
+                "HDAT1 %04x HDAT0 %04x\n",
+                -0.5*ctl.volLevel, tm.mode, tm.status, tm.hdat1, tm.hdat0);
+      LogPrintf("  sampleCounter %lu", tm.sampleCounter);
+      LogPrintf(", sdiFree %u", tm.sdiFree/2);
+      LogPrintf(", audioFill %u", tm.audioFill);
+      LogPrintf("\n  positionMSec %lu", PlayPositionMsec(&ff, &tm));
+      LogPrintf(", config1 0x%04x", tm.config1);
+      LogPrintf("\n");
+      PrintFeederStats(&feeder);
       break;
 
       /* Adjust play speed between 1x - 4x */
@@ -435,133 +1891,145 @@ void VS1063PlayFile(FILE *readFp) {
     case '3':
     case '4':
       /* FF speed */
-      printf("\nSet playspeed to %dX\n", c-'0');
-      WriteVS10xxMem(PAR_PLAY_SPEED, c-'0');
+      LogPrintf("\nSet playspeed to %dX\n", c-'0');
+      WriteVS10xxReg(REG_PAR_PLAY_SPEED, c-'0');
+      ff.speed = 1;
+      feeder.speed = c-'0';
+      break;
+
+      /* Fast forward 2x - 16x. For MPEG audio and ADTS, frames that
+         wouldn't be played are dropped by the host, otherwise VS10xx
+         playSpeed is used. */
+    case 'f':
+      {
+        u_int16 h1 = ReadSci(SCI_HDAT1);
+        u_int32 speed = ReadVS10xxReg(REG_PAR_PLAY_SPEED);
+        if (speed < ff.speed) {
+          speed = ff.speed;
+        }
+        speed *= 2;
+        if (speed > FF_MAX_SPEED) {
+          speed = 1;
+        }
+        if (h1 == 0x4154 || (h1 & 0xFFE0) == 0xFFE0) {
+          ff.speed = speed;
+          feeder.speed = 1;
+          WriteVS10xxReg(REG_PAR_PLAY_SPEED, 1);
+        } else {
+          ff.speed = 1;
+          feeder.speed = speed;
+          WriteVS10xxReg(REG_PAR_PLAY_SPEED, speed);
+        }
+        LogPrintf("\nFast forward %luX%s\n", speed,
+                  (ff.speed > 1) ? " (host)" : "");
+      }
       break;
 
       /* Ask player nicely to stop playing the song. */
     case 'q':
-      if (playerState == psPlayback)
-        playerState = psUserRequestedCancel;
+      PendingAdd(&pending, pcCancel, 0);
       break;
 
       /* Forceful and ugly exit. For debug uses only. */
     case 'Q':
       RestoreUIState();
-      printf("\n");
+      LogPrintf("\n");
       exit(EXIT_SUCCESS);
       break;
 
       /* EarSpeaker spatial processing adjustment. */
     case 'e':
       earSpeaker = (earSpeaker+8192) & 0xFFFF;
-      printf("\n");
-      printf("Set earspeaker to %d\n", earSpeaker);
-      WriteVS10xxMem(PAR_EARSPEAKER_LEVEL, earSpeaker);
+      LogPrintf("\n");
+      LogPrintf("Set earspeaker to %d\n", earSpeaker);
+      WriteVS10xxReg(REG_PAR_EARSPEAKER_LEVEL, earSpeaker);
       break;
 
       /* Toggle VU meter on/off */
     case 'u':
       vuMeter = 1-vuMeter;
       if (vuMeter) {
-        playMode |= PAR_PLAY_MODE_VU_METER_ENA;
-        printf("\nVU meter on\n");
+        ctl.playMode |= PAR_PLAY_MODE_VU_METER_ENA;
+        LogPrintf("\nVU meter on\n");
       } else {
-        playMode &= ~PAR_PLAY_MODE_VU_METER_ENA;
-        printf("\nVU meter off\n");
+        ctl.playMode &= ~PAR_PLAY_MODE_VU_METER_ENA;
+        LogPrintf("\nVU meter off\n");
       }
-      WriteVS10xxMem(PAR_PLAY_MODE, playMode);
+      WriteVS10xxReg(REG_PAR_PLAY_MODE, ctl.playMode);
       break;
 
       /* Toggle pause mode */
     case 'p':
-      playMode ^= PAR_PLAY_MODE_PAUSE_ENA;
-      printf("\nPause mode %s\n",
-             (playMode & PAR_PLAY_MODE_PAUSE_ENA) ? "on" : "off");
-      WriteVS10xxMem(PAR_PLAY_MODE, playMode);
+      PendingAdd(&pending, pcPause, -1);
       break;
 
       /* Toggle mono mode */
     case 'm':
-      playMode ^= PAR_PLAY_MODE_MONO_ENA;
-      printf("\nMono mode %s\n",
-             (playMode & PAR_PLAY_MODE_MONO_ENA) ? "on" : "off");
-      WriteVS10xxMem(PAR_PLAY_MODE, playMode);
+      ctl.playMode ^= PAR_PLAY_MODE_MONO_ENA;
+      LogPrintf("\nMono mode %s\n",
+                (ctl.playMode & PAR_PLAY_MODE_MONO_ENA) ? "on" : "off");
+      WriteVS10xxReg(REG_PAR_PLAY_MODE, ctl.playMode);
       break;
 
       /* Toggle differential mode */
     case 'd':
       {
         u_int16 t = ReadSci(SCI_MODE) ^ SM_DIFF;
-        printf("\nDifferential mode %s\n", (t & SM_DIFF) ? "on" : "off");
+        LogPrintf("\nDifferential mode %s\n", (t & SM_DIFF) ? "on" : "off");
         WriteSci(SCI_MODE, t);
       }
       break;
 
       /* Adjust playback samplerate finetuning */
     case 'r':
-      if (rateTune >= 0) {
-        rateTune = (rateTune*0.95);
-      } else {
-        rateTune = (rateTune*1.05);
-      }
-      rateTune -= 2;
-      if (rateTune < -990000)
-        rateTune = -990000;
-      WriteVS10xxMem32(PAR_RATE_TUNE, rateTune);
-      printf("\nrateTune %d ppm\n", rateTune);
-      break;
     case 'R':
-      if (rateTune <= 0) {
-        rateTune = (rateTune*0.95);
-      } else {
-        rateTune = (rateTune*1.05);
-      }
-      rateTune += 2;
-      WriteVS10xxMem32(PAR_RATE_TUNE, rateTune);
-      printf("\nrateTune %d ppm\n", rateTune);
+      PendingAdd(&pending, pcRateTune,
+                 RateTuneStep(pending.rateTuneSet ?
+                              pending.rateTune : ctl.rateTune, c == 'R'));
       break;
     case '/':
-      rateTune = 0;
-      WriteVS10xxMem32(PAR_RATE_TUNE, rateTune);
-      printf("\nrateTune off\n");
+      PendingAdd(&pending, pcRateTune, 0);
       break;
 
       /* Show help */
     case '?':
-      printf("\nInteractive VS1063 file player keys:\n"
-             "1-4\tSet playback speed\n"
-             "- +\tVolume down / up\n"
-             "; :\tSpeedShift down / up\n"
-             "*\tSpeedShift off\n"
-             "_\tShow current settings\n"
-             "q Q\tQuit current song / program\n"
-             "e\tSet earspeaker\n"
-             "t\tToggle temporary bitrate display\n"
-             "r R\tR rateTune down / up\n"
-             "/\tRateTune off\n"
-             "u\tToggle VU Meter\n"
-             "p\tToggle Pause\n"
-             "m\tToggle Mono\n"
-             "d\tToggle Differential\n"
-             );
+      LogPrintf("\nInteractive VS1063 file player keys:\n"
+                "1-4\tSet playback speed\n"
+                "f\tFast forward 2X / 4X / 8X / 16X / off\n"
+                "- +\tVolume down / up\n"
+                "; :\tSpeedShift down / up\n"
+                "*\tSpeedShift off\n"
+                "b\tToggle bass boost\n"
+                "_\tShow current settings\n"
+                "q Q\tQuit current song / program\n"
+                "e\tSet earspeaker\n"
+                "t\tToggle temporary bitrate display\n"
+                "r R\tR rateTune down / up\n"
+                "/\tRateTune off\n"
+                "u\tToggle VU Meter\n"
+                "p\tToggle Pause\n"
+                "m\tToggle Mono\n"
+                "d\tToggle Differential\n"
+                );
       break;
 
       /* Unknown commands or no command at all */
     default:
       if (c < -1) {
-        printf("Ctrl-C, aborting\n");
-        fflush(stdout);
+        LogPrintf("Ctrl-C, aborting\n");
         RestoreUIState();
         exit(EXIT_FAILURE);
       }
       if (c >= 0) {
-        printf("\nUnknown char '%c' (%d)\n", isprint(c) ? c : '.', c);
+        LogPrintf("\nUnknown char '%c' (%d)\n", isprint(c) ? c : '.', c);
       }
       break;
     } /* switch (c) */
 #endif /* PLAYER_USER_INTERFACE */
-  } /* while ((bytesInBuffer = fread(...)) > 0 && playerState != psStopped) */
+
+    DrainPlayerCommands(&pending);
+    ApplyPlayerCommands(&pending, &ctl);
+  } /* while (playerState != psStopped) */
 
 
   
@@ -569,43 +2037,578 @@ void VS1063PlayFile(FILE *readFp) {
   RestoreUIState();
 #endif /* PLAYER_USER_INTERFACE */
 
-  printf("\nSending %d footer %d's... ", endFillBytes, endFillByte);
-  fflush(stdout);
+#ifdef PCM_MIXER
+  /* A sound being mixed is cut at the end of the file */
+  if (mixer.active) {
+    ctl.playMode &= ~PAR_PLAY_MODE_PCM_MIXER_ENA;
+    WriteVS10xxReg(REG_PAR_PLAY_MODE, ctl.playMode);
+    mixer.active = 0;
+    mixer.left = 0;
+    MixerRestoreVolume(&mixer, &ctl);
+  }
+#endif
+  LogPrintf("\nSending %lu footer %d's... ", endFillBytes, endFillByte);
 
   /* Earlier we collected endFillByte. Now, just in case the file was
      broken, or if a cancel playback command has been given, write
-     lots of endFillBytes. */
-  memset(playBuf, endFillByte, sizeof(playBuf));
-  for (i=0; i<endFillBytes; i+=SDI_MAX_TRANSFER_SIZE) {
-    WriteSdi(playBuf, SDI_MAX_TRANSFER_SIZE);
-  }
-
-  /* If the file actually ended, and playback cancellation was not
-     done earlier, do it now. */
-  if (playerState == psPlayback) {
-    unsigned short oldMode = ReadSci(SCI_MODE);
-    WriteSci(SCI_MODE, oldMode | SM_CANCEL);
-    printf("ok. Setting SM_CANCEL, waiting... ");
-    fflush(stdout);
-    while (ReadSci(SCI_MODE) & SM_CANCEL)
-      WriteSdi(playBuf, 2);
-  }
+     endFillBytes and make sure the decoder has exited. */
+  stopTime = VS1063FinishStream(endFillByte, endFillBytes);
 
   /* That's it. Now we've played the file as we should, and left VS10xx
      in a stable state. It is now safe to call this function again for
      the next song, and again, and again... */
-  printf("ok\n");
+  LogPrintf("ok, stopped in %lu ms\n", stopTime/1000);
+  PrintFeederStats(&feeder);
+#ifdef RATE_CONTROL
+  if (rc.active) {
+    LogPrintf("  rate control: level %lu ms (target %lu), rateTune %ld ppm, "
+              "%lu updates\n", rc.levelMs, rc.targetMs, ctl.rateTune,
+              rc.updates);
+  }
+#endif
+  PrintLoopTiming(&timing);
+  LogFlush();
+}
+
+
+
+/*
+
+  Recorded stream packets.
+
+  For live streaming, the recorded stream can be cut into packets that
+  can be sent on as they are: whole Ogg pages, MP3 frames, or RIFF WAV
+  blocks. Each packet is given to a handler as soon as its last byte
+  has been read from VS10xx, with its position in samples. A packet
+  that is whole in the data read is passed without copying, otherwise
+  it is first collected to a buffer.
+
+  Ogg pages tell their position in samples (granule position). For
+  MP3 and RIFF WAV, samples are counted from the start. With Ogg Vorbis,
+  VS1063 may hold samples for several seconds before finishing a page.
+  Set RQ_OGG_LIMIT_FRAME_LENGTH in SCI_RECQUALITY (profile "oggstream")
+  for pages to be finished more often.
+
+*/
+#define OGG_MAX_PAGE_SIZE    (OGG_PAGE_HEADER_SIZE+255+255*255)
+
+struct Packetizer {
+  enum AudioFormat format;
+  u_int16 blockAlign;   // RIFF WAV block size
+  u_int16 samplesPerBlock;
+  u_int32 sampleRate;
+  u_int32 samplePos;    // Position after latest packet in samples
+  u_int32 bytes;        // Bytes collected to buf
+  u_int32 packets;
+  u_int32 skipped;      // Bytes skipped when looking for a header
+  RecordPacketFunc *func;
+  void *arg;
+  u_int8 buf[OGG_MAX_PAGE_SIZE];
+};
+
+RecordPacketFunc *recordPacketFunc; // Packet handler, or NULL
+void *recordPacketArg;
+
+
+/*
+  Finds the length of the MP3 frame or Ogg page that starts at h, when
+  avail bytes of it are available. Returns the length, 0 if there is no
+  valid header at h, or UNIT_NEED_MORE if more bytes are needed to tell.
+  *need is set to the number of bytes needed for the header.
+*/
+u_int32 StreamUnitLength(enum AudioFormat format, const u_int8 *h,
+                         u_int32 avail, u_int32 *need) {
+  u_int32 i, len;
+
+  if (format == afMp3) {
+    u_int32 samples, rate;
+    u_int32 keep;
+    u_int16 key;
+    *need = 4;
+    if (avail < 4) {
+      return (avail && h[0] != 0xFF) ? 0 : UNIT_NEED_MORE;
+    }
+    /* The encoder makes no ADTS, whose header would also be longer */
+    if ((h[1] & 0xF6) == 0xF0) {
+      return 0;
+    }
+    return FastForwardParseHeader(h, &samples, &rate, &keep, &key);
+  }
+
+  *need = OGG_PAGE_HEADER_SIZE;
+  if (memcmp(h, "OggS", min(avail, 4))) {
+    return 0;
+  }
+  if (avail < OGG_PAGE_HEADER_SIZE) {
+    return UNIT_NEED_MORE;
+  }
+  *need += h[26];               // Segment table follows
+  if (avail < *need) {
+    return UNIT_NEED_MORE;
+  }
+  for (i=0, len=*need; i<h[26]; i++) {
+    len += h[OGG_PAGE_HEADER_SIZE+i];
+  }
+  return len;
+}
+
+
+/*
+  Returns 1 if the Ogg page header at h belongs to a Vorbis header
+  page. Those are the only ones with granule position 0.
+*/
+int OggHeaderPage(const u_int8 *h) {
+  int i;
+
+  for (i=6; i<14; i++) {
+    if (h[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+void PacketizerInit(struct Packetizer *pz, enum AudioFormat format,
+                    u_int32 sampleRate, u_int16 blockAlign,
+                    u_int16 samplesPerBlock, RecordPacketFunc *func,
+                    void *arg) {
+  pz->format = format;
+  pz->blockAlign = blockAlign ? blockAlign : 1;
+  pz->samplesPerBlock = samplesPerBlock;
+  pz->sampleRate = sampleRate;
+  pz->samplePos = 0;
+  pz->bytes = 0;
+  pz->packets = 0;
+  pz->skipped = 0;
+  pz->func = func;
+  pz->arg = arg;
+}
+
+
+/*
+  Passes one packet to the handler.
+*/
+void PacketizerEmit(struct Packetizer *pz, const u_int8 *d, u_int32 bytes,
+                    int header, u_int32 readTime) {
+  struct RecordPacket p;
+
+  if (!header) {
+    if (pz->format == afMp3) {
+      u_int32 samples, rate;
+      u_int32 keep;
+      u_int16 key;
+      FastForwardParseHeader(d, &samples, &rate, &keep, &key);
+      pz->samplePos += samples;
+      pz->sampleRate = rate;
+    } else if (pz->format == afOggVorbis) {
+      /* All bits set means that no packet ends on this page */
+      if ((d[6] & d[7] & d[8] & d[9]) != 0xFF) {
+        pz->samplePos = d[6] | ((u_int32)d[7] << 8) |
+          ((u_int32)d[8] << 16) | ((u_int32)d[9] << 24);
+      }
+    } else {
+      pz->samplePos += bytes / pz->blockAlign * pz->samplesPerBlock;
+    }
+  }
+
+  p.data = d;
+  p.bytes = bytes;
+  p.samplePos = pz->samplePos;
+  p.sampleRate = pz->sampleRate;
+  p.readTime = readTime;
+  p.header = header;
+  pz->packets++;
+  pz->func(&p, pz->arg);
+}
+
+
+/*
+  Cuts recorded data into packets and passes them to the handler.
+*/
+void PacketizerPut(struct Packetizer *pz, const u_int8 *d, u_int32 bytes) {
+  u_int32 now = GetMicroseconds();
+
+  if (pz->format == afRiff) {
+    /* Whole blocks, as many as there are */
+    if (pz->bytes) {
+      u_int32 t = min(pz->blockAlign - pz->bytes, bytes);
+      memcpy(pz->buf+pz->bytes, d, t);
+      d += t;
+      bytes -= t;
+      if ((pz->bytes += t) == pz->blockAlign) {
+        PacketizerEmit(pz, pz->buf, pz->blockAlign, 0, now);
+        pz->bytes = 0;
+      }
+    }
+    if (bytes >= pz->blockAlign) {
+      u_int32 t = bytes - bytes % pz->blockAlign;
+      PacketizerEmit(pz, d, t, 0, now);
+      d += t;
+      bytes -= t;
+    }
+    memcpy(pz->buf+pz->bytes, d, bytes);
+    pz->bytes += bytes;
+    return;
+  }
+
+  while (bytes) {
+    const u_int8 *h = pz->bytes ? pz->buf : d;
+    u_int32 need, t;
+    u_int32 len = StreamUnitLength(pz->format, h, pz->bytes ? pz->bytes : bytes,
+                                   &need);
+
+    if (!len) {
+      /* Not in sync, skip one byte */
+      pz->skipped++;
+      if (pz->bytes) {
+        memmove(pz->buf, pz->buf+1, --pz->bytes);
+      } else {
+        d++;
+        bytes--;
+      }
+      continue;
+    }
+    if (len != UNIT_NEED_MORE) {
+      need = len;
+      if (!pz->bytes && len <= bytes) {
+        /* Whole packet available, no need to copy */
+        PacketizerEmit(pz, d, len, pz->format == afOggVorbis &&
+                       OggHeaderPage(d), now);
+        d += len;
+        bytes -= len;
+        continue;
+      }
+    }
+    t = min(need - pz->bytes, bytes);
+    memcpy(pz->buf+pz->bytes, d, t);
+    pz->bytes += t;
+    d += t;
+    bytes -= t;
+    if (pz->bytes == len) {
+      PacketizerEmit(pz, pz->buf, len, pz->format == afOggVorbis &&
+                     OggHeaderPage(pz->buf), now);
+      pz->bytes = 0;
+    }
+  }
+}
+
+
+/*
+  Sets the handler that gets the next recordings as packets, or NULL
+  for none. The handler is called from the recording loop, so it must
+  not block: copy the packet or hand it to another thread and return.
+  Only for MP3, Ogg Vorbis, and with RECORD_HOST_RIFF, RIFF WAV.
+*/
+void VSTestSetRecordPacketHandler(RecordPacketFunc *func, void *arg) {
+  recordPacketFunc = func;
+  recordPacketArg = arg;
+}
+
+
+
+/*
+
+  Recorder buffer statistics and overrun detection.
+
+  When VS10xx encoder buffer overflows, it returns to empty state. The
+  number of words in the buffer (SCI_RECWORDS) can't decrease except by
+  us reading data, so if there are fewer words than were left after
+  the previous read, data has been lost.
+
+*/
+struct RecorderStats {
+  u_int16 wordsLeft;    // SCI_RECWORDS left after previous read
+  u_int16 wordsHigh;    // SCI_RECWORDS high-water mark
+  u_int32 ringHigh;     // Writer ring high-water mark in bytes
+  u_int32 ringStalls;   // Times the ring was full and reading had to wait
+  int stalled;
+  u_int32 overruns;     // Encoder buffer overflows, i.e. data lost
+};
+
+
+/*
+  Reads SCI_RECWORDS and checks it for overruns.
+*/
+u_int16 RecorderWords(struct RecorderStats *s) {
+  u_int16 words = ReadSci(SCI_RECWORDS);
+
+  if (words > s->wordsHigh) {
+    s->wordsHigh = words;
+  }
+  if (words < s->wordsLeft) {
+    s->overruns++;
+    LogEvent(leRecOverrun);
+  }
+  s->wordsLeft = words;
+  return words;
+}
+
+
+/*
+  Called after n words have been read. space tells how much space was
+  available for them in bytes.
+*/
+void RecorderRead(struct RecorderStats *s, u_int16 n, u_int32 space) {
+  s->wordsLeft -= n;
+  if (space < 2) {
+    if (!s->stalled) {
+      s->ringStalls++;
+    }
+    s->stalled = 1;
+  } else {
+    s->stalled = 0;
+  }
+#ifdef RECORD_WRITER_THREAD
+  {
+    u_int32 fill = HostWriterFill();
+    if (fill > s->ringHigh) {
+      s->ringHigh = fill;
+    }
+  }
+#endif
+}
+
+
+void PrintRecorderStats(const struct RecorderStats *s) {
+  LogPrintf("  recWords max %u/%u", s->wordsHigh, REC_ENCODER_BUFFER_WORDS);
+#ifdef RECORD_WRITER_THREAD
+  LogPrintf(", ring max %lu/%lu KiB, %lu stalls",
+            s->ringHigh/1024, HostWriterSize()/1024, s->ringStalls);
+#endif
+  LogPrintf(", %lu overruns\n", s->overruns);
+#ifdef RECORD_WRITER_THREAD
+  {
+    int i, err;
+    u_int32 sent, dropped;
+    for (i=0; (err = HostWriterSinkStats(i, &sent, &dropped)) >= 0; i++) {
+      LogPrintf("  sink %d: sent %lu KiB, dropped %lu KiB%s\n",
+                i, sent/1024, dropped/1024, err ? ", failed" : "");
+    }
+  }
+#endif
+}
+
+
+
+/*
+
+  Encoder profiles.
+
+  Each profile has the encoder register settings and what the host needs
+  to keep up with the data: SPI speed for reading the data, and how
+  often to poll for it. Low-rate voice profiles poll less often, while
+  HiFi profiles get the bandwidth they need.
+
+  There is no clock per profile. The Datasheet gives no lower clock for
+  any of the encoders than the 5.0x used for MP3 and Ogg Vorbis, so all
+  of them run at ENCODER_CLOCKF. SCI reads must not exceed CLKI/7, so
+  spiHz is limited to that. pollUs is at most 1/8 of the time it takes
+  to fill the encoder buffer (REC_ENCODER_BUFFER_WORDS) at the highest
+  data rate of the profile.
+
+  All values assume XTALI = 12.288 MHz.
+
+*/
+#define ENCODER_CLOCKF \
+  (HZ_TO_SC_FREQ(12288000) | SC_MULT_53_50X | SC_ADD_53_00X)
+
+struct EncoderProfile {
+  const char *name;
+  enum AudioFormat format;
+  u_int16 recMode;      // SCI_RECMODE
+  u_int16 recQuality;   // SCI_RECQUALITY
+  u_int16 recRate;      // SCI_RECRATE
+  u_int16 recGain;      // SCI_RECGAIN, 1024 = gain 1, 0 = AGC
+  u_int16 recMaxAuto;   // SCI_RECMAXAUTO, max AGC gain if recGain is 0
+  u_int32 spiHz;        // Recommended SPI speed
+  u_int32 pollUs;       // How often to poll SCI_RECWORDS when idle
+};
+
+const struct EncoderProfile encoderProfiles[] = {
+  /* MP3. For best quality, record at 48 kHz.
+     If you must use CBR, set bitrate to at least 160 kbit/s. Avoid
+     128 kbit/s. Preferably use VBR mode, which generally gives better
+     results for a given bitrate. */
+  {"mp3", afMp3,
+   RM_63_FORMAT_MP3 | RM_63_ADC_MODE_JOINT_AGC_STEREO,
+   RQ_MODE_VBR | RQ_MULT_1000 | 160, 48000, 1024, 0,
+   2000000, 20000},
+  {"mp3cbr", afMp3,
+   RM_63_FORMAT_MP3 | RM_63_ADC_MODE_JOINT_AGC_STEREO,
+   RQ_MODE_CBR | RQ_MULT_1000 | 160, 48000, 1024, 0,
+   2000000, 20000},
+  /* Ogg Vorbis. For best quality, record at 48 kHz.
+     The quality mode gives the best results. */
+  {"ogg", afOggVorbis,
+   RM_63_FORMAT_OGG_VORBIS | RM_63_ADC_MODE_JOINT_AGC_STEREO,
+   RQ_MODE_QUALITY | RQ_OGG_PAR_SERIAL_NUMBER | 5, 48000, 1024, 0,
+   2000000, 20000},
+  /* For live streaming: shorter Ogg pages for lower latency, at the
+     cost of a little more overhead. */
+  {"oggstream", afOggVorbis,
+   RM_63_FORMAT_OGG_VORBIS | RM_63_ADC_MODE_JOINT_AGC_STEREO,
+   RQ_MODE_QUALITY | RQ_OGG_PAR_SERIAL_NUMBER | RQ_OGG_LIMIT_FRAME_LENGTH |
+   5, 48000, 1024, 0,
+   2000000, 20000},
+  /* HiFi stereo quality PCM recording in stereo 48 kHz.
+     This will result in a really fast 1536 kbit/s bitstream. Because
+     there is a 100% overhead in reading from SCI, and because the data
+     often has to be written to an SD card or similar using the same
+     bus, the SPI speed must be really high and the software streamlined
+     for there to be a chance for uninterrupted recording. A
+     ReadSciBurst() that reads all words in one bus transaction helps a
+     lot. */
+  {"pcm", afRiff,
+   RM_63_FORMAT_PCM | RM_63_ADC_MODE_JOINT_AGC_STEREO,
+   0, 48000, 1024, 0,
+   7000000, 4000},
+  /* Telephone quality G.711 from left channel at 8 kHz, 64 kbit/s. */
+  {"ulaw", afRiff,
+   RM_63_FORMAT_G711_ULAW | RM_63_ADC_MODE_LEFT,
+   0, 8000, 0, 4096,
+   1000000, 100000},
+  {"alaw", afRiff,
+   RM_63_FORMAT_G711_ALAW | RM_63_ADC_MODE_LEFT,
+   0, 8000, 0, 4096,
+   1000000, 100000},
+  /* Voice quality ADPCM recording from left channel at 8 kHz.
+     This will result in a 33 kbit/s bitstream. */
+  {"ima", afRiff,
+   RM_63_FORMAT_IMA_ADPCM | RM_63_ADC_MODE_LEFT,
+   0, 8000, 0, 4096,
+   1000000, 100000},
+  /* Wideband voice G.722 from left channel at 16 kHz, 64 kbit/s. */
+  {"g722", afRiff,
+   RM_63_FORMAT_G722_ADPCM | RM_63_ADC_MODE_LEFT,
+   0, 16000, 0, 4096,
+   1000000, 100000},
+  {NULL}
+};
+
+/* Profile for the next recording */
+const struct EncoderProfile *encoderProfile = &encoderProfiles[2];
+
+
+/*
+  Selects the encoder profile for the following recordings.
+  Returns 0 on success, or -1 if there is no such profile.
+*/
+int VSTestSetEncoderProfile(const char *name) {
+  const struct EncoderProfile *p;
+
+  for (p=encoderProfiles; p->name; p++) {
+    if (!strcmp(p->name, name)) {
+      encoderProfile = p;
+      return 0;
+    }
+  }
+  printf("Unknown encoder profile %s, available:", name);
+  for (p=encoderProfiles; p->name; p++) {
+    printf(" %s", p->name);
+  }
+  printf("\n");
+  return -1;
+}
+
+
+/*
+  Returns VS1063 internal clock CLKI in Hz for a SCI_CLOCKF value.
+  SC_ADD only applies to some decoders, so it's not counted.
+*/
+u_int32 ClockFToHz(u_int16 clockF) {
+  static const u_int8 mult10[8] = {10, 20, 25, 30, 35, 40, 45, 50};
+  u_int16 freq = FIELD_GET(clockF, SC_FREQ_F);
+  u_int32 xtali = freq ? freq*4000UL+8000000UL : 12288000UL;
+
+  return xtali / 10 * mult10[FIELD_GET(clockF, SC_MULT_F)];
 }
 
 
 
+#ifdef FAST_MODE_SWITCH
+/*
+
+  Fast switch from recording back to playback.
+
+  VSTestInitSoftware() starts from scratch: it checks the SCI bus and
+  the chip type, and loads the patches package at the slow SPI speed
+  that is needed until SCI_CLOCKF has been set. When returning from
+  recording, most of that is known to be good already.
+  VS1063SaveState() takes a snapshot of the playback setup before
+  recording starts, and VS1063RestoreState() returns to it after the
+  encoder has been stopped.
+
+  The software reset that takes VS1063 out of encoding mode also
+  disables the patches package, so it can't be reused and is loaded
+  again. This is done only after SCI_CLOCKF has been restored, so that
+  SPI can run at full speed, which makes it several times faster. Other
+  registers are only written if the reset left them different from the
+  snapshot.
 
+*/
+struct VS1063State {
+  u_int16 mode;         // SCI_MODE without encoder bits
+  u_int16 clockF;
+  u_int16 vol;
+  u_int16 bass;
+  u_int16 config1;      // PAR_CONFIG1
+};
 
 
+void VS1063SaveState(struct VS1063State *s) {
+  s->mode = ReadSci(SCI_MODE) & ~(SM_RESET|SM_CANCEL|SM_ENCODE|SM_LINE1);
+  s->clockF = ReadSci(SCI_CLOCKF);
+  s->vol = ReadSci(SCI_VOL);
+  s->bass = ReadSci(SCI_BASS);
+  s->config1 = ReadVS10xxReg(REG_PAR_CONFIG1);
+}
 
 
+/*
+  Returns VS1063 to the playback setup saved with VS1063SaveState().
+  The encoder must have been stopped. Falls back to VSTestInitSoftware()
+  if the chip doesn't answer properly after the reset.
+  Sets *us to how long the switch took in microseconds. Returns 0 on
+  success, or the non-zero result of VSTestInitSoftware().
+*/
+int VS1063RestoreState(const struct VS1063State *s, u_int32 *us) {
+  u_int32 startTime = GetMicroseconds();
+
+  /* SCI_CLOCKF may return to its default in the reset */
+  SetSpiSpeed(0);
+  WriteSci(SCI_MODE, s->mode | SM_RESET);
+
+  /* SS_VER 6 is VS1063 */
+  if (FIELD_GET(ReadVS10xxReg(REG_SCI_STATUS), SS_VER_F) != 6) {
+    int err;
+    LogPrintf("VS1063 not responding after reset, reinitializing\n");
+    LogFlush();
+    err = VSTestInitSoftware();
+    *us = GetMicroseconds() - startTime;
+    return err;
+  }
 
+  if (ReadSci(SCI_CLOCKF) != s->clockF) {
+    WriteSci(SCI_CLOCKF, s->clockF);
+  }
+  SetSpiSpeed(ClockFToHz(s->clockF)/7);
+  if (ReadSci(SCI_VOL) != s->vol) {
+    WriteSci(SCI_VOL, s->vol);
+  }
+  if (ReadSci(SCI_BASS) != s->bass) {
+    WriteSci(SCI_BASS, s->bass);
+  }
+  if (ReadVS10xxReg(REG_PAR_CONFIG1) != s->config1) {
+    WriteVS10xxReg(REG_PAR_CONFIG1, s->config1);
+  }
+  LoadPlugin(plugin, sizeof(plugin)/sizeof(plugin[0]));
+  SetSpiSpeed(0);
 
+  *us = GetMicroseconds() - startTime;
+  return 0;
+}
+#endif /* FAST_MODE_SWITCH */
 
 
 
@@ -620,132 +2623,204 @@ void VS1063RecordFile(FILE *writeFp) {
   u_int32 fileSize = 0;
   int volLevel = ReadSci(SCI_VOL) & 0xFF;
   int c;
+  u_int32 uiPollTime = GetMicroseconds(); // When UI was last polled
+  struct PendingCommands pending; // Commands not yet applied
+  struct LoopTiming timing;     // Loop jitter and transfer histograms
+  struct RecorderStats stats;   // Buffer levels and overruns
+  int split = 0;                // Start a new segment at next boundary
+  const struct EncoderProfile *profile = encoderProfile;
+  static struct Packetizer packetizer;
+  struct Packetizer *pz = NULL; // Packets for the handler, if any
+#ifdef RECORD_WRITER_THREAD
+  int writerThread;             // Writer thread is running
+#endif
+#ifdef RECORD_SEGMENTS
+  static u_int8 segBuf[2*REC_ENCODER_BUFFER_WORDS];
+  struct Segmenter seg;
+  int segmenting = 0;           // Splitting into several files
+#endif
+#ifdef FAST_MODE_SWITCH
+  struct VS1063State state;     // Playback setup to return to
+  u_int32 switchTime;
+#endif
+#ifdef RECORD_METER
+  static struct Telemetry tm;   // Latest levels or VS10xx snapshot
+  struct Meter meter;           // Levels of PCM recordings
+#endif
+#ifdef RECORD_HOST_RIFF
+  u_int8 riff[RIFF_HEADER_SIZE];
+  u_int16 recMode = 0;
+  u_int16 recRate = 0;
+  int seekable = (fseek(writeFp, 0, SEEK_CUR) == 0);
+#endif
 
   playerState = psPlayback;
+  PendingInit(&pending);
+  memset(&timing, 0, sizeof(timing));
+  memset(&stats, 0, sizeof(stats));
+  LogStart();
 
-  printf("VS1063RecordFile\n");
+  LogPrintf("VS1063RecordFile\n");
 
   /* Initialize recording */
 
-  /* This clock is high enough for both Ogg and MP3. */
-  WriteSci(SCI_CLOCKF,
-           HZ_TO_SC_FREQ(12288000) | SC_MULT_53_50X | SC_ADD_53_00X);
+#ifdef FAST_MODE_SWITCH
+  VS1063SaveState(&state);
+#endif
+
+  LogPrintf("Encoder profile %s\n", profile->name);
+  WriteSci(SCI_CLOCKF, ENCODER_CLOCKF);
+  /* SCI reads must not exceed CLKI/7 */
+  SetSpiSpeed(min(profile->spiHz, ClockFToHz(ENCODER_CLOCKF)/7));
   /* The serial number field is used only by the Ogg Vorbis encoder,
      and even then only if told to used the field. If you use to
      encode Ogg Vorbis, use a randomizer or other function that creates
      a different serial number for each file. */
-  WriteVS10xxMem32(PAR_ENC_SERIAL_NUMBER, 0x87654321);
-
-#if 0
-  /* Example definitions for MP3 recording.
-     For best quality, record at 48 kHz.
-     If you must use CBR, set bitrate to at least 160 kbit/s. Avoid 128 kbit/s.
-     Preferably use VBR mode, which generally gives better results for a
-     given bitrate. */
-  WriteSci(SCI_RECRATE,     48000);
-  WriteSci(SCI_RECGAIN,      1024); /* 1024 = gain 1 = best quality */
-  WriteSci(SCI_RECMODE, RM_63_FORMAT_MP3 | RM_63_ADC_MODE_JOINT_AGC_STEREO);
-  if (1) {
-    /* Example of VBR mode */
-    WriteSci(SCI_RECQUALITY, RQ_MODE_VBR | RQ_MULT_1000 | 160); /* ~160 kbps */
-  } else {
-    /* Example of CBR mode */
-    WriteSci(SCI_RECQUALITY, RQ_MODE_CBR | RQ_MULT_1000 | 160); /*  160 kbps */
+  WriteVS10xxReg(REG_PAR_ENC_SERIAL_NUMBER, 0x87654321);
+
+  WriteSci(SCI_RECRATE, profile->recRate);
+  WriteSci(SCI_RECGAIN, profile->recGain);
+  WriteSci(SCI_RECMAXAUTO, profile->recMaxAuto);
+  WriteSci(SCI_RECMODE, profile->recMode);
+  WriteSci(SCI_RECQUALITY, profile->recQuality);
+  audioFormat = profile->format;
+
+#ifdef RECORD_HOST_RIFF
+  if (audioFormat == afRiff) {
+    recMode = ReadSci(SCI_RECMODE) | RM_63_NO_RIFF;
+    recRate = ReadSci(SCI_RECRATE);
+    WriteSci(SCI_RECMODE, recMode);
   }
-  audioFormat = afMp3;
-#elif 1
-  /* Example definitions for Ogg Vorbis recording.
-     For best quality, record at 48 kHz.
-     The quality mode gives the best results. */
-  WriteSci(SCI_RECRATE,     48000);
-  WriteSci(SCI_RECGAIN,      1024); /* 1024 = gain 1 = best quality */
-  WriteSci(SCI_RECMODE,
-           RM_63_FORMAT_OGG_VORBIS | RM_63_ADC_MODE_JOINT_AGC_STEREO);
-  WriteSci(SCI_RECQUALITY, RQ_MODE_QUALITY | RQ_OGG_PAR_SERIAL_NUMBER | 5);
-  audioFormat = afOggVorbis;
-#elif 1
-  /* HiFi stereo quality PCM recording in stereo 48 kHz.
-     This will result in a really fast 1536 kbit/s bitstream. Because
-     there is a 100% overhead in reading from SCI, and because the data
-     often has to be written to an SD card or similar using the same
-     bus, the SPi speed must be really high and the software streamlined
-     for there to be a chance for uninterrupted recording. */
-  WriteSci(SCI_RECRATE,     48000);
-  WriteSci(SCI_RECGAIN,      1024); /* 1024 = gain 1 = best quality */
-  WriteSci(SCI_RECMODE, RM_63_FORMAT_PCM | RM_63_ADC_MODE_JOINT_AGC_STEREO);
-  audioFormat = afRiff;
-#else
-  /* Example definitions for voice quality ADPCM recording from left channel
-     at 8 kHz. This will result in a 33 kbit/s bitstream. */
-  WriteSci(SCI_RECRATE,     8000);
-  WriteSci(SCI_RECGAIN,        0); /* 1024 = gain 1 = best quality */
-  WriteSci(SCI_RECMAXAUTO,  4096); /* if RECGAIN = 0, define max auto gain */
-  WriteSci(SCI_RECMODE, RM_63_FORMAT_IMA_ADPCM | RM_63_ADC_MODE_LEFT);
-  audioFormat = afRiff;
 #endif
 
   WriteSci(SCI_MODE, ReadSci(SCI_MODE) | SM_LINE1 | SM_ENCODE);
   WriteSci(SCI_AIADDR, 0x0050); /* Activate recording! */
 
+#ifdef RECORD_METER
+  MeterInit(&meter, ReadSci(SCI_RECMODE), ReadSci(SCI_RECRATE));
+  memset(&tm, 0, sizeof(tm));
+  if (meter.channels) {
+    tm.sampleRate = ReadSci(SCI_RECRATE);
+    tm.channels = meter.channels;
+    tm.positionMsec = 0xFFFFFFFFU;
+  } else {
+    /* Compressed, levels come from VS10xx */
+    WriteVS10xxReg(REG_PAR_PLAY_MODE,
+                   ReadVS10xxReg(REG_PAR_PLAY_MODE) | PAR_PLAY_MODE_VU_METER_ENA);
+  }
+#endif
+
 
 #ifdef RECORDER_USER_INTERFACE
   SaveUIState();
 #endif /* RECORDER_USER_INTERFACE */
 
+#ifdef RECORD_WRITER_THREAD
+  if (!(writerThread = !HostWriterStart(writeFp))) {
+    LogPrintf("Couldn't start writer thread, writing directly\n");
+  }
+#endif
+
+#ifdef RECORD_HOST_RIFF
+  /* Our own RIFF WAV header. On non-seekable outputs it can't be fixed
+     later, so the sizes are left at 0xFFFFFFFF. */
+  if (audioFormat == afRiff) {
+    MakeRiffHeader(riff, recMode, recRate, 0xFFFFFFFFU);
+#ifdef RECORD_WRITER_THREAD
+    if (writerThread) {
+      u_int32 space;
+      memcpy(HostWriterSpace(&space), riff, RIFF_HEADER_SIZE);
+      HostWriterCommit(RIFF_HEADER_SIZE);
+    } else {
+      fwrite(riff, 1, RIFF_HEADER_SIZE, writeFp);
+    }
+#else
+    fwrite(riff, 1, RIFF_HEADER_SIZE, writeFp);
+#endif
+    fileSize += RIFF_HEADER_SIZE;
+    if (recordPacketFunc) {
+      pz = &packetizer;
+      PacketizerInit(pz, afRiff, recRate, riff[32] | (riff[33] << 8),
+                     riff[38] | (riff[39] << 8),
+                     recordPacketFunc, recordPacketArg);
+      PacketizerEmit(pz, riff, RIFF_HEADER_SIZE, 1, GetMicroseconds());
+    }
+  }
+#endif
+
+  /* Without RECORD_HOST_RIFF, the RIFF WAV header comes from VS10xx and
+     can't be told apart from the blocks, so no packets for it. */
+  if (recordPacketFunc &&
+      (audioFormat == afMp3 || audioFormat == afOggVorbis)) {
+    pz = &packetizer;
+    PacketizerInit(pz, audioFormat, profile->recRate, 0, 0,
+                   recordPacketFunc, recordPacketArg);
+  }
+
+#ifdef RECORD_SEGMENTS
+  if (writerThread && segmentPattern) {
+    segmenting = 1;
+    HostWriterSegments(segmentPattern, 0);
+    SegmenterInit(&seg, audioFormat,
+                  (audioFormat == afRiff) ? riff[32] | (riff[33] << 8) : 0,
+                  fileSize);
+  }
+#endif
+
   while (playerState != psStopped) {
     int n;
 
 #ifdef RECORDER_USER_INTERFACE
     {
-      c = GetUICommand();
+      c = PollUICommand(&uiPollTime);
       
       switch(c) {
       case 'q':
-        if (playerState == psPlayback) {
-          WriteSci(SCI_MODE, ReadSci(SCI_MODE) | SM_CANCEL);
-          printf("\nSwitching encoder off...\n");
-          playerState = psUserRequestedCancel;
-        }
+        PendingAdd(&pending, pcCancel, 0);
         break;
       case '-':
-        if (volLevel < 255) {
-          volLevel++;
-          WriteSci(SCI_VOL, volLevel*0x101);
-        }
+        PendingAdd(&pending, pcVolume, 1);
         break;
       case '+':
-        if (volLevel) {
-          volLevel--;
-          WriteSci(SCI_VOL, volLevel*0x101);
-        }
+        PendingAdd(&pending, pcVolume, -1);
         break;
       case 'p':
-        {
-          int recMode = ReadSci(SCI_RECMODE) ^ RM_63_PAUSE;
-          printf("\nPause mode %s\n", (recMode & RM_63_PAUSE) ? "on" : "off");
-          WriteSci(SCI_RECMODE, recMode);
-        }
+        PendingAdd(&pending, pcPause, -1);
+        break;
+      case 's':
+        PendingAdd(&pending, pcSplit, 0);
         break;
       case '_':
-        printf("\nvol %4.1f\n", -0.5*volLevel);
+        LogPrintf("\nvol %4.1f\n", -0.5*volLevel);
+#ifdef RECORD_METER
+        if (meter.channels && tm.count) {
+          LogPrintf("  peak %.1f/%.1f dBFS, RMS %.1f/%.1f dBFS, "
+                    "loudness %.1f LUFS\n",
+                    0.1*tm.peakLeft, 0.1*tm.peakRight,
+                    0.1*tm.rmsLeft, 0.1*tm.rmsRight, 0.1*tm.loudness);
+        } else if (tm.count) {
+          LogPrintf("  VU %d/%d dB\n", tm.vuLeft, tm.vuRight);
+        }
+#endif
+        PrintRecorderStats(&stats);
         break;
       case '?':
-        printf("\nInteractive VS1063 file recorder keys:\n"
-               "- +\tVolume down / up\n"
-               "_\tShow current settings\n"
-               "p\tToggle pause\n"
-               "q\tQuit recording\n"
-               );
+        LogPrintf("\nInteractive VS1063 file recorder keys:\n"
+                  "- +\tVolume down / up\n"
+                  "_\tShow current settings\n"
+                  "p\tToggle pause\n"
+                  "s\tStart a new segment file\n"
+                  "q\tQuit recording\n"
+                  );
         break;
       default:
         if (c < -1) {
-          printf("Ctrl-C, aborting\n");
-          fflush(stdout);
+          LogPrintf("Ctrl-C, aborting\n");
           RestoreUIState();
           exit(EXIT_FAILURE);
         }
         if (c >= 0) {
-          printf("\nUnknown char '%c' (%d)\n", isprint(c) ? c : '.', c);
+          LogPrintf("\nUnknown char '%c' (%d)\n", isprint(c) ? c : '.', c);
         }
         break;  
       }
@@ -753,20 +2828,70 @@ void VS1063RecordFile(FILE *writeFp) {
     }
 #endif /* RECORDER_USER_INTERFACE */
 
+    DrainPlayerCommands(&pending);
+    ApplyRecorderCommands(&pending, &volLevel, &split);
 
-    /* See if there is some data available */
-    if ((n = ReadSci(SCI_RECWORDS)) > 0) {
-      int i;
-      u_int8 *rbp = recBuf;
 
-      n = min(n, REC_BUFFER_SIZE/2);
-      for (i=0; i<n; i++) {
-        u_int16 w = ReadSci(SCI_RECDATA);
-        *rbp++ = (u_int8)(w >> 8);
-        *rbp++ = (u_int8)(w & 0xFF);
+    /* See if there is some data available */
+    if ((n = RecorderWords(&stats)) > 0) {
+      u_int32 xferStart = LoopTimingStart(&timing);
+      u_int8 *dst = recBuf;
+      u_int32 space = REC_BUFFER_SIZE;
+
+#ifdef RECORD_SEGMENTS
+      if (segmenting) {
+        /* Data must be scanned for boundaries before it goes to the
+           ring, so read it to a buffer of our own. Leave room in the
+           ring for the header of a new file. */
+        u_int32 reserve = (audioFormat == afRiff) ?
+          RIFF_HEADER_SIZE : seg.oggHeaderBytes;
+        dst = segBuf;
+        space = HostWriterSize() - HostWriterFill();
+        space = min((space > reserve) ? space - reserve : 0,
+                    (u_int32)sizeof(segBuf));
+      } else
+#endif
+#ifdef RECORD_WRITER_THREAD
+      if (writerThread) {
+        dst = HostWriterSpace(&space);
+      }
+#endif
+      /* Read all available words, up to what fits in the buffer, in one
+         burst. If the buffer is full, leave the data in VS10xx. */
+      n = min((u_int32)n, space/2);
+      if (n) {
+        ReadSciBurst(SCI_RECDATA, dst, n);
+      }
+      LoopTimingXfer(&timing, xferStart);
+      if (pz) {
+        PacketizerPut(pz, dst, 2*n);
+      }
+#ifdef RECORD_METER
+      MeterPut(&meter, dst, 2*n, &tm);
+#endif
+#ifdef RECORD_SEGMENTS
+      if (segmenting) {
+        SegmenterWrite(&seg, segBuf, 2*n, &split, recMode, recRate);
+      } else
+#endif
+#ifdef RECORD_WRITER_THREAD
+      if (writerThread) {
+        HostWriterCommit(2*n);
+      } else {
+        fwrite(recBuf, 1, 2*n, writeFp);
       }
+#else
       fwrite(recBuf, 1, 2*n, writeFp);
+#endif
+      RecorderRead(&stats, n, space);
       fileSize += 2*n;
+#ifdef PLAYER_HOST
+      /* The buffer was full: give the writer time to catch up instead
+         of polling VS10xx again right away */
+      if (!n) {
+        HostSleep(profile->pollUs);
+      }
+#endif
     } else {
       /* The following read from SCI_RECWORDS may appear redundant.
          But it's not: SCI_RECWORDS needs to be rechecked AFTER we
@@ -775,20 +2900,30 @@ void VS1063RecordFile(FILE *writeFp) {
           && !ReadSci(SCI_RECWORDS)) {
         playerState = psStopped;
       }
+#ifdef PLAYER_HOST
+      /* Nothing to do until more data has been encoded. Posted
+         commands wake us up early. */
+      if (playerState == psPlayback) {
+        HostSleep(profile->pollUs);
+      }
+#endif
+    }
+
+#ifdef RECORD_METER
+    if (!meter.channels) {
+      TelemetryPoll(&tm);
     }
+#endif
 
-    if (fileSize - nextReportPos >= REPORT_INTERVAL) {
+    if (fileSize - nextReportPos >= REPORT_INTERVAL && !rtMode) {
       u_int16 sampleRate = ReadSci(SCI_AUDATA);
       nextReportPos += REPORT_INTERVAL;
-      printf("\r%ldKiB %lds %uHz %s %s ",
-             fileSize/1024,
-             ReadVS10xxMem32Counter(PAR_SAMPLE_COUNTER) /
-             (sampleRate & 0xFFFE),
-             sampleRate & 0xFFFE,
-             (sampleRate & 1) ? "stereo" : "mono",
-             afName[audioFormat]
-             );
-      fflush(stdout);
+      LogEvent(leRecProgress, fileSize/1024,
+               ReadVS10xxReg(REG_PAR_SAMPLE_COUNTER) /
+               (sampleRate & 0xFFFE),
+               sampleRate & 0xFFFE,
+               (sampleRate & 1) ? "stereo" : "mono",
+               afName[audioFormat]);
     }
   } /* while (playerState != psStopped) */
 
@@ -797,20 +2932,45 @@ void VS1063RecordFile(FILE *writeFp) {
   RestoreUIState();
 #endif /* RECORDER_USER_INTERFACE */
 
+#ifdef RECORD_WRITER_THREAD
+  /* Let the writer thread finish before touching the file */
+  if (writerThread && HostWriterStop()) {
+    LogPrintf("\nError writing file!\n");
+  }
+#endif
+#ifdef RECORD_SEGMENTS
+  /* The rest goes to the last segment file */
+  if (segmenting) {
+    writeFp = HostWriterFile();
+    seekable = (fseek(writeFp, 0, SEEK_CUR) == 0);
+    fileSize = seg.bytes;
+  }
+#endif
+
   /* We need to check whether the file had an odd length.
      That information is available in the MSB of PAR_END_FILL_BYTE.
      In that case, the 8 LSB's are the missing byte, so we'll add
      it to the output file. */
   {
     u_int16 lastByte;
-    lastByte = ReadVS10xxMem(PAR_END_FILL_BYTE);
+    lastByte = ReadVS10xxReg(REG_PAR_END_FILL_BYTE);
     if (lastByte & 0x8000U) {
       fputc(lastByte&0xFF, writeFp);
-      printf("\nOdd length recording\n");
+      fileSize++;
+      LogPrintf("\nOdd length recording\n");
     } else {
-      printf("\nEven length recording\n");
+      LogPrintf("\nEven length recording\n");
     } 
   }
+  PrintRecorderStats(&stats);
+  PrintLoopTiming(&timing);
+  if (pz) {
+    LogPrintf("  %lu packets, %lu bytes skipped, %lu bytes incomplete\n",
+              pz->packets, pz->skipped, pz->bytes);
+  }
+#ifdef RECORD_WRITER_THREAD
+  HostWriterRemoveSinks();
+#endif
 
   /* In case we were building a RIFF file (WAV PCM, WAV IMA ADPCM, etc),
      we need to correct the file length to the headers so that the file
@@ -818,8 +2978,21 @@ void VS1063RecordFile(FILE *writeFp) {
      seek and replace capabilities that are not necessarily available
      in all microcontroller environments. */
   if (audioFormat == afRiff) {
+#ifdef RECORD_HOST_RIFF
+    /* Rewrite the whole header in one go */
+    if (seekable) {
+      LogPrintf("\nCorrecting RIFF WAV headers\n");
+      MakeRiffHeader(riff, recMode, recRate, fileSize-RIFF_HEADER_SIZE);
+#ifdef PLAYER_HOST
+      HostFilePatch(writeFp, riff, RIFF_HEADER_SIZE, 0);
+#else
+      fseek(writeFp, 0, SEEK_SET);
+      fwrite(riff, 1, RIFF_HEADER_SIZE, writeFp);
+#endif
+    }
+#else
     unsigned long t;
-    printf("\nCorrecting RIFF WAV headers\n");
+    LogPrintf("\nCorrecting RIFF WAV headers\n");
     t = fileSize-8;
     fseek(writeFp, 4, SEEK_SET);
     fputc((t >>  0) & 0xFF, writeFp);
@@ -832,17 +3005,402 @@ void VS1063RecordFile(FILE *writeFp) {
     fputc((t >>  8) & 0xFF, writeFp);
     fputc((t >> 16) & 0xFF, writeFp);
     fputc((t >> 24) & 0xFF, writeFp);
+#endif /* RECORD_HOST_RIFF */
   }
 
 
+#ifdef FAST_MODE_SWITCH
+  /* Finally, return to the playback setup we had before recording. */
+  if (VS1063RestoreState(&state, &switchTime)) {
+    LogPrintf("Couldn't return to playback\n");
+    LogFlush();
+    return;
+  }
+  LogPrintf("Back to playback in %lu us\n", switchTime);
+#else
   /* Finally, reset the VS10xx software, including realoading the
      patches package, to make sure everything is set up properly. */
+  LogFlush();
+  SetSpiSpeed(0);
   VSTestInitSoftware();
+#endif /* FAST_MODE_SWITCH */
+
+  LogPrintf("ok\n");
+  LogFlush();
+}
+
+
+
+
+
+#ifdef RECORD_HOST_RIFF
+
+/*
+
+  Full-duplex codec mode.
+
+  In codec mode VS1063 encodes and decodes at the same time, e.g. for an
+  intercom or a telephone. One loop does both: it reads what the encoder
+  has produced in one burst, then sends the decoder as much data as its
+  SDI FIFO can take, and sleeps only when neither side had anything to
+  do. Both directions are measured on the same time base, and their
+  latencies are reported: data waiting in the encoder buffer, and data
+  waiting in the SDI FIFO and the audio buffer.
+
+  Codec mode only supports RIFF WAV formats and samplerates of 48000,
+  24000, 12000 and 8000 Hz. With acoustic echo cancellation (AEC), the
+  decoder must use the same samplerate as the encoder. That is why the
+  decoder is run with RM_63_NO_RIFF, which makes it use the encoder
+  format: a RIFF WAV header in the file to be played is checked and
+  skipped here. Pause and SpeedShifter must not be used in codec mode,
+  and EarSpeaker must not be used with AEC.
+
+*/
+#define DUPLEX_MIN_BURST   64     /* Smallest SDI burst worth sending */
+#define DUPLEX_POLL_US     2000   /* Sleep when there was nothing to do */
+#define DUPLEX_PLAY_BUFFER 4096
+
+struct DuplexStats {
+  u_int16 sdiSize;      // SDI FIFO size in bytes, from sdiFree at start
+  u_int32 byteRate;     // Bytes per second in both directions
+  u_int32 playMs, playMsMax; // Playback latency
+  u_int32 recMs, recMsMax;   // Recording latency
+  u_int32 underruns;    // Times the decoder ran out of data
+  int starving;
+};
+
+
+/*
+  Updates latencies of both directions. sdiFree is in bytes, audioFill
+  in stereo samples, and recWords in words.
+*/
+void DuplexLatency(struct DuplexStats *s, u_int16 sdiFree,
+                   u_int16 audioFill, u_int16 recWords, u_int16 rate) {
+  u_int32 sdiFill = (sdiFree < s->sdiSize) ? s->sdiSize - sdiFree : 0;
+
+  s->playMs = sdiFill * 1000UL / s->byteRate + audioFill * 1000UL / rate;
+  s->recMs = 2000UL * recWords / s->byteRate;
+  if (s->playMs > s->playMsMax) {
+    s->playMsMax = s->playMs;
+  }
+  if (s->recMs > s->recMsMax) {
+    s->recMsMax = s->recMs;
+  }
+}
+
+
+void PrintDuplexStats(const struct DuplexStats *s) {
+  LogPrintf("  play latency %lu ms (max %lu), record latency %lu ms (max %lu),"
+            " %lu underruns\n", s->playMs, s->playMsMax, s->recMs, s->recMsMax,
+            s->underruns);
+}
+
+
+/*
+  If fp starts with a RIFF WAV header, checks that its format is the
+  same as in riff, and skips to the start of the data. Otherwise fp is
+  expected to have raw data in that format.
+  Returns 0 on success, or -1 if the formats differ.
+*/
+int SkipRiffHeader(FILE *fp, const u_int8 *riff) {
+  u_int8 h[16];
+  u_int32 size;
+
+  if (fread(h, 1, 12, fp) != 12 ||
+      memcmp(h, "RIFF", 4) || memcmp(h+8, "WAVE", 4)) {
+    fseek(fp, 0, SEEK_SET);
+    return 0;
+  }
+  while (fread(h, 1, 8, fp) == 8) {
+    size = h[4] | (h[5] << 8) | ((u_int32)h[6] << 16) | ((u_int32)h[7] << 24);
+    if (!memcmp(h, "data", 4)) {
+      return 0;
+    }
+    if (!memcmp(h, "fmt ", 4)) {
+      /* Format tag, channels, samplerate, bytes per second, block align */
+      if (size < 14 || fread(h, 1, 14, fp) != 14 || memcmp(h, riff+20, 14)) {
+        return -1;
+      }
+      size -= 14;
+    }
+    fseek(fp, (size+1) & ~1UL, SEEK_CUR);
+  }
+  return -1;
+}
+
+
+/*
+  Plays readFp and records to writeFp at the same time in codec mode
+  with the given encoder profile. If aec is non-zero, acoustic echo
+  cancellation is used with aec as PAR_ENC_AEC_ADAPT_MULTIPLIER
+  (2 = default). Playback ends at the end of readFp, or with 'q'.
+*/
+void VS1063DuplexFile(FILE *readFp, FILE *writeFp,
+                      const struct EncoderProfile *profile, int aec) {
+  static u_int8 recBuf[2*REC_ENCODER_BUFFER_WORDS];
+  static u_int8 playBuf[DUPLEX_PLAY_BUFFER];
+  u_int8 *playPtr = playBuf;
+  u_int32 bytesInBuffer = 0;
+  int eof = 0;
+  u_int32 fileSize = 0;
+  u_int32 nextReportTime;
+  int volLevel = ReadSci(SCI_VOL) & 0xFF;
+  int split = 0;
+  u_int32 uiPollTime = GetMicroseconds();
+  struct PendingCommands pending;
+  struct LoopTiming timing;
+  struct RecorderStats stats;
+  struct DuplexStats duplex;
+#ifdef FAST_MODE_SWITCH
+  struct VS1063State state;
+  u_int32 switchTime;
+#endif
+  u_int8 riff[RIFF_HEADER_SIZE];
+  u_int16 recMode = profile->recMode | RM_63_CODEC | RM_63_NO_RIFF;
+  u_int16 rate = profile->recRate;
+  int seekable = (fseek(writeFp, 0, SEEK_CUR) == 0);
+
+  LogPrintf("VS1063DuplexFile, profile %s%s\n", profile->name,
+            aec ? ", AEC" : "");
+  if (profile->format != afRiff || (rate != 48000 && rate != 24000 &&
+                                    rate != 12000 && rate != 8000)) {
+    LogPrintf("Codec mode needs a RIFF WAV format at 48, 24, 12 or 8 kHz\n");
+    return;
+  }
+  MakeRiffHeader(riff, recMode, rate, 0xFFFFFFFFU);
+  if (SkipRiffHeader(readFp, riff)) {
+    LogPrintf("File to be played is not in the same format\n");
+    return;
+  }
+
+  playerState = psPlayback;
+  PendingInit(&pending);
+  memset(&timing, 0, sizeof(timing));
+  memset(&stats, 0, sizeof(stats));
+  memset(&duplex, 0, sizeof(duplex));
+  LogStart();
+  duplex.byteRate = riff[28] | (riff[29] << 8) | ((u_int32)riff[30] << 16);
+
+#ifdef FAST_MODE_SWITCH
+  VS1063SaveState(&state);
+#endif
+  WriteSci(SCI_CLOCKF, ENCODER_CLOCKF);
+  SetSpiSpeed(min(profile->spiHz, ClockFToHz(ENCODER_CLOCKF)/7));
+  WriteSci(SCI_RECRATE, rate);
+  WriteSci(SCI_RECGAIN, profile->recGain);
+  WriteSci(SCI_RECMAXAUTO, profile->recMaxAuto);
+  if (aec) {
+    recMode |= RM_63_AEC;
+    WriteVS10xxReg(REG_PAR_ENC_AEC_ADAPT_MULTIPLIER, aec);
+    WriteVS10xxReg(REG_PAR_EARSPEAKER_LEVEL, 0);
+  }
+  WriteSci(SCI_RECMODE, recMode);
+  WriteSci(SCI_MODE, ReadSci(SCI_MODE) | SM_LINE1 | SM_ENCODE);
+  WriteSci(SCI_AIADDR, 0x0050); /* Activate codec mode */
+
+  /* Nothing has been sent yet, so the FIFO is empty */
+  duplex.sdiSize = 2*ReadVS10xxReg(REG_PAR_SDI_FREE);
+
+  fwrite(riff, 1, RIFF_HEADER_SIZE, writeFp);
+  fileSize = RIFF_HEADER_SIZE;
+  nextReportTime = GetMicroseconds();
+
+#ifdef RECORDER_USER_INTERFACE
+  SaveUIState();
+#endif /* RECORDER_USER_INTERFACE */
+
+  while (playerState != psStopped) {
+#ifdef PLAYER_HOST
+    int idle = 1;
+#endif
+    u_int16 n;
+    u_int32 now;
+
+#ifdef RECORDER_USER_INTERFACE
+    {
+      int c = PollUICommand(&uiPollTime);
+
+      switch(c) {
+      case 'q':
+        PendingAdd(&pending, pcCancel, 0);
+        break;
+      case '-':
+        PendingAdd(&pending, pcVolume, 1);
+        break;
+      case '+':
+        PendingAdd(&pending, pcVolume, -1);
+        break;
+      case '_':
+        LogPrintf("\nvol %4.1f\n", -0.5*volLevel);
+        PrintDuplexStats(&duplex);
+        PrintRecorderStats(&stats);
+        break;
+      case '?':
+        LogPrintf("\nInteractive VS1063 codec mode keys:\n"
+                  "- +\tVolume down / up\n"
+                  "_\tShow current settings\n"
+                  "q\tQuit\n"
+                  );
+        break;
+      default:
+        if (c < -1) {
+          LogPrintf("Ctrl-C, aborting\n");
+          RestoreUIState();
+          exit(EXIT_FAILURE);
+        }
+        break;
+      }
+    }
+#endif /* RECORDER_USER_INTERFACE */
+
+    DrainPlayerCommands(&pending);
+    /* Pause is not allowed in codec mode */
+    pending.pause = -1;
+    pending.pauseToggle = 0;
+    ApplyRecorderCommands(&pending, &volLevel, &split);
+
+    /* Encoder to file */
+    if ((n = RecorderWords(&stats)) > 0) {
+      u_int32 xferStart = LoopTimingStart(&timing);
+      ReadSciBurst(SCI_RECDATA, recBuf, n);
+      LoopTimingXfer(&timing, xferStart);
+      fwrite(recBuf, 1, 2*n, writeFp);
+      RecorderRead(&stats, n, sizeof(recBuf));
+      fileSize += 2*n;
+#ifdef PLAYER_HOST
+      idle = 0;
+#endif
+    } else if (playerState != psPlayback &&
+               !(ReadSci(SCI_MODE) & SM_CANCEL) && !ReadSci(SCI_RECWORDS)) {
+      playerState = psStopped;
+    }
+
+    /* File to decoder. sdiFree and audioFill are read in one go. */
+    if (playerState == psPlayback) {
+      u_int16 sdiFree, audioFill;
+
+      WriteSci(SCI_WRAMADDR, REG_READ_ADDR(REG_PAR_SDI_FREE));
+      sdiFree = 2*ReadSci(SCI_WRAM);
+      audioFill = ReadSci(SCI_WRAM);    // PAR_AUDIO_FILL follows
+      DuplexLatency(&duplex, sdiFree, audioFill, stats.wordsLeft, rate);
+
+      if (!bytesInBuffer && !eof) {
+        bytesInBuffer = fread(playBuf, 1, DUPLEX_PLAY_BUFFER, readFp);
+        playPtr = playBuf;
+        eof = !bytesInBuffer;
+      }
+      if (bytesInBuffer && sdiFree >= min(DUPLEX_MIN_BURST, bytesInBuffer)) {
+        struct SdiSegment seg;
+        seg.data = playPtr;
+        seg.bytes = min(sdiFree, bytesInBuffer);
+        WriteSdiv(&seg, 1);
+        playPtr += seg.bytes;
+        bytesInBuffer -= seg.bytes;
+#ifdef PLAYER_HOST
+        idle = 0;
+#endif
+      }
+
+      if (sdiFree >= duplex.sdiSize && !audioFill) {
+        if (eof) {
+          /* Everything has been played */
+          PendingAdd(&pending, pcCancel, 0);
+        } else if (!duplex.starving) {
+          duplex.underruns++;
+        }
+        duplex.starving = 1;
+      } else {
+        duplex.starving = 0;
+      }
+    }
+
+    now = GetMicroseconds();
+    if ((s_int32)(now - nextReportTime) >= 0 && !rtMode) {
+      nextReportTime = now + 1000000;
+      LogEvent(leDuplexProgress, fileSize/1024, duplex.playMs, duplex.recMs);
+    }
+
+#ifdef PLAYER_HOST
+    if (idle && playerState == psPlayback) {
+      HostSleep(DUPLEX_POLL_US);
+    }
+#endif
+  }
+
+#ifdef RECORDER_USER_INTERFACE
+  RestoreUIState();
+#endif /* RECORDER_USER_INTERFACE */
+
+  {
+    u_int16 lastByte = ReadVS10xxReg(REG_PAR_END_FILL_BYTE);
+    if (lastByte & 0x8000U) {
+      fputc(lastByte&0xFF, writeFp);
+      fileSize++;
+    }
+  }
+  if (seekable) {
+    MakeRiffHeader(riff, recMode, rate, fileSize-RIFF_HEADER_SIZE);
+#ifdef PLAYER_HOST
+    HostFilePatch(writeFp, riff, RIFF_HEADER_SIZE, 0);
+#else
+    fseek(writeFp, 0, SEEK_SET);
+    fwrite(riff, 1, RIFF_HEADER_SIZE, writeFp);
+#endif
+  }
 
-  printf("ok\n");
+  LogPrintf("\n");
+  PrintDuplexStats(&duplex);
+  PrintRecorderStats(&stats);
+  PrintLoopTiming(&timing);
+
+#ifdef FAST_MODE_SWITCH
+  if (VS1063RestoreState(&state, &switchTime)) {
+    LogPrintf("Couldn't return to playback\n");
+    LogFlush();
+    return;
+  }
+  LogPrintf("Back to playback in %lu us\n", switchTime);
+#else
+  LogFlush();
+  SetSpiSpeed(0);
+  VSTestInitSoftware();
+#endif /* FAST_MODE_SWITCH */
+  LogPrintf("ok\n");
+  LogFlush();
 }
 
 
+/*
+  Plays playName and records recName at the same time in codec mode,
+  see VS1063DuplexFile().
+*/
+int VSTestHandleDuplex(const char *playName, const char *recName,
+                       const char *profileName, int aec) {
+  const struct EncoderProfile *saved = encoderProfile;
+  FILE *readFp, *writeFp;
+  int res = -1;
+
+  if (VSTestSetEncoderProfile(profileName)) {
+    return -1;
+  }
+  if (!(readFp = fopen(playName, "rb"))) {
+    printf("Failed opening %s for reading\n", playName);
+  } else {
+    if (!(writeFp = fopen(recName, "wb"))) {
+      printf("Failed opening %s for writing\n", recName);
+    } else {
+      VS1063DuplexFile(readFp, writeFp, encoderProfile, aec);
+      LogStop();
+      fclose(writeFp);
+      res = 0;
+    }
+    fclose(readFp);
+  }
+  encoderProfile = saved;
+  return res;
+}
+
+#endif /* RECORD_HOST_RIFF */
 
 
 
@@ -902,7 +3460,7 @@ int VSTestInitSoftware(void) {
   WriteSci(SCI_AICTRL2, 0);
 
   /* Check VS10xx type */
-  ssVer = ((ReadSci(SCI_STATUS) >> 4) & 15);
+  ssVer = FIELD_GET(ReadVS10xxReg(REG_SCI_STATUS), SS_VER_F);
   if (chipNumber[ssVer]) {
     printf("Chip is VS%d\n", chipNumber[ssVer]);
     if (chipNumber[ssVer] != 1063) {
@@ -926,7 +3484,7 @@ int VSTestInitSoftware(void) {
      recording files. */
 
   /* Set up other parameters. */
-  WriteVS10xxMem(PAR_CONFIG1, PAR_CONFIG1_AAC_SBR_SELECTIVE_UPSAMPLE);
+  WriteVS10xxReg(REG_PAR_CONFIG1, PAR_CONFIG1_AAC_SBR_SELECTIVE_UPSAMPLE);
 
   /* Set volume level at -6 dB of maximum */
   WriteSci(SCI_VOL, 0x0c0c);
@@ -951,6 +3509,8 @@ int VSTestHandleFile(const char *fileName, int record) {
     printf("Play file %s\n", fileName);
     if (fp) {
       VS1063PlayFile(fp);
+      LogStop();
+      fclose(fp);
     } else {
       printf("Failed opening %s for reading\n", fileName);
       return -1;
@@ -960,6 +3520,8 @@ int VSTestHandleFile(const char *fileName, int record) {
     printf("Record file %s\n", fileName);
     if (fp) {
       VS1063RecordFile(fp);
+      LogStop();
+      fclose(fp);
     } else {
       printf("Failed opening %s for writing\n", fileName);
       return -1;
@@ -967,3 +3529,97 @@ int VSTestHandleFile(const char *fileName, int record) {
   }
   return 0;
 }
+
+
+
+#ifdef PLAYER_HOST
+
+/* With a static stdio buffer, file accesses don't allocate memory */
+static char rtFileBuf[RT_FILE_BUFFER_SIZE];
+
+struct RtFileArgs {
+  FILE *fp;
+  int record;
+};
+
+static void RtHandleFile(void *p) {
+  struct RtFileArgs *a = p;
+
+  if (a->record) {
+    VS1063RecordFile(a->fp);
+  } else {
+    VS1063PlayFile(a->fp);
+  }
+}
+
+/*
+  Like VSTestHandleFile(), but runs the player or recorder in a
+  real-time thread: SCHED_FIFO with the given priority, pinned to the
+  given CPU (-1 = any), and with all memory locked. The real-time
+  thread doesn't touch the terminal or, when playing, the file: the
+  file is read ahead by a prefetch thread, GetUICommand() is polled by
+  a user interface thread, and output goes through the log ring (see
+  LogPrintf()). Periodic on-screen reports are left out, and loop
+  timing histograms are printed after the file has been handled.
+  If the helper threads cannot be started, falls back to
+  VSTestHandleFile(). If the real-time thread cannot be started, the
+  file is handled in the calling thread.
+*/
+int VSTestHandleFileRt(const char *fileName, int record, int cpu,
+                       int priority) {
+  struct RtFileArgs a;
+
+  if (!(a.fp = fopen(fileName, record ? "wb" : "rb"))) {
+    return VSTestHandleFile(fileName, record);
+  }
+  a.record = record;
+  if (record) {
+    setvbuf(a.fp, rtFileBuf, _IOFBF, sizeof(rtFileBuf));
+  } else if (HostReaderStart(a.fp)) {
+    fclose(a.fp);
+    printf("Couldn't start prefetch thread\n");
+    return VSTestHandleFile(fileName, record);
+  }
+  if (HostUiStart(GetUICommand, UI_POLL_INTERVAL)) {
+    HostReaderStop();
+    fclose(a.fp);
+    printf("Couldn't start user interface thread\n");
+    return VSTestHandleFile(fileName, record);
+  }
+  printf("%s file %s\n", record ? "Record" : "Play", fileName);
+
+  rtReader = !record;
+  rtMode = 1;
+  if (HostRtRun(RtHandleFile, &a, cpu, priority)) {
+    rtMode = 0;
+    HostUiStop();
+    printf("Couldn't start real-time thread, check privileges\n");
+    RtHandleFile(&a);
+  }
+  rtMode = 0;
+  rtReader = 0;
+
+  HostUiStop();
+  HostReaderStop();
+  LogStop();
+  fclose(a.fp);
+  return 0;
+}
+
+
+/*
+  Sends the next recording also to fd, e.g. a socket or a pipe, in
+  addition to the file. A sink that can't keep up loses data, but
+  doesn't slow down the recording or the other sinks. The fd is made
+  non-blocking, and isn't closed.
+  Returns 0 on success, or -1 if there are too many sinks.
+*/
+int VSTestAddRecordSink(int fd) {
+#ifdef RECORD_WRITER_THREAD
+  return (HostWriterAddSink(fd) < 0) ? -1 : 0;
+#else
+  return -1;
+#endif
+}
+
+#endif /* PLAYER_HOST */
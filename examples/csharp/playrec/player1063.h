@@ -0,0 +1,427 @@
+/*
+
+  VLSI Solution generic microcontroller example player / recorder for
+  VS1063: configuration, and definitions shared by its modules.
+
+  The player / recorder itself is in player1063.c, and some of its
+  subsystems are in modules of their own:
+    playertelemetry.c  Snapshots of VS10xx state, see VSTestGetTelemetry()
+    playerlog.c        Reports from the playback and recording loops
+    playerpcm.c        Streaming PCM from the application, see VSTestPcmStart()
+    playerpcmconv.c    Sample conversions for playerpcm.c
+    playerdecode.c     Decoding recordings, see VSTestDecodeRecording()
+    playermeter.c      Levels of PCM recordings, see RECORD_METER
+    playersegment.c    Recording to several files, see VSTestRecordSegments()
+    playerendian.c     Byte order conversions
+    playerriff.c       RIFF WAV headers
+  Compile and link all of them. Modules of features that are not
+  defined below compile to nothing.
+
+*/
+#ifndef PLAYER_1063_H
+#define PLAYER_1063_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "player.h"
+
+#define FILE_BUFFER_SIZE 512
+#define SDI_MAX_TRANSFER_SIZE 32
+#define SDI_END_FILL_BYTES_FLAC 12288
+#define SDI_END_FILL_BYTES       2050
+/* If SM_CANCEL hasn't cleared after this many bytes, reset VS10xx */
+#define SDI_CANCEL_MAX_BYTES     2048
+#define REC_BUFFER_SIZE 512
+#define REC_ENCODER_BUFFER_WORDS 3712 /* Size of VS1063 encoder buffer */
+#define RIFF_HEADER_SIZE 48           /* Same size as VS1063 generates */
+
+
+#define SPEED_SHIFT_CHANGE 128
+#define SPEED_SHIFT_MIN  11141 /* 0.68x */
+#define SPEED_SHIFT_MAX  26869 /* 1.64x */
+
+/* Bass boost set with the 'b' key: +10 dB below 60 Hz */
+#define BASS_BOOST (10*SB_AMPLITUDE | 6*SB_FREQLIMIT)
+
+/* How many bytes of endFillByte to send before jumping in a file */
+#define SDI_SEEK_FILL_BYTES 2048
+
+/* How many transferred bytes between collecting data.
+   A value between 1-8 KiB is typically a good value.
+   If REPORT_ON_SCREEN is defined, a report is given on screen each time
+   data is collected. */
+#define REPORT_INTERVAL 4096
+#if 1
+#define REPORT_ON_SCREEN
+#endif
+
+/* How often, in microseconds, a telemetry snapshot of VS10xx state is
+   taken during playback and compressed recording, see
+   VSTestGetTelemetry(). Can be changed with VSTestSetTelemetryInterval(). */
+#define TELEMETRY_INTERVAL 100000
+
+/* Define PLAYER_USER_INTERFACE if you want to have a user interface in your
+   player. */
+#if 1
+#define PLAYER_USER_INTERFACE
+#endif
+
+/* Define RECORDER_USER_INTERFACE if you want to have a user interface in your
+   player. */
+#if 1
+#define RECORDER_USER_INTERFACE
+#endif
+
+/* How often, in microseconds, the user interface is polled with
+   GetUICommand(). */
+#define UI_POLL_INTERVAL 20000
+
+/* Define PLAYER_HOST if the player runs on a Linux host instead of a
+   microcontroller. This enables features that need operating system
+   support: FEEDER_TICKLESS, RATE_CONTROL, RECORD_METER, LOOP_TIMING,
+   PLAYER_COMMAND_QUEUE, ASYNC_LOG and RECORD_WRITER_THREAD. You then
+   also need to compile and link playerhost.c, with threads and the
+   math library:
+     cc player1063.c playertelemetry.c playerlog.c playerpcm.c \
+       playerpcmconv.c playerdecode.c playermeter.c playersegment.c \
+       playerendian.c playerriff.c playerhost.c <your transport> \
+       -lpthread -lm */
+#if 0
+#define PLAYER_HOST
+#endif
+
+/* Define FEEDER_TICKLESS if you want the player to sleep until the VS10xx
+   SDI FIFO has drained to FEEDER_REFILL_BYTES, then send it one large
+   burst, instead of polling DREQ all the time. This saves a lot of CPU
+   time with low-bitrate streams. Requires PLAYER_HOST. */
+#ifdef PLAYER_HOST
+#define FEEDER_TICKLESS
+#endif
+
+#define FEEDER_REFILL_BYTES   1024
+#define FEEDER_MAX_SLEEP    100000 /* Microseconds */
+#define FEEDER_PAUSE_SLEEP   10000 /* Microseconds */
+
+/* The feeder watches PAR_AUDIO_FILL and PAR_SDI_FREE for underruns.
+   After an underrun it reads further ahead from the file, up to
+   FEEDER_READAHEAD_MAX bytes at a time, and refills the SDI FIFO
+   sooner, down to FEEDER_REFILL_MIN free bytes. After
+   FEEDER_RELAX_TIME microseconds without trouble it relaxes again.
+   Without FEEDER_TICKLESS, levels are sampled every FEEDER_SAMPLE_BYTES
+   bytes sent. */
+#ifdef PLAYER_HOST
+#define FEEDER_READAHEAD_MAX 32768
+#else
+#define FEEDER_READAHEAD_MAX FILE_BUFFER_SIZE
+#endif
+#define FEEDER_REFILL_MIN      256
+#define FEEDER_RELAX_TIME 10000000
+#define FEEDER_SAMPLE_BYTES   1024
+
+/* Define RATE_CONTROL if you want the player to be able to follow the
+   clock of a live stream with PAR_RATE_TUNE, see VSTestSetRateControl().
+   Requires PLAYER_HOST. */
+#ifdef PLAYER_HOST
+#define RATE_CONTROL
+#endif
+
+#define RATE_CONTROL_PERIOD      1 /* Seconds of audio between updates */
+#define RATE_CONTROL_KP        1.0 /* ppm per ms of error */
+#define RATE_CONTROL_KI       0.02 /* ppm per ms of error per second */
+#define RATE_CONTROL_MAX_PPM  2000
+#define RATE_CONTROL_SLEW_PPM   20 /* Largest change per update */
+
+/* Define PCM_MIXER if you want to be able to mix cached sounds, e.g.
+   announcements and chimes, into playback with the VS1063 PCM mixer,
+   see VSTestLoadSound(). MIXER_POOL_SAMPLES is the total size of the
+   sound cache in mono samples. */
+#if 0
+#define PCM_MIXER
+#endif
+
+#define MIXER_SOUNDS 16
+#ifdef PLAYER_HOST
+#define MIXER_POOL_SAMPLES (1024*1024)
+#else
+#define MIXER_POOL_SAMPLES 8192
+#endif
+#define MIXER_MIN_VOL_LEVEL 4   /* SCI_VOL at least 0x0404 while mixing */
+#define MIXER_MAX_ATTENUATION 182
+
+/* Define RECORD_METER if you want the peak, RMS and loudness levels of
+   PCM recordings to be measured by the host from the recorded data, and
+   published in the telemetry snapshot every METER_BLOCK_MS, instead of
+   polling the VS10xx VU meter. Requires PLAYER_HOST. The filters and
+   levels use tan(), pow() and log10(), so link with the math library
+   (-lm). */
+#ifdef PLAYER_HOST
+#define RECORD_METER
+#endif
+
+#define METER_BLOCK_MS      100
+#define METER_WINDOW_BLOCKS 30      /* Short-term loudness over 3 s */
+#define METER_FLOOR         (-1200) /* Lowest level, -120 dB */
+#define METER_PI 3.14159265358979323846 /* M_PI is not ISO C */
+
+/* Define PCM_INPUT if you want to stream audio that the application
+   produces itself, e.g. synthesized speech, to VS10xx with
+   VSTestPcmStart(), VSTestPcmWrite() and VSTestPcmEnd(). Float input
+   is rounded with lrintf(), so link with the math library (-lm). */
+#if 0
+#define PCM_INPUT
+#endif
+
+#define PCM_BLOCK_FRAMES 512    /* Frames converted and sent at a time */
+#define PCM_DITHER_SIZE (4*PCM_BLOCK_FRAMES)
+
+/* Define LOOP_TIMING to collect histograms of feeder and recorder loop
+   jitter and transfer times. */
+#ifdef PLAYER_HOST
+#define LOOP_TIMING
+#endif
+
+/* Define PLAYER_COMMAND_QUEUE if you want other threads to be able to
+   control the player with PostPlayerCommand(). Requires PLAYER_HOST. */
+#ifdef PLAYER_HOST
+#define PLAYER_COMMAND_QUEUE
+#endif
+
+/* Define ASYNC_LOG if you want reports from the playback and recording
+   loops to be put into a ring and printed by a background thread, so
+   that the loops never wait for the terminal. Requires PLAYER_HOST. */
+#ifdef PLAYER_HOST
+#define ASYNC_LOG
+#endif
+
+/* Define RECORD_HOST_RIFF if you want the recorder to create RIFF WAV
+   headers itself instead of VS10xx (RM_63_NO_RIFF). When the output is
+   seekable, the header is then fixed with a single write. When it's not,
+   e.g. a pipe or a socket, a streaming header with 0xFFFFFFFF sizes is
+   written and the recording needs no fixing afterwards. */
+#if 0
+#define RECORD_HOST_RIFF
+#endif
+
+/* Define RECORD_WRITER_THREAD if you want recorded data to be written to
+   the file by a separate thread, so that storage stalls don't delay
+   reading data from VS10xx. Requires PLAYER_HOST. */
+#ifdef PLAYER_HOST
+#define RECORD_WRITER_THREAD
+#endif
+
+/* Define RECORD_SEGMENTS if you want VSTestRecordSegments() to be able
+   to split a recording into several files without losing any data in
+   between. Requires RECORD_WRITER_THREAD and RECORD_HOST_RIFF. */
+#if defined(RECORD_WRITER_THREAD) && defined(RECORD_HOST_RIFF)
+#define RECORD_SEGMENTS
+#endif
+
+/* Define FAST_MODE_SWITCH if you want to return from recording to
+   playback by restoring a snapshot of the playback setup instead of
+   running the whole VSTestInitSoftware(). */
+#if 0
+#define FAST_MODE_SWITCH
+#endif
+
+#define LOOP_TIMING_BUCKETS 20
+#define RT_FILE_BUFFER_SIZE 65536
+#define RT_READ_WAIT 1000 /* Microseconds, when the prefetch thread is behind */
+#define DECODE_CHUNK_BYTES (256*1024) /* Recording read at a time */
+
+#ifdef PLAYER_HOST
+#include "playerhost.h"
+#endif
+
+
+#define min(a,b) (((a)<(b))?(a):(b))
+#define max(a,b) (((a)>(b))?(a):(b))
+
+
+enum AudioFormat {
+  afUnknown,
+  afRiff,
+  afOggVorbis,
+  afMp1,
+  afMp2,
+  afMp3,
+  afAacMp4,
+  afAacAdts,
+  afAacAdif,
+  afFlac,
+  afWma,
+};
+
+extern enum AudioFormat audioFormat;
+extern const char *afName[];
+
+enum PlayerStates {
+  psPlayback = 0,
+  psUserRequestedCancel,
+  psCancelSentToVS10xx,
+  psStopped
+};
+
+extern enum PlayerStates playerState;
+
+/* Set when running in a real-time thread, see VSTestHandleFileRt().
+   Periodic on-screen reports are then left out. */
+extern int rtMode;
+
+/* Events for LogEvent(), with formats in the same order in logFormat[] */
+enum LogEventId {
+  lePlayProgress,
+  lePlayVu,
+  lePlaySeek,
+  lePlayCancel,
+  lePlayCancelled,
+  leRecProgress,
+  leRecSegment,
+  leRecOverrun,
+  leDuplexProgress,
+  leEvents
+};
+
+
+/*
+  Read or write a register through its descriptor (see REG_DESC() in
+  vs10xx_uc.h). With a constant descriptor the compiler resolves the
+  access method, so e.g. ReadVS10xxReg(REG_PAR_SDI_FREE) costs the same
+  as the hand-written mirror read, and a 32-bit counter can never be
+  read with the non-atomic ReadVS10xxMem32() by mistake.
+*/
+#define ReadVS10xxReg(r) \
+  (!((r) & REG_WRAM) ? (u_int32)ReadSci((u_int8)REG_ADDR(r)) : \
+   !((r) & REG_32) ? (u_int32)ReadVS10xxMem(REG_READ_ADDR(r)) : \
+   ((r) & REG_VOLATILE) ? ReadVS10xxMem32Counter(REG_ADDR(r)) : \
+   ReadVS10xxMem32(REG_ADDR(r)))
+
+#define WriteVS10xxReg(r, data) \
+  do { \
+    if (!((r) & REG_WRAM)) { \
+      WriteSci((u_int8)REG_ADDR(r), (u_int16)(data)); \
+    } else if ((r) & REG_32) { \
+      WriteVS10xxMem32(REG_ADDR(r), (u_int32)(data)); \
+    } else { \
+      WriteVS10xxMem(REG_ADDR(r), (u_int16)(data)); \
+    } \
+  } while (0)
+
+/* SDI feeder scheduling, see FeederBurst() */
+struct Feeder {
+  u_int32 credit;       // Bytes VS10xx can take without waiting
+  int speed;            // Playback speed multiplier (playSpeed)
+  u_int32 wakeups;      // Number of timer wakeups
+  u_int32 startTime;    // When the stream started, in us
+  u_int32 startCpu;     // CPU time used when the stream started, in us
+  u_int32 readAhead;    // Bytes to read from the file at a time
+  u_int32 refillBytes;  // Refill SDI FIFO when this much is free
+  u_int32 sdiSize;      // SDI FIFO size in bytes, largest sdiFree seen
+  int started;          // Audio has come out since start or seek,
+                        // -1 when stopping
+  int starving;         // In an underrun
+  u_int32 underruns;    // Times VS10xx ran out of data
+  u_int32 minSdiFill;   // Lowest SDI FIFO fill in bytes
+  u_int32 minAudioFill; // Lowest audio buffer fill in stereo samples
+  u_int32 windowStart;  // Start of the current relax period, in us
+  u_int32 windowMin;    // Lowest SDI FIFO fill since windowStart
+  u_int32 unsampled;    // Bytes sent since last sample
+  u_int32 maxSleep;     // Longest sleep, 0 = FEEDER_MAX_SLEEP
+};
+
+/* Recording meter, see MeterPut() */
+struct Meter {
+  int channels;         // 0 = not metering
+  u_int32 blockFrames;  // Frames per block
+  u_int32 frames;       // Frames in the current block
+  int next;             // Channel of the next sample
+  u_int32 skip;         // Bytes still to skip, VS10xx RIFF header
+  u_int16 peak[2];      // Largest absolute sample in the block
+  double sumSq[2];      // Sum of squares in the block
+  double kSumSq[2];     // Sum of squares after K-weighting
+  double coef[2][5];    // K-weighting stages: b0, b1, b2, a1, a2
+  double state[2][2][2]; // Per channel and stage: z1, z2
+  double window[METER_WINDOW_BLOCKS]; // K-weighted block mean squares
+  int windowPos;
+  int windowBlocks;
+};
+
+/* Segmented recording, see SegmenterWrite() */
+#define OGG_PAGE_HEADER_SIZE 27
+#define UNIT_NEED_MORE       0xFFFFFFFFU
+#define SEG_MAX_HEADER       (OGG_PAGE_HEADER_SIZE+255)
+
+struct Segmenter {
+  enum AudioFormat format;
+  u_int16 blockAlign;   // RIFF WAV block size
+  u_int32 left;         // Bytes left in current block, frame or page
+  u_int8 hdr[SEG_MAX_HEADER]; // Header bytes carried between blocks
+  u_int32 hdrBytes;
+  u_int32 hdrNeed;      // Header bytes needed before it can be parsed
+  int headerPage;       // Current Ogg page is a Vorbis header page
+  int oggHeadersDone;   // All Vorbis header pages have been seen
+  u_int32 oggHeaderBytes;
+  u_int32 index;        // Number of current segment
+  u_int32 bytes;        // Size of current segment file
+  u_int32 seconds;      // Length of current segment
+  u_int32 us;           // Fraction of a second, in microseconds
+  u_int32 lastTime;
+};
+
+
+/* player1063.c */
+u_int32 Counter32(u_int16 msbBefore, u_int16 lsb, u_int16 msbAfter);
+u_int32 ReadVS10xxMem32Counter(u_int16 addr);
+u_int32 ReadVS10xxMem32(u_int16 addr);
+u_int16 ReadVS10xxMem(u_int16 addr);
+void WriteVS10xxMem(u_int16 addr, u_int16 data);
+void WriteVS10xxMem32(u_int16 addr, u_int32 data);
+void FeederInit(struct Feeder *f);
+u_int32 FeederBurst(struct Feeder *f, u_int32 maxBytes);
+void PrintFeederStats(const struct Feeder *f);
+u_int32 VS1063FinishStream(int endFillByte, u_int32 endFillBytes);
+u_int32 StreamUnitLength(enum AudioFormat format, const u_int8 *h,
+                         u_int32 avail, u_int32 *need);
+int OggHeaderPage(const u_int8 *h);
+void VS1063RecordFile(FILE *writeFp);
+
+/* playertelemetry.c */
+void TelemetryPublish(struct Telemetry *t);
+void TelemetryTake(struct Telemetry *t);
+int TelemetryPoll(struct Telemetry *t);
+
+/* playerlog.c */
+void LogStart(void);
+void LogEvent(int id, ...);
+void LogPrintf(const char *format, ...);
+void LogFlush(void);
+void LogStop(void);
+
+/* playerpcmconv.c */
+void PcmFloatToS16(s_int16 *out, const float *in, u_int32 n,
+                   const float *dither);
+void PcmS32ToS16(s_int16 *out, const int32_t *in, u_int32 n,
+                 const int32_t *dither);
+void PcmS24ToS32(int32_t *out, const u_int8 *in, u_int32 n);
+void PcmInterleave(s_int16 *out, const s_int16 *left, const s_int16 *right,
+                   u_int32 n);
+
+/* playermeter.c */
+void MeterInit(struct Meter *m, u_int16 recMode, u_int16 sampleRate);
+void MeterPut(struct Meter *m, const u_int8 *d, u_int32 bytes,
+              struct Telemetry *t);
+
+/* playersegment.c */
+extern const char *segmentPattern;
+void SegmenterInit(struct Segmenter *sg, enum AudioFormat format,
+                   u_int16 blockAlign, u_int32 fileSize);
+void SegmenterWrite(struct Segmenter *sg, const u_int8 *d, u_int32 bytes,
+                    int *split, u_int16 recMode, u_int16 recRate);
+
+/* playerendian.c */
+void SamplesToLittleEndian(s_int16 *s, u_int32 n);
+
+/* playerriff.c */
+int MakeRiffHeader(u_int8 *h, u_int16 recMode, u_int16 sampleRate,
+                   u_int32 dataBytes);
+
+#endif
@@ -0,0 +1,123 @@
+/*
+
+  VLSI Solution generic microcontroller example player / recorder for
+  VS1063: decoding G.711 and IMA ADPCM recordings on the host. The
+  decoders themselves are in playerhost.c.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "player1063.h"
+
+#ifdef PLAYER_HOST
+
+/*
+  Reads RIFF WAV headers from fp up to the start of the data, and
+  returns the format tag, the number of channels, the sample rate and
+  the block size. Returns 0 on success, -1 if fp isn't a RIFF WAV file.
+*/
+static int ReadRiffFormat(FILE *fp, u_int16 *format, u_int16 *channels,
+                          u_int32 *rate, u_int16 *blockAlign) {
+  u_int8 h[16];
+  u_int32 size;
+
+  *format = *channels = *blockAlign = 0;
+  *rate = 0;
+  if (fread(h, 1, 12, fp) != 12 ||
+      memcmp(h, "RIFF", 4) || memcmp(h+8, "WAVE", 4)) {
+    return -1;
+  }
+  while (fread(h, 1, 8, fp) == 8) {
+    size = h[4] | (h[5] << 8) | ((u_int32)h[6] << 16) | ((u_int32)h[7] << 24);
+    if (!memcmp(h, "data", 4)) {
+      return *format ? 0 : -1;
+    }
+    if (!memcmp(h, "fmt ", 4)) {
+      /* Format tag, channels, samplerate, bytes per second, block align */
+      if (size < 14 || fread(h, 1, 14, fp) != 14) {
+        return -1;
+      }
+      *format = h[0] | (h[1] << 8);
+      *channels = h[2] | (h[3] << 8);
+      *rate = h[4] | (h[5] << 8) | ((u_int32)h[6] << 16) |
+        ((u_int32)h[7] << 24);
+      *blockAlign = h[12] | (h[13] << 8);
+      size -= 14;
+    }
+    fseek(fp, (size+1) & ~1UL, SEEK_CUR);
+  }
+  return -1;
+}
+
+
+/*
+  Decodes a G.711 u-law or A-law, or an IMA ADPCM RIFF WAV recording
+  inName into a 16-bit PCM RIFF WAV file outName. IMA ADPCM blocks are
+  decoded in threads threads (0 = one per CPU).
+  Returns 0 on success, or -1 on failure.
+*/
+int VSTestDecodeRecording(const char *inName, const char *outName,
+                          int threads) {
+  static u_int8 inBuf[DECODE_CHUNK_BYTES];
+  static s_int16 outBuf[2*DECODE_CHUNK_BYTES]; // IMA: <= 2 samples per byte
+  u_int8 riff[RIFF_HEADER_SIZE];
+  u_int16 format, channels, blockAlign, recMode;
+  u_int32 rate, chunk, n, samples, dataBytes = 0;
+  u_int32 startTime = GetMicroseconds();
+  FILE *inFp, *outFp;
+
+  if (!(inFp = fopen(inName, "rb"))) {
+    printf("Failed opening %s for reading\n", inName);
+    return -1;
+  }
+  if (ReadRiffFormat(inFp, &format, &channels, &rate, &blockAlign) ||
+      channels < 1 || channels > 2 ||
+      (format != 0x0006 && format != 0x0007 && format != 0x0011) ||
+      (format == 0x0011 && (blockAlign < 8*channels ||
+                            blockAlign % (4*channels)))) {
+    printf("%s is not a G.711 or IMA ADPCM RIFF WAV file\n", inName);
+    fclose(inFp);
+    return -1;
+  }
+  if (!(outFp = fopen(outName, "wb"))) {
+    printf("Failed opening %s for writing\n", outName);
+    fclose(inFp);
+    return -1;
+  }
+
+  recMode = RM_63_FORMAT_PCM | ((channels == 2) ?
+                                RM_63_ADC_MODE_JOINT_AGC_STEREO :
+                                RM_63_ADC_MODE_MONO);
+  MakeRiffHeader(riff, recMode, (u_int16)rate, 0xFFFFFFFFU);
+  fwrite(riff, 1, RIFF_HEADER_SIZE, outFp);
+
+  chunk = (format == 0x0011) ?
+    DECODE_CHUNK_BYTES / blockAlign * blockAlign : DECODE_CHUNK_BYTES;
+  while ((n = fread(inBuf, 1, chunk, inFp)) > 0) {
+    if (format == 0x0011) {
+      /* A partial block at the end is left out */
+      samples = HostImaDecode(outBuf, inBuf, n/blockAlign, blockAlign,
+                              channels, threads) * channels;
+    } else {
+      HostG711Decode(outBuf, inBuf, n, format == 0x0006);
+      samples = n;
+    }
+    SamplesToLittleEndian(outBuf, samples);
+    fwrite(outBuf, 2, samples, outFp);
+    dataBytes += 2*samples;
+  }
+
+  MakeRiffHeader(riff, recMode, (u_int16)rate, dataBytes);
+  HostFilePatch(outFp, riff, RIFF_HEADER_SIZE, 0);
+  fclose(inFp);
+  if (fclose(outFp)) {
+    printf("Failed writing %s\n", outName);
+    return -1;
+  }
+  printf("Decoded %s: %lu samples in %lu ms\n", inName, dataBytes/2,
+         (GetMicroseconds()-startTime)/1000);
+  return 0;
+}
+
+#endif /* PLAYER_HOST */
@@ -0,0 +1,93 @@
+/*
+
+  VLSI Solution generic microcontroller example player / recorder for
+  VS1063: byte order conversions.
+
+*/
+
+#include <string.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "player1063.h"
+
+
+/*
+  Converts words 16-bit values in host byte order to big-endian byte
+  order (most significant byte first), in place. data doesn't need to
+  be aligned.
+
+  Used by ReadSciBurst() on every burst of recorded data and telemetry.
+  On little-endian hosts with AVX2, SSSE3 or NEON the conversion is
+  done 16 or 8 words at a time with byte shuffles, and with SSE2 with
+  shifts. The scalar loop that handles the rest works with either byte
+  order. swapbench.c checks the
+  results and compares the speed with splitting each word into bytes.
+*/
+void WordsToBigEndian(u_int8 *data, u_int32 words) {
+  u_int32 i = 0;
+
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#if defined(__AVX2__)
+  const __m256i swap32 = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+                                          9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6,
+                                          9, 8, 11, 10, 13, 12, 15, 14);
+  for (; i+16 <= words; i += 16) {
+    __m256i *p = (__m256i *)(data+2*i);
+    _mm256_storeu_si256(p, _mm256_shuffle_epi8(_mm256_loadu_si256(p),
+                                               swap32));
+  }
+#endif
+#if defined(__SSSE3__)
+  {
+    const __m128i swap16 = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6,
+                                         9, 8, 11, 10, 13, 12, 15, 14);
+    for (; i+8 <= words; i += 8) {
+      __m128i *p = (__m128i *)(data+2*i);
+      _mm_storeu_si128(p, _mm_shuffle_epi8(_mm_loadu_si128(p), swap16));
+    }
+  }
+#elif defined(__SSE2__)
+  for (; i+8 <= words; i += 8) {
+    __m128i *p = (__m128i *)(data+2*i);
+    __m128i v = _mm_loadu_si128(p);
+    _mm_storeu_si128(p, _mm_or_si128(_mm_slli_epi16(v, 8),
+                                     _mm_srli_epi16(v, 8)));
+  }
+#elif defined(__ARM_NEON)
+  for (; i+8 <= words; i += 8) {
+    vst1q_u8(data+2*i, vrev16q_u8(vld1q_u8(data+2*i)));
+  }
+#endif
+#endif /* little-endian */
+
+  for (; i<words; i++) {
+    u_int16 w;
+    memcpy(&w, data+2*i, 2);
+    data[2*i]   = (u_int8)(w >> 8);
+    data[2*i+1] = (u_int8)(w & 0xFF);
+  }
+}
+
+
+/*
+  Converts n 16-bit samples in host byte order to little-endian byte
+  order, as in RIFF WAV files, in place.
+*/
+void SamplesToLittleEndian(s_int16 *s, u_int32 n) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  u_int32 i;
+
+  for (i=0; i<n; i++) {
+    s[i] = (s_int16)((u_int16)s[i] >> 8 | (u_int16)s[i] << 8);
+  }
+#else
+  (void)s;
+  (void)n;
+#endif
+}
+
+
@@ -0,0 +1,1776 @@
+/*
+
+  Host (Linux) support functions for the VS1063 example player / recorder.
+
+  These are the operating system dependent parts of the player. They
+  are only used if PLAYER_HOST is defined in player1063.h.
+
+*/
+
+#define _GNU_SOURCE /* For CPU affinity and fallocate() */
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "playerhost.h"
+
+#define HOST_RT_STACK_SIZE     (256*1024)
+#define HOST_RT_STACK_PREFAULT (64*1024)
+#define HOST_CMD_QUEUE_SIZE    64 /* Must be a power of two */
+#define HOST_WRITER_RING_SIZE  (256*1024) /* Must be a power of two */
+#define HOST_WRITER_CHUNK      (16*1024)  /* Divides HOST_WRITER_RING_SIZE */
+#define HOST_WRITER_PREALLOC   (8*1024*1024)
+#define HOST_WRITER_SPLITS     4  /* Must be a power of two */
+#define HOST_WRITER_FIXUP_SIZE 64
+#define HOST_WRITER_SINKS      4
+#define HOST_SINK_WAKE         2048 /* Power of two, <= HOST_WRITER_CHUNK */
+#define HOST_SINK_MARGIN       (HOST_WRITER_RING_SIZE/2) /* Max sink lag */
+#define HOST_SINK_POLL_MS      100
+#define HOST_SINK_STOP_MS      1000
+#define HOST_SNAPSHOT_WORDS    64
+#define HOST_LOG_ENTRIES       256 /* Must be a power of two */
+#define HOST_LOG_ARGS          8
+#define HOST_READER_RING_SIZE  (256*1024) /* Must be a power of two */
+#define HOST_READER_CHUNK      (16*1024)
+#define HOST_READER_POLL_MS    2
+#define HOST_UI_KEYS           16 /* Must be a power of two */
+#define HOST_DECODE_THREADS    16
+
+
+/* Each feeder thread has its own timer */
+static __thread int timerFd = -1;
+
+/* Command queue slot. seq tells whose turn it is to use the slot:
+   seq == position means free for the producer that claimed position,
+   seq == position+1 means filled and ready for the consumer. */
+struct HostCmdSlot {
+  atomic_ulong seq;
+  int cmd;
+  s_int32 arg;
+};
+
+static struct HostCmdSlot cmdQueue[HOST_CMD_QUEUE_SIZE];
+static atomic_ulong cmdTail;    // Next position for producers
+static unsigned long cmdHead;   // Next position for the consumer
+static int cmdFd = -1;          // eventfd, signalled by HostCmdPost()
+static pthread_once_t cmdOnce = PTHREAD_ONCE_INIT;
+
+/* Latest snapshot, published with a sequence lock: seq is odd while
+   the snapshot is being written, and 0 before the first one. The data
+   is kept in atomic words so that readers racing with the writer
+   don't cause undefined behaviour; they just retry. */
+static atomic_ulong snapshotSeq;
+static atomic_uint snapshotData[HOST_SNAPSHOT_WORDS];
+
+
+/*
+  Creates the timer used by HostSleep() for the calling thread.
+  Returns 0 on success.
+*/
+int HostTimerInit(void) {
+  if (timerFd < 0) {
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  }
+  return (timerFd < 0) ? -1 : 0;
+}
+
+
+static void HostCmdInit(void) {
+  int i;
+
+  for (i=0; i<HOST_CMD_QUEUE_SIZE; i++) {
+    atomic_init(&cmdQueue[i].seq, i);
+  }
+  atomic_init(&cmdTail, 0);
+  cmdFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+}
+
+
+/*
+  Sleeps for us microseconds on a timerfd. The feeder only wakes up
+  when the timer expires or a command is posted with HostCmdPost(),
+  so there is no polling in between.
+*/
+void HostSleep(u_int32 us) {
+  struct itimerspec its;
+  struct pollfd fds[2];
+  unsigned long long expirations;
+
+  if (!us) {
+    return;
+  }
+
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = us / 1000000;
+  its.it_value.tv_nsec = (us % 1000000) * 1000;
+
+  if (HostTimerInit() || timerfd_settime(timerFd, 0, &its, NULL)) {
+    nanosleep(&its.it_value, NULL);
+    return;
+  }
+
+  pthread_once(&cmdOnce, HostCmdInit);
+  fds[0].fd = timerFd;
+  fds[0].events = POLLIN;
+  fds[1].fd = cmdFd;
+  fds[1].events = POLLIN;
+  while (poll(fds, (cmdFd < 0) ? 1 : 2, -1) < 0 && errno == EINTR)
+    ;
+  /* A timer that is still running is restarted by the next call, which
+     also clears any expirations left over. */
+  if (fds[1].revents & POLLIN) {
+    read(cmdFd, &expirations, sizeof(expirations));
+  }
+}
+
+
+/*
+  Posts a command to the player. May be called from any number of
+  threads at the same time, and never blocks. Wakes up the player if
+  it is sleeping in HostSleep().
+  Returns 0 on success, or -1 if the queue is full.
+*/
+int HostCmdPost(int cmd, s_int32 arg) {
+  unsigned long pos, seq;
+  struct HostCmdSlot *slot;
+  static const unsigned long long one = 1;
+
+  pthread_once(&cmdOnce, HostCmdInit);
+
+  pos = atomic_load_explicit(&cmdTail, memory_order_relaxed);
+  while (1) {
+    long diff;
+    slot = &cmdQueue[pos & (HOST_CMD_QUEUE_SIZE-1)];
+    seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    diff = (long)(seq - pos);
+    if (!diff) {
+      /* Slot is free, try to claim it */
+      if (atomic_compare_exchange_weak_explicit(&cmdTail, &pos, pos+1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return -1;                // Full
+    } else {
+      pos = atomic_load_explicit(&cmdTail, memory_order_relaxed);
+    }
+  }
+
+  slot->cmd = cmd;
+  slot->arg = arg;
+  atomic_store_explicit(&slot->seq, pos+1, memory_order_release);
+
+  if (cmdFd >= 0) {
+    write(cmdFd, &one, sizeof(one));
+  }
+  return 0;
+}
+
+
+/*
+  Gets the next command from the queue. Must only be called from the
+  player thread. Returns 1 if a command was available, 0 otherwise.
+*/
+int HostCmdGet(int *cmd, s_int32 *arg) {
+  struct HostCmdSlot *slot;
+
+  pthread_once(&cmdOnce, HostCmdInit);
+
+  slot = &cmdQueue[cmdHead & (HOST_CMD_QUEUE_SIZE-1)];
+  if (atomic_load_explicit(&slot->seq, memory_order_acquire) != cmdHead+1) {
+    return 0;
+  }
+  *cmd = slot->cmd;
+  *arg = slot->arg;
+  atomic_store_explicit(&slot->seq, cmdHead+HOST_CMD_QUEUE_SIZE,
+                        memory_order_release);
+  cmdHead++;
+  return 1;
+}
+
+
+/*
+  Publishes a snapshot of at most 4*HOST_SNAPSHOT_WORDS bytes. Must
+  only be called from one thread, and never waits.
+*/
+void HostSnapshotPublish(const void *data, u_int32 bytes) {
+  unsigned int w[HOST_SNAPSHOT_WORDS] = {0};
+  unsigned long seq = atomic_load_explicit(&snapshotSeq,
+                                           memory_order_relaxed);
+  u_int32 i, n = (bytes + sizeof(w[0]) - 1) / sizeof(w[0]);
+
+  if (bytes > sizeof(w)) {
+    return;
+  }
+  memcpy(w, data, bytes);
+  atomic_store_explicit(&snapshotSeq, seq+1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  for (i=0; i<n; i++) {
+    atomic_store_explicit(&snapshotData[i], w[i], memory_order_relaxed);
+  }
+  atomic_store_explicit(&snapshotSeq, seq+2, memory_order_release);
+}
+
+
+/*
+  Gets the latest snapshot published with HostSnapshotPublish(). Can
+  be called from any thread, and only retries if the snapshot is
+  being written at the same time.
+  Returns 0 on success, or -1 if nothing has been published yet.
+*/
+int HostSnapshotRead(void *data, u_int32 bytes) {
+  unsigned int w[HOST_SNAPSHOT_WORDS];
+  unsigned long seq1, seq2;
+  u_int32 i, n = (bytes + sizeof(w[0]) - 1) / sizeof(w[0]);
+
+  if (bytes > sizeof(w)) {
+    return -1;
+  }
+  do {
+    seq1 = atomic_load_explicit(&snapshotSeq, memory_order_acquire);
+    if (!seq1) {
+      return -1;
+    }
+    for (i=0; i<n; i++) {
+      w[i] = atomic_load_explicit(&snapshotData[i], memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    seq2 = atomic_load_explicit(&snapshotSeq, memory_order_relaxed);
+  } while (seq1 != seq2 || (seq1 & 1));
+
+  memcpy(data, w, bytes);
+  return 0;
+}
+
+
+/*
+  Returns CPU time used by the calling thread in microseconds.
+*/
+u_int32 HostCpuMicroseconds(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (u_int32)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+
+struct HostRtStart {
+  void (*func)(void *);
+  void *arg;
+};
+
+static void *HostRtThread(void *p) {
+  struct HostRtStart *start = p;
+  volatile u_int8 stack[HOST_RT_STACK_PREFAULT];
+  int i;
+
+  /* Touch the stack so that the feeder doesn't take page faults on it
+     later. Together with mlockall() it then stays resident. */
+  for (i=0; i<HOST_RT_STACK_PREFAULT; i+=256) {
+    stack[i] = 0;
+  }
+  (void)stack[0];
+  HostTimerInit();
+  start->func(start->arg);
+  return NULL;
+}
+
+
+/*
+  Runs func(arg) in a real-time thread and waits for it to finish.
+
+  The thread is run with SCHED_FIFO at the given priority, pinned to
+  the given CPU (or any CPU if cpu < 0). All memory of the process,
+  including static buffers, is locked into RAM for the duration.
+
+  Returns 0 on success, or -1 if the thread couldn't be set up, which
+  is typically because the process lacks CAP_SYS_NICE / CAP_IPC_LOCK
+  or a large enough RLIMIT_RTPRIO / RLIMIT_MEMLOCK.
+*/
+int HostRtRun(void (*func)(void *), void *arg, int cpu, int priority) {
+  struct HostRtStart start;
+  struct sched_param sp;
+  pthread_attr_t attr;
+  pthread_t thread;
+  cpu_set_t cpus;
+  int res;
+
+  if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+    return -1;
+  }
+
+  start.func = func;
+  start.arg = arg;
+  memset(&sp, 0, sizeof(sp));
+  sp.sched_priority = priority;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, HOST_RT_STACK_SIZE);
+  pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+  pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+  pthread_attr_setschedparam(&attr, &sp);
+  if (cpu >= 0) {
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+  }
+
+  res = pthread_create(&thread, &attr, HostRtThread, &start);
+  pthread_attr_destroy(&attr);
+  if (!res) {
+    pthread_join(thread, NULL);
+  }
+
+  munlockall();
+  return res ? -1 : 0;
+}
+
+
+
+
+/*
+
+  File prefetch.
+
+  In real-time mode the feeder doesn't read the file itself. A reader
+  thread reads it into a single-producer, single-consumer ring ahead of
+  time, and HostReaderRead() only copies from the ring. The feeder side
+  makes no system calls and never waits: the reader thread polls the
+  ring every HOST_READER_POLL_MS instead of being woken up.
+
+  Seeking is asynchronous. HostReaderSeek() posts the new position,
+  and HostReaderRead() returns no data until the reader thread has
+  moved there. The data read before the seek is then thrown away.
+
+*/
+static u_int8 readerRing[HOST_READER_RING_SIZE];
+static atomic_ulong readerHead;  // Bytes taken by the feeder
+static atomic_ulong readerTail;  // Bytes read from the file
+static atomic_int readerEof;
+static atomic_int readerStop;
+static atomic_ulong readerSeekReq;  // Seeks posted by the feeder
+static atomic_ulong readerSeekAck;  // Seeks done by the reader thread
+static atomic_ulong readerSeekBase; // Ring position of the new data
+static atomic_long readerSeekPos;
+static atomic_long readerQueued; // In the pipe or socket, or -1
+static int readerFd = -1;
+static long readerSize;          // File size, or -1 if not seekable
+static int readerDiscard;        // Feeder: drop data up to readerSeekBase
+static pthread_t readerThread;
+
+
+static void *HostReaderThread(void *p) {
+  struct timespec ts = {0, HOST_READER_POLL_MS*1000000L};
+
+  while (!atomic_load_explicit(&readerStop, memory_order_acquire)) {
+    unsigned long req = atomic_load_explicit(&readerSeekReq,
+                                             memory_order_acquire);
+    unsigned long tail = atomic_load_explicit(&readerTail,
+                                              memory_order_relaxed);
+    unsigned long offset = tail & (HOST_READER_RING_SIZE-1);
+    unsigned long space = HOST_READER_RING_SIZE -
+      (tail - atomic_load_explicit(&readerHead, memory_order_acquire));
+    ssize_t n;
+
+    if (req != atomic_load_explicit(&readerSeekAck, memory_order_relaxed)) {
+      off_t pos = atomic_load_explicit(&readerSeekPos, memory_order_relaxed);
+      atomic_store_explicit(&readerEof, lseek(readerFd, pos, SEEK_SET) != pos,
+                            memory_order_relaxed);
+      atomic_store_explicit(&readerSeekBase, tail, memory_order_relaxed);
+      atomic_store_explicit(&readerSeekAck, req, memory_order_release);
+      continue;
+    }
+
+    if (space > HOST_READER_RING_SIZE - offset) {
+      space = HOST_READER_RING_SIZE - offset;
+    }
+    if (space > HOST_READER_CHUNK) {
+      space = HOST_READER_CHUNK;
+    }
+    if (!space || atomic_load_explicit(&readerEof, memory_order_relaxed)) {
+      nanosleep(&ts, NULL);
+      continue;
+    }
+
+    if ((n = read(readerFd, readerRing+offset, space)) < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n > 0) {
+      atomic_store_explicit(&readerTail, tail+n, memory_order_release);
+    } else {
+      atomic_store_explicit(&readerEof, 1, memory_order_release);
+    }
+    if (atomic_load_explicit(&readerQueued, memory_order_relaxed) >= 0) {
+      atomic_store_explicit(&readerQueued, HostInputQueued(p),
+                            memory_order_relaxed);
+    }
+  }
+  return p;
+}
+
+
+/*
+  Starts a thread that reads fp ahead into the prefetch ring. Nothing
+  must have been read from fp through stdio yet.
+  Returns 0 on success, -1 on failure.
+*/
+int HostReaderStart(FILE *fp) {
+  struct stat st;
+
+  readerFd = fileno(fp);
+  readerSize = (!fstat(readerFd, &st) && S_ISREG(st.st_mode)) ?
+    (long)st.st_size : -1;
+  readerDiscard = 0;
+  atomic_store(&readerHead, 0);
+  atomic_store(&readerTail, 0);
+  atomic_store(&readerEof, 0);
+  atomic_store(&readerStop, 0);
+  atomic_store(&readerSeekReq, 0);
+  atomic_store(&readerSeekAck, 0);
+  atomic_store(&readerQueued, HostInputQueued(fp));
+  if (pthread_create(&readerThread, NULL, HostReaderThread, fp)) {
+    readerFd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+
+/*
+  Copies up to bytes of prefetched data to buf. Never blocks.
+  Returns the number of bytes copied, 0 if no data is available yet,
+  or -1 at the end of the file.
+*/
+long HostReaderRead(u_int8 *buf, u_int32 bytes) {
+  unsigned long head = atomic_load_explicit(&readerHead,
+                                            memory_order_relaxed);
+  unsigned long tail;
+  unsigned long offset, avail;
+  int eof;
+
+  if (atomic_load_explicit(&readerSeekAck, memory_order_acquire) !=
+      atomic_load_explicit(&readerSeekReq, memory_order_relaxed)) {
+    return 0;                   // Still seeking
+  }
+  if (readerDiscard) {
+    head = atomic_load_explicit(&readerSeekBase, memory_order_relaxed);
+    readerDiscard = 0;
+  }
+  eof = atomic_load_explicit(&readerEof, memory_order_acquire);
+  tail = atomic_load_explicit(&readerTail, memory_order_acquire);
+  if (head == tail) {
+    atomic_store_explicit(&readerHead, head, memory_order_release);
+    return eof ? -1 : 0;
+  }
+
+  offset = head & (HOST_READER_RING_SIZE-1);
+  avail = tail - head;
+  if (avail > HOST_READER_RING_SIZE - offset) {
+    avail = HOST_READER_RING_SIZE - offset;
+  }
+  if (avail > bytes) {
+    avail = bytes;
+  }
+  memcpy(buf, readerRing+offset, avail);
+  atomic_store_explicit(&readerHead, head+avail, memory_order_release);
+  return avail;
+}
+
+
+/*
+  Makes the reader thread continue from file position pos. Data read
+  before that is dropped.
+  Returns 0 if the seek was posted, -1 if the file isn't seekable or
+  pos is past its end.
+*/
+int HostReaderSeek(long pos) {
+  if (readerSize < 0 || pos < 0 || pos > readerSize) {
+    return -1;
+  }
+  readerDiscard = 1;
+  atomic_store_explicit(&readerSeekPos, pos, memory_order_relaxed);
+  atomic_fetch_add_explicit(&readerSeekReq, 1, memory_order_release);
+  return 0;
+}
+
+
+/*
+  Like HostInputQueued() for the prefetched file: returns how many
+  bytes are in the ring and queued in the pipe or socket, or -1 if
+  the file is not a pipe or socket.
+*/
+long HostReaderQueued(void) {
+  long queued = atomic_load_explicit(&readerQueued, memory_order_relaxed);
+
+  if (queued < 0) {
+    return -1;
+  }
+  return queued + (long)(atomic_load_explicit(&readerTail,
+                                              memory_order_acquire) -
+                         atomic_load_explicit(&readerHead,
+                                              memory_order_relaxed));
+}
+
+
+void HostReaderStop(void) {
+  if (readerFd >= 0) {
+    atomic_store_explicit(&readerStop, 1, memory_order_release);
+    pthread_join(readerThread, NULL);
+    readerFd = -1;
+  }
+}
+
+
+
+
+/*
+
+  User interface thread.
+
+  In real-time mode GetUICommand() is polled by a thread of its own,
+  which passes the keys to the feeder through a small ring. A key that
+  doesn't fit is dropped.
+
+*/
+static int uiRing[HOST_UI_KEYS];
+static atomic_ulong uiHead, uiTail;
+static atomic_int uiStop;
+static int (*uiPoll)(void);
+static u_int32 uiInterval;
+static pthread_t uiThread;
+static int uiRunning;
+
+
+static void *HostUiThread(void *p) {
+  struct timespec ts;
+
+  ts.tv_sec = uiInterval / 1000000;
+  ts.tv_nsec = (uiInterval % 1000000) * 1000L;
+  while (!atomic_load_explicit(&uiStop, memory_order_acquire)) {
+    unsigned long tail = atomic_load_explicit(&uiTail, memory_order_relaxed);
+    int c = uiPoll();
+
+    if (c != -1 &&
+        tail - atomic_load_explicit(&uiHead, memory_order_acquire) <
+        HOST_UI_KEYS) {
+      uiRing[tail & (HOST_UI_KEYS-1)] = c;
+      atomic_store_explicit(&uiTail, tail+1, memory_order_release);
+    }
+    nanosleep(&ts, NULL);
+  }
+  return p;
+}
+
+
+/*
+  Starts a thread that calls poll() every us microseconds.
+  Returns 0 on success, -1 on failure.
+*/
+int HostUiStart(int (*poll)(void), u_int32 us) {
+  uiPoll = poll;
+  uiInterval = us;
+  atomic_store(&uiHead, 0);
+  atomic_store(&uiTail, 0);
+  atomic_store(&uiStop, 0);
+  uiRunning = !pthread_create(&uiThread, NULL, HostUiThread, NULL);
+  return uiRunning ? 0 : -1;
+}
+
+
+/*
+  Returns the next key from the user interface thread, or -1 if there
+  is none. Never blocks.
+*/
+int HostUiGet(void) {
+  unsigned long head = atomic_load_explicit(&uiHead, memory_order_relaxed);
+  int c;
+
+  if (head == atomic_load_explicit(&uiTail, memory_order_acquire)) {
+    return -1;
+  }
+  c = uiRing[head & (HOST_UI_KEYS-1)];
+  atomic_store_explicit(&uiHead, head+1, memory_order_release);
+  return c;
+}
+
+
+void HostUiStop(void) {
+  if (uiRunning) {
+    atomic_store_explicit(&uiStop, 1, memory_order_release);
+    pthread_join(uiThread, NULL);
+    uiRunning = 0;
+  }
+}
+
+
+
+
+/*
+
+  Recording writer.
+
+  The recorder puts data into a single-producer, single-consumer ring,
+  and a separate writer thread writes it to the file. That way a slow
+  storage device doesn't stall reading data from VS10xx. The writer
+  writes in whole HOST_WRITER_CHUNK blocks, so writes are both large
+  and aligned to the chunk size in the file, except for the last one.
+  For regular files, disk space is reserved HOST_WRITER_PREALLOC bytes
+  at a time with fallocate() so that the file system doesn't have to
+  allocate blocks on each write. What wasn't used is released at the end.
+
+  Sinks added with HostWriterAddSink() get a copy of the same stream
+  for e.g. a live-stream socket or an analysis pipe. Each sink thread
+  has its own read position. Only the file writer can make the ring
+  full: a sink that can't keep up skips data instead of holding up
+  reading from VS10xx or the others. As the recorder may then write
+  over data a sink is reading, the sink copies each chunk out of the
+  ring first, checks that the recorder has not come near it in the
+  meantime, and only then sends it.
+
+  For segmented recording, the recorder marks split points into the
+  stream with HostWriterSplit(). When the writer reaches a split point,
+  it finishes the current file, optionally rewriting its header, and
+  continues in the next file, which it has already opened beforehand.
+
+*/
+struct HostSplit {
+  unsigned long pos;             // Ring position where the next file starts
+  u_int8 fixup[HOST_WRITER_FIXUP_SIZE]; // Written at start of ending file
+  u_int32 fixupBytes;
+};
+
+static u_int8 writerRing[HOST_WRITER_RING_SIZE];
+static atomic_ulong writerHead;  // Bytes written to the file
+static atomic_ulong writerTail;  // Bytes put into the ring
+static atomic_int writerStop;
+static int writerError;
+static int writerFd = -1;        // eventfd, wakes up the writer thread
+static FILE *writerFp;
+static pthread_t writerThread;
+static int writerPrealloc;       // Preallocate space for a regular file
+static off_t writerAllocated;    // How much space has been preallocated
+static unsigned long writerFileStart; // Ring position where writerFp starts
+static struct HostSplit writerSplit[HOST_WRITER_SPLITS];
+static atomic_ulong splitHead, splitTail;
+static const char *writerPattern; // Segment file name pattern, or NULL
+static int writerIndex;           // Number of the current segment
+static FILE *writerNext;          // Next segment file, opened in advance
+static char writerNextName[256];
+
+static int HostIsRegularFile(FILE *fp) {
+  struct stat st;
+
+  return !fstat(fileno(fp), &st) && S_ISREG(st.st_mode);
+}
+
+
+static void HostWriterOpenNext(void) {
+  if (writerPattern && !writerNext) {
+    snprintf(writerNextName, sizeof(writerNextName), writerPattern,
+             writerIndex+1);
+    writerNext = fopen(writerNextName, "wb");
+  }
+}
+
+
+/*
+  Finishes the current file: flushes it, releases preallocated space
+  that wasn't used, and writes fixup at the start of it, if given.
+  Returns 0 on success.
+*/
+static int HostWriterFinishFile(const u_int8 *fixup, u_int32 fixupBytes) {
+  off_t size = atomic_load(&writerHead) - writerFileStart;
+  int res = 0;
+
+  if (fflush(writerFp)) {
+    res = -1;
+  }
+  /* Truncating to the current size releases space reserved past it */
+  if (writerPrealloc && writerAllocated > size &&
+      ftruncate(fileno(writerFp), size)) {
+    res = -1;
+  }
+  if (fixupBytes && HostIsRegularFile(writerFp) &&
+      pwrite(fileno(writerFp), fixup, fixupBytes, 0) != (ssize_t)fixupBytes) {
+    res = -1;
+  }
+  return res;
+}
+
+
+/*
+  Switches from the current file to the next one at a split point.
+*/
+static void HostWriterRotate(const struct HostSplit *sp) {
+  if (HostWriterFinishFile(sp->fixup, sp->fixupBytes)) {
+    writerError = 1;
+  }
+  fclose(writerFp);
+
+  HostWriterOpenNext();         // Only if opening in advance failed
+  if (!writerNext) {
+    /* Nowhere to write, so there's nothing better to do than to start
+       throwing data away. */
+    writerError = 1;
+    writerFp = fopen("/dev/null", "wb");
+  } else {
+    writerFp = writerNext;
+    writerNext = NULL;
+  }
+  writerIndex++;
+  writerFileStart = sp->pos;
+  writerPrealloc = HostIsRegularFile(writerFp);
+  writerAllocated = 0;
+  HostWriterOpenNext();
+}
+
+
+static void *HostWriterThread(void *p) {
+  unsigned long long events;
+
+  while (1) {
+    unsigned long head = atomic_load_explicit(&writerHead,
+                                              memory_order_relaxed);
+    unsigned long tail = atomic_load_explicit(&writerTail,
+                                              memory_order_acquire);
+    int stop = atomic_load_explicit(&writerStop, memory_order_acquire);
+    unsigned long sh = atomic_load_explicit(&splitHead, memory_order_relaxed);
+    struct HostSplit *sp = NULL;
+    unsigned long offset = head & (HOST_WRITER_RING_SIZE-1);
+    unsigned long filePos = head - writerFileStart;
+    unsigned long bytes;
+
+    if (sh != atomic_load_explicit(&splitTail, memory_order_acquire)) {
+      sp = &writerSplit[sh & (HOST_WRITER_SPLITS-1)];
+      tail = sp->pos;
+    }
+
+    if (sp || stop) {
+      bytes = tail - head;
+    } else {
+      /* Whole chunks only, aligned to file position */
+      bytes = ((filePos + tail - head) & ~(HOST_WRITER_CHUNK-1UL));
+      bytes = (bytes > filePos) ? bytes - filePos : 0;
+    }
+
+    if (bytes) {
+      if (bytes > HOST_WRITER_RING_SIZE - offset) {
+        bytes = HOST_WRITER_RING_SIZE - offset;
+      }
+      if (writerPrealloc && (off_t)(filePos+bytes) > writerAllocated) {
+        writerAllocated += HOST_WRITER_PREALLOC;
+        if (fallocate(fileno(writerFp), FALLOC_FL_KEEP_SIZE,
+                      0, writerAllocated)) {
+          writerPrealloc = 0;   // Not supported, don't try again
+        }
+      }
+      if (fwrite(writerRing+offset, 1, bytes, writerFp) != bytes) {
+        writerError = 1;
+      }
+      atomic_store_explicit(&writerHead, head+bytes, memory_order_release);
+    } else if (sp) {
+      HostWriterRotate(sp);
+      atomic_store_explicit(&splitHead, sh+1, memory_order_release);
+    } else if (stop) {
+      break;
+    } else {
+      while (read(writerFd, &events, sizeof(events)) < 0 && errno == EINTR)
+        ;
+    }
+  }
+  return p;
+}
+
+
+struct HostSink {
+  int fd;
+  int eventFd;                   // Wakes up the sink thread
+  pthread_t thread;
+  int running;
+  atomic_ulong sent;             // Bytes sent
+  atomic_ulong dropped;          // Bytes skipped because sink was too slow
+  int error;
+  u_int8 buf[HOST_WRITER_CHUNK]; // Chunk being sent, copied from the ring
+};
+
+static struct HostSink writerSinks[HOST_WRITER_SINKS];
+static int writerSinkCount;
+
+
+/*
+  Sends data to a sink without blocking and without SIGPIPE.
+*/
+static ssize_t HostSinkSend(int fd, const u_int8 *data, size_t bytes) {
+  ssize_t n = send(fd, data, bytes, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+  if (n < 0 && errno == ENOTSOCK) {
+    n = write(fd, data, bytes); // Pipe or file, made non-blocking
+  }
+  return n;
+}
+
+
+/*
+  Skips the sink from pos to the current end of the ring. Returns the
+  new position.
+*/
+static unsigned long HostSinkSkip(struct HostSink *s, unsigned long pos) {
+  unsigned long tail = atomic_load_explicit(&writerTail,
+                                            memory_order_acquire);
+
+  atomic_fetch_add_explicit(&s->dropped, tail-pos, memory_order_relaxed);
+  return tail;
+}
+
+
+static void *HostSinkThread(void *p) {
+  struct HostSink *s = p;
+  unsigned long pos = 0;        // Ring position of the next chunk
+  unsigned long bufBytes = 0, bufSent = 0;
+  unsigned long long events;
+
+  while (1) {
+    int stop = atomic_load_explicit(&writerStop, memory_order_acquire);
+    ssize_t n;
+
+    if (bufSent == bufBytes) {
+      unsigned long tail = atomic_load_explicit(&writerTail,
+                                                memory_order_acquire);
+      unsigned long offset = pos & (HOST_WRITER_RING_SIZE-1);
+      unsigned long bytes = tail - pos;
+
+      if (bytes > HOST_SINK_MARGIN) {
+        /* Fallen too far behind, the data may soon be overwritten */
+        pos = HostSinkSkip(s, pos);
+        continue;
+      }
+      if (!bytes) {
+        struct pollfd pfd = {s->eventFd, POLLIN, 0};
+        if (stop) {
+          break;
+        }
+        if (poll(&pfd, 1, HOST_SINK_POLL_MS) > 0) {
+          read(s->eventFd, &events, sizeof(events));
+        }
+        continue;
+      }
+
+      if (bytes > HOST_WRITER_RING_SIZE - offset) {
+        bytes = HOST_WRITER_RING_SIZE - offset;
+      }
+      if (bytes > sizeof(s->buf)) {
+        bytes = sizeof(s->buf);
+      }
+      memcpy(s->buf, writerRing+offset, bytes);
+
+      /* The recorder writes at most HOST_SINK_MARGIN bytes past the end
+         of the ring (see HostWriterSpace()). If it hasn't come within
+         that of pos by now, the copy is intact. Otherwise drop it. */
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load_explicit(&writerTail, memory_order_relaxed) - pos >
+          HOST_SINK_MARGIN) {
+        pos = HostSinkSkip(s, pos);
+        continue;
+      }
+      pos += bytes;
+      bufBytes = bytes;
+      bufSent = 0;
+    }
+
+    if ((n = HostSinkSend(s->fd, s->buf+bufSent, bufBytes-bufSent)) < 0) {
+      struct pollfd pfd = {s->fd, POLLOUT, 0};
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        s->error = 1;           // E.g. the other end has gone away
+        break;
+      }
+      if (!poll(&pfd, 1, stop ? HOST_SINK_STOP_MS : HOST_SINK_POLL_MS) &&
+          stop) {
+        /* Don't hold up stopping forever */
+        atomic_fetch_add_explicit(&s->dropped, bufBytes-bufSent,
+                                  memory_order_relaxed);
+        HostSinkSkip(s, pos);
+        break;
+      }
+      continue;
+    }
+
+    atomic_fetch_add_explicit(&s->sent, n, memory_order_relaxed);
+    bufSent += n;
+  }
+  return p;
+}
+
+
+/*
+  Adds fd as a sink for the next recording. The fd is made non-blocking
+  and must stay open until HostWriterStop() has returned. Sinks are
+  removed with HostWriterRemoveSinks().
+  Returns the sink number, or -1 if there are too many sinks.
+*/
+int HostWriterAddSink(int fd) {
+  struct HostSink *s;
+
+  if (writerSinkCount >= HOST_WRITER_SINKS) {
+    return -1;
+  }
+  s = &writerSinks[writerSinkCount];
+  memset(s, 0, sizeof(*s));
+  s->fd = fd;
+  s->eventFd = -1;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return writerSinkCount++;
+}
+
+
+void HostWriterRemoveSinks(void) {
+  writerSinkCount = 0;
+}
+
+
+/*
+  Gets the statistics of sink i. Returns -1 if there is no such sink,
+  1 if the sink had to be given up because of an error, otherwise 0.
+*/
+int HostWriterSinkStats(int i, u_int32 *sent, u_int32 *dropped) {
+  struct HostSink *s;
+
+  if (i < 0 || i >= writerSinkCount) {
+    return -1;
+  }
+  s = &writerSinks[i];
+  *sent = atomic_load_explicit(&s->sent, memory_order_relaxed);
+  *dropped = atomic_load_explicit(&s->dropped, memory_order_relaxed);
+  return s->error;
+}
+
+
+static void HostSinksStart(void) {
+  int i;
+
+  for (i=0; i<writerSinkCount; i++) {
+    struct HostSink *s = &writerSinks[i];
+    atomic_store(&s->sent, 0);
+    atomic_store(&s->dropped, 0);
+    s->error = 0;
+    if ((s->eventFd = eventfd(0, EFD_CLOEXEC)) >= 0) {
+      s->running = !pthread_create(&s->thread, NULL, HostSinkThread, s);
+    }
+  }
+}
+
+
+static void HostSinksWake(void) {
+  static const unsigned long long one = 1;
+  int i;
+
+  for (i=0; i<writerSinkCount; i++) {
+    if (writerSinks[i].running) {
+      write(writerSinks[i].eventFd, &one, sizeof(one));
+    }
+  }
+}
+
+
+static void HostSinksStop(void) {
+  int i;
+
+  HostSinksWake();
+  for (i=0; i<writerSinkCount; i++) {
+    struct HostSink *s = &writerSinks[i];
+    if (s->running) {
+      pthread_join(s->thread, NULL);
+      s->running = 0;
+    }
+    if (s->eventFd >= 0) {
+      close(s->eventFd);
+      s->eventFd = -1;
+    }
+  }
+}
+
+
+/*
+  Starts the writer thread that writes to fp, and a thread for each
+  sink.
+  Returns 0 on success, -1 on failure.
+*/
+int HostWriterStart(FILE *fp) {
+  writerFp = fp;
+  writerError = 0;
+  writerPrealloc = HostIsRegularFile(fp);
+  writerAllocated = 0;
+  writerFileStart = 0;
+  writerPattern = NULL;
+  writerNext = NULL;
+  atomic_store(&writerHead, 0);
+  atomic_store(&writerTail, 0);
+  atomic_store(&writerStop, 0);
+  atomic_store(&splitHead, 0);
+  atomic_store(&splitTail, 0);
+  if ((writerFd = eventfd(0, EFD_CLOEXEC)) < 0) {
+    return -1;
+  }
+  if (pthread_create(&writerThread, NULL, HostWriterThread, NULL)) {
+    close(writerFd);
+    writerFd = -1;
+    return -1;
+  }
+  HostSinksStart();
+  return 0;
+}
+
+
+/*
+  Makes the writer thread open segment files in advance. Segment file
+  names are made from the printf() pattern with a running number. The
+  current file is number index. Must be called right after
+  HostWriterStart(), before any split.
+*/
+void HostWriterSegments(const char *pattern, int index) {
+  writerPattern = pattern;
+  writerIndex = index;
+  HostWriterOpenNext();
+}
+
+
+/*
+  Returns a pointer to free space in the ring, and in *bytes how much
+  contiguous space there is. *bytes is 0 if the ring is full. At most
+  HOST_SINK_MARGIN bytes are given at a time, see HostSinkThread().
+*/
+u_int8 *HostWriterSpace(u_int32 *bytes) {
+  unsigned long tail = atomic_load_explicit(&writerTail,
+                                            memory_order_relaxed);
+  unsigned long offset = tail & (HOST_WRITER_RING_SIZE-1);
+  unsigned long space = HOST_WRITER_RING_SIZE -
+    (tail - atomic_load_explicit(&writerHead, memory_order_acquire));
+
+  if (space > HOST_WRITER_RING_SIZE - offset) {
+    space = HOST_WRITER_RING_SIZE - offset;
+  }
+  if (space > HOST_SINK_MARGIN) {
+    space = HOST_SINK_MARGIN;
+  }
+  *bytes = space;
+  return writerRing+offset;
+}
+
+
+/*
+  Hands bytes written into the space given by HostWriterSpace() over to
+  the writer thread. The writer is only woken up when there is a new
+  full chunk to write.
+*/
+void HostWriterCommit(u_int32 bytes) {
+  static const unsigned long long one = 1;
+  unsigned long tail = atomic_load_explicit(&writerTail,
+                                            memory_order_relaxed);
+
+  atomic_store_explicit(&writerTail, tail+bytes, memory_order_release);
+  if ((tail ^ (tail+bytes)) & ~(HOST_WRITER_CHUNK-1UL)) {
+    write(writerFd, &one, sizeof(one));
+  }
+  /* Sinks are woken up more often to keep live stream latency low */
+  if ((tail ^ (tail+bytes)) & ~(HOST_SINK_WAKE-1UL)) {
+    HostSinksWake();
+  }
+}
+
+
+/*
+  Ends the current file after the data committed so far. Data
+  committed after this goes to the next segment file. If fixupBytes is
+  non-zero, fixup is written at the start of the ending file before it
+  is closed, e.g. to correct the sizes in its header.
+  Returns 0 on success, -1 if too many splits are already pending.
+*/
+int HostWriterSplit(const u_int8 *fixup, u_int32 fixupBytes) {
+  static const unsigned long long one = 1;
+  unsigned long st = atomic_load_explicit(&splitTail, memory_order_relaxed);
+  struct HostSplit *sp = &writerSplit[st & (HOST_WRITER_SPLITS-1)];
+
+  if (st - atomic_load_explicit(&splitHead, memory_order_acquire) >=
+      HOST_WRITER_SPLITS || fixupBytes > HOST_WRITER_FIXUP_SIZE) {
+    return -1;
+  }
+  sp->pos = atomic_load_explicit(&writerTail, memory_order_relaxed);
+  memcpy(sp->fixup, fixup, fixupBytes);
+  sp->fixupBytes = fixupBytes;
+  atomic_store_explicit(&splitTail, st+1, memory_order_release);
+  write(writerFd, &one, sizeof(one));
+  return 0;
+}
+
+
+/*
+  Returns how many bytes are waiting in the ring.
+*/
+u_int32 HostWriterFill(void) {
+  return atomic_load_explicit(&writerTail, memory_order_relaxed) -
+    atomic_load_explicit(&writerHead, memory_order_acquire);
+}
+
+
+u_int32 HostWriterSize(void) {
+  return HOST_WRITER_RING_SIZE;
+}
+
+
+/*
+  Writes the rest of the data and stops the writer and sink threads.
+  A segment file that was opened in advance but not used is removed.
+  Returns 0 on success, -1 if there were write errors.
+*/
+int HostWriterStop(void) {
+  static const unsigned long long one = 1;
+
+  if (writerFd < 0) {
+    return -1;
+  }
+  atomic_store_explicit(&writerStop, 1, memory_order_release);
+  write(writerFd, &one, sizeof(one));
+  pthread_join(writerThread, NULL);
+  close(writerFd);
+  writerFd = -1;
+  HostSinksStop();
+
+  if (HostWriterFinishFile(NULL, 0)) {
+    writerError = 1;
+  }
+  if (writerNext) {
+    fclose(writerNext);
+    remove(writerNextName);
+    writerNext = NULL;
+  }
+  return writerError ? -1 : 0;
+}
+
+
+/*
+  Returns the file the writer thread was writing to when it stopped.
+  With segments, this is not the file given to HostWriterStart().
+*/
+FILE *HostWriterFile(void) {
+  return writerFp;
+}
+
+
+/*
+  Writes bytes of data to file position offset with a single pwrite().
+  Buffered data is flushed first. The stdio file position doesn't change.
+  Returns 0 on success, -1 on failure.
+*/
+int HostFilePatch(FILE *fp, const void *data, u_int32 bytes, u_int32 offset) {
+  if (fflush(fp)) {
+    return -1;
+  }
+  return (pwrite(fileno(fp), data, bytes, offset) == (ssize_t)bytes) ? 0 : -1;
+}
+
+
+/*
+  Returns how many bytes can be read from fp without waiting: what is
+  left in its stdio buffer, and what is queued in the pipe or socket.
+  Returns -1 for regular files and other inputs without a queue.
+*/
+long HostInputQueued(FILE *fp) {
+  struct stat st;
+  int queued;
+  long buffered = 0;
+
+  if (fstat(fileno(fp), &st) ||
+      !(S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode) || S_ISCHR(st.st_mode)) ||
+      ioctl(fileno(fp), FIONREAD, &queued)) {
+    return -1;
+  }
+#ifdef __GLIBC__
+  buffered = fp->_IO_read_end - fp->_IO_read_ptr;
+#endif
+  return buffered + queued;
+}
+
+
+
+
+/*
+
+  Log ring.
+
+  The playback and recording loops don't print reports themselves.
+  HostLogV() copies the event number, a timestamp and the arguments
+  into a single-producer, single-consumer ring, and a background
+  thread formats them with printf formats given to HostLogStart(). The
+  producer never waits: if the ring is full, the entry is dropped and
+  counted. The thread sleeps on an eventfd while the ring is empty, so
+  the producer only makes a system call to wake it up when putting an
+  entry into an empty ring. HostLogStop() prints what is left and
+  stops the thread.
+
+  HostLogPrintfV() puts a message with a format of its own into the
+  same ring. The format must then stay valid, e.g. a string literal.
+
+  Arguments are taken from the va_list as the conversions in the
+  format tell: %s is a string, which must stay valid, %f, %e and %g
+  are doubles, and other conversions are ints, or longs with an l
+  modifier. At most HOST_LOG_ARGS arguments are stored, and * widths
+  are not supported.
+
+*/
+union HostLogArg {
+  long i;
+  double d;
+  const char *s;
+};
+
+struct HostLogEntry {
+  u_int32 time;
+  const char *format;
+  int args;
+  union HostLogArg arg[HOST_LOG_ARGS];
+};
+
+static struct HostLogEntry logRing[HOST_LOG_ENTRIES];
+static atomic_ulong logHead;    // Entries printed, and flushed
+static atomic_ulong logTail;    // Entries put into the ring
+static atomic_ulong logDropped;
+static const char *const *logFormats;
+static int logEvents;
+static FILE *logFp;
+static pthread_t logThread;
+static int logRunning;
+static int logFd = -1;          // eventfd, wakes up the log thread
+static atomic_int logStop;
+
+
+/*
+  Finds the next conversion in format f. Sets *conv to its conversion
+  character, or to 0 if there are no more, and *isLong if it has an l
+  modifier. Returns a pointer to just after the conversion.
+*/
+static const char *HostLogNextConv(const char *f, char *conv, int *isLong) {
+  while (*f) {
+    if (*f++ != '%') {
+      continue;
+    }
+    if (*f == '%') {
+      f++;
+      continue;
+    }
+    *isLong = 0;
+    while (*f && !isalpha((unsigned char)*f)) {
+      f++;                      // Flags, width, precision
+    }
+    while (*f == 'l' || *f == 'h' || *f == 'z') {
+      if (*f++ != 'h') {
+        *isLong = 1;
+      }
+    }
+    if ((*conv = *f)) {
+      f++;
+    }
+    return f;
+  }
+  *conv = 0;
+  return f;
+}
+
+
+static void HostLogFormat(FILE *fp, const struct HostLogEntry *e) {
+  const char *f = e->format;
+  int i = 0;
+
+  while (*f) {
+    char seg[32];
+    char conv;
+    int isLong;
+    const char *end;
+    size_t len;
+
+    if (*f != '%' || f[1] == '%') {
+      fputc(*f, fp);            // Literal text, only %% to handle
+      f += (*f == '%') ? 2 : 1;
+      continue;
+    }
+
+    end = HostLogNextConv(f, &conv, &isLong);
+    len = end - f;
+    if (len > sizeof(seg)-1) {
+      len = sizeof(seg)-1;
+    }
+    memcpy(seg, f, len);
+    seg[len] = '\0';
+    f = end;
+
+    if (!conv || i >= e->args) {
+      break;
+    } else if (conv == 's') {
+      fprintf(fp, seg, e->arg[i++].s);
+    } else if (strchr("fFeEgGaA", conv)) {
+      fprintf(fp, seg, e->arg[i++].d);
+    } else if (isLong) {
+      fprintf(fp, seg, e->arg[i++].i);
+    } else {
+      fprintf(fp, seg, (int)e->arg[i++].i);
+    }
+  }
+}
+
+
+/*
+  Prints entries until the ring is empty, then sleeps until
+  HostLogPrintfV() puts an entry into the empty ring. logHead and
+  logTail are stored and loaded sequentially consistent on both sides
+  before deciding whether to sleep or wake up, so that a wakeup is
+  never lost.
+*/
+static void *HostLogThread(void *arg) {
+  unsigned long long events;
+
+  while (1) {
+    int stop = atomic_load_explicit(&logStop, memory_order_acquire);
+    unsigned long head = atomic_load_explicit(&logHead, memory_order_relaxed);
+    unsigned long tail = atomic_load(&logTail);
+
+    if (head != tail) {
+      while (head != tail) {
+        HostLogFormat(logFp, &logRing[head & (HOST_LOG_ENTRIES-1)]);
+        head++;
+      }
+      fflush(logFp);
+      atomic_store(&logHead, head);
+    } else if (stop) {
+      break;
+    } else {
+      while (read(logFd, &events, sizeof(events)) < 0 && errno == EINTR)
+        ;
+    }
+  }
+  return arg;
+}
+
+
+/*
+  Starts the thread that prints log entries to fp. formats[event] is
+  the printf format of each of the events. Does nothing if the thread
+  is already running.
+  Returns 0 on success, -1 on failure.
+*/
+int HostLogStart(const char *const *formats, int events, FILE *fp) {
+  if (logRunning) {
+    return 0;
+  }
+  logFormats = formats;
+  logEvents = events;
+  logFp = fp;
+  atomic_store(&logStop, 0);
+  if ((logFd = eventfd(0, EFD_CLOEXEC)) < 0) {
+    return -1;
+  }
+  if (pthread_create(&logThread, NULL, HostLogThread, NULL)) {
+    close(logFd);
+    logFd = -1;
+    return -1;
+  }
+  logRunning = 1;
+  return 0;
+}
+
+
+/*
+  Prints what is left in the log ring and stops the log thread. Must
+  be called from the thread that puts entries into the ring, after the
+  last one. Does nothing if the thread isn't running.
+*/
+void HostLogStop(void) {
+  static const unsigned long long one = 1;
+
+  if (!logRunning) {
+    return;
+  }
+  atomic_store_explicit(&logStop, 1, memory_order_release);
+  write(logFd, &one, sizeof(one));
+  pthread_join(logThread, NULL);
+  close(logFd);
+  logFd = -1;
+  logRunning = 0;
+}
+
+
+/*
+  Puts a message with printf format into the log ring. Must only be
+  called from one thread at a time. Never blocks, and makes a system
+  call only to wake up the log thread if the ring was empty.
+*/
+void HostLogPrintfV(u_int32 time, const char *format, va_list ap) {
+  static const unsigned long long one = 1;
+  unsigned long tail = atomic_load_explicit(&logTail, memory_order_relaxed);
+  unsigned long head = atomic_load_explicit(&logHead, memory_order_acquire);
+  struct HostLogEntry *e = &logRing[tail & (HOST_LOG_ENTRIES-1)];
+  const char *f = format;
+  char conv;
+  int isLong;
+
+  if (tail - head >= HOST_LOG_ENTRIES) {
+    atomic_fetch_add_explicit(&logDropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  e->time = time;
+  e->format = format;
+  e->args = 0;
+  while (e->args < HOST_LOG_ARGS) {
+    union HostLogArg *a = &e->arg[e->args];
+    f = HostLogNextConv(f, &conv, &isLong);
+    if (!conv) {
+      break;
+    }
+    e->args++;
+    if (conv == 's') {
+      a->s = va_arg(ap, const char *);
+    } else if (strchr("fFeEgGaA", conv)) {
+      a->d = va_arg(ap, double);
+    } else if (isLong) {
+      a->i = va_arg(ap, long);
+    } else {
+      a->i = va_arg(ap, int);
+    }
+  }
+  atomic_store(&logTail, tail+1);
+  /* The thread may have gone to sleep only if it had printed all */
+  if (atomic_load(&logHead) == tail) {
+    write(logFd, &one, sizeof(one));
+  }
+}
+
+
+/*
+  Puts an event with one of the formats given to HostLogStart() into
+  the log ring, like HostLogPrintfV().
+*/
+void HostLogV(u_int32 time, int event, va_list ap) {
+  if (event >= 0 && event < logEvents) {
+    HostLogPrintfV(time, logFormats[event], ap);
+  }
+}
+
+
+/*
+  Waits until everything in the log ring has been printed, so that
+  other output doesn't get mixed with it. Returns the number of
+  entries dropped since the last call.
+*/
+u_int32 HostLogFlush(void) {
+  struct timespec ts = {0, 1000000L};
+
+  while (logRunning &&
+         atomic_load_explicit(&logHead, memory_order_acquire) !=
+         atomic_load_explicit(&logTail, memory_order_relaxed)) {
+    nanosleep(&ts, NULL);
+  }
+  return atomic_exchange_explicit(&logDropped, 0, memory_order_relaxed);
+}
+
+
+
+/*
+
+  Recording decoders.
+
+  G.711 and IMA ADPCM recordings are decoded to 16-bit PCM here, so
+  that they can be analysed without generic conversion tools.
+
+  G.711 is decoded with 256-entry tables. With AVX2 or NEON, 16 or 8
+  samples are decoded at a time with the same arithmetic that builds
+  the tables: the segment shift is done with a multiply by a power of
+  two from a byte shuffle, or with a vector shift.
+
+  IMA ADPCM can't be vectorized, as each sample depends on the one
+  before, but the blocks are independent. HostImaDecode() splits the
+  blocks between threads.
+
+  decodetest.c checks both against reference decoders and against
+  recordings in testdata/ decoded with VSTestDecodeRecording(), and
+  measures their throughput.
+
+*/
+static s_int16 ulawTable[256], alawTable[256];
+static pthread_once_t g711Once = PTHREAD_ONCE_INIT;
+
+static const s_int16 imaStep[89] = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41,
+  45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190,
+  209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724,
+  796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272,
+  2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132,
+  7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500,
+  20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int imaIndex[16] = {
+  -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+struct HostImaJob {
+  s_int16 *out;
+  const u_int8 *in;
+  u_int32 blocks;
+  u_int16 blockAlign;
+  int channels;
+};
+
+
+static void HostG711Init(void) {
+  int i;
+
+  for (i=0; i<256; i++) {
+    int x = i ^ 0xFF;
+    int t = (((x & 0x0F) << 3) + 0x84) << ((x >> 4) & 7);
+
+    ulawTable[i] = (s_int16)((x & 0x80) ? 0x84 - t : t - 0x84);
+
+    x = i ^ 0x55;
+    t = ((x & 0x0F) << 4) + 8;
+    if (x & 0x70) {
+      t = (t + 0x100) << (((x >> 4) & 7) - 1);
+    }
+    alawTable[i] = (s_int16)((x & 0x80) ? t : -t);
+  }
+}
+
+
+/*
+  Decodes n G.711 A-law (if alaw is non-zero) or u-law samples.
+*/
+void HostG711Decode(s_int16 *out, const u_int8 *in, u_int32 n, int alaw) {
+  const s_int16 *table = alaw ? alawTable : ulawTable;
+  u_int32 i = 0;
+
+  pthread_once(&g711Once, HostG711Init);
+
+#if defined(__AVX2__)
+  {
+    const __m256i ulawPow2 = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                              0, 0, 0, 0, 0, 0, 0, 0,
+                                              1, 2, 4, 8, 16, 32, 64, -128,
+                                              0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i alawPow2 = _mm256_setr_epi8(1, 1, 2, 4, 8, 16, 32, 64,
+                                              0, 0, 0, 0, 0, 0, 0, 0,
+                                              1, 1, 2, 4, 8, 16, 32, 64,
+                                              0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i lowByte = _mm256_set1_epi16(0x00FF);
+    const __m256i mant = _mm256_set1_epi16(0x0F);
+    const __m256i seg = _mm256_set1_epi16(7);
+    const __m256i sign = _mm256_set1_epi16(0x80);
+    const __m256i one = _mm256_set1_epi16(1);
+
+    for (; i+16 <= n; i += 16) {
+      __m256i x = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(in+i)));
+      __m256i e, t, s;
+
+      if (alaw) {
+        x = _mm256_xor_si256(x, _mm256_set1_epi16(0x55));
+        e = _mm256_and_si256(_mm256_srli_epi16(x, 4), seg);
+        t = _mm256_add_epi16(_mm256_slli_epi16(_mm256_and_si256(x, mant), 4),
+                             _mm256_set1_epi16(8));
+        t = _mm256_add_epi16(t, _mm256_and_si256(
+                               _mm256_cmpgt_epi16(e, _mm256_setzero_si256()),
+                               _mm256_set1_epi16(0x100)));
+        t = _mm256_mullo_epi16(t, _mm256_and_si256(
+                                 _mm256_shuffle_epi8(alawPow2, e), lowByte));
+        s = _mm256_andnot_si256(x, sign);       // Positive if sign bit set
+      } else {
+        x = _mm256_xor_si256(x, lowByte);
+        e = _mm256_and_si256(_mm256_srli_epi16(x, 4), seg);
+        t = _mm256_add_epi16(_mm256_slli_epi16(_mm256_and_si256(x, mant), 3),
+                             _mm256_set1_epi16(0x84));
+        t = _mm256_mullo_epi16(t, _mm256_and_si256(
+                                 _mm256_shuffle_epi8(ulawPow2, e), lowByte));
+        t = _mm256_sub_epi16(t, _mm256_set1_epi16(0x84));
+        s = _mm256_and_si256(x, sign);
+      }
+      /* sign_epi16 negates where s is negative, so s is 0x8001 or 1 */
+      s = _mm256_or_si256(_mm256_slli_epi16(s, 8), one);
+      _mm256_storeu_si256((__m256i *)(out+i), _mm256_sign_epi16(t, s));
+    }
+  }
+#elif defined(__ARM_NEON)
+  {
+    const uint16x8_t mant = vdupq_n_u16(0x0F);
+    const uint16x8_t seg = vdupq_n_u16(7);
+    const uint16x8_t sign = vdupq_n_u16(0x80);
+
+    for (; i+8 <= n; i += 8) {
+      uint16x8_t x = vmovl_u8(vld1_u8(in+i));
+      int16x8_t e, v;
+      uint16x8_t t, neg;
+
+      if (alaw) {
+        x = veorq_u16(x, vdupq_n_u16(0x55));
+        e = vreinterpretq_s16_u16(vandq_u16(vshrq_n_u16(x, 4), seg));
+        t = vaddq_u16(vshlq_n_u16(vandq_u16(x, mant), 4), vdupq_n_u16(8));
+        t = vaddq_u16(t, vandq_u16(vcgtq_s16(e, vdupq_n_s16(0)),
+                                   vdupq_n_u16(0x100)));
+        t = vshlq_u16(t, vmaxq_s16(vsubq_s16(e, vdupq_n_s16(1)),
+                                   vdupq_n_s16(0)));
+        neg = vceqq_u16(vandq_u16(x, sign), vdupq_n_u16(0));
+      } else {
+        x = veorq_u16(x, vdupq_n_u16(0xFF));
+        e = vreinterpretq_s16_u16(vandq_u16(vshrq_n_u16(x, 4), seg));
+        t = vaddq_u16(vshlq_n_u16(vandq_u16(x, mant), 3), vdupq_n_u16(0x84));
+        t = vsubq_u16(vshlq_u16(t, e), vdupq_n_u16(0x84));
+        neg = vtstq_u16(x, sign);
+      }
+      v = vreinterpretq_s16_u16(t);
+      vst1q_s16(out+i, vbslq_s16(neg, vnegq_s16(v), v));
+    }
+  }
+#endif
+
+  for (; i<n; i++) {
+    out[i] = table[in[i]];
+  }
+}
+
+
+/*
+  Decodes one IMA ADPCM block of blockAlign bytes into interleaved
+  samples. Each channel starts with a 4-byte header: the first sample
+  and the step index. After them come 4 bytes (8 samples) of each
+  channel in turn, low nibble first.
+*/
+static void HostImaDecodeBlock(s_int16 *out, const u_int8 *in,
+                               u_int16 blockAlign, int channels) {
+  u_int32 frames = (blockAlign/channels - 4)*2 + 1;
+  int c;
+
+  for (c=0; c<channels; c++) {
+    const u_int8 *h = in+4*c;
+    const u_int8 *d = in+4*channels+4*c;
+    s_int32 pred = (s_int16)(h[0] | (h[1] << 8));
+    int index = (h[2] > 88) ? 88 : h[2];
+    u_int32 k;
+
+    out[c] = (s_int16)pred;
+    for (k=0; k<frames-1; k++) {
+      int nibble = (d[(k >> 3)*4*channels + ((k >> 1) & 3)] >> ((k & 1)*4))
+        & 0xF;
+      s_int32 step = imaStep[index];
+      s_int32 diff = step >> 3;
+
+      if (nibble & 4) {
+        diff += step;
+      }
+      if (nibble & 2) {
+        diff += step >> 1;
+      }
+      if (nibble & 1) {
+        diff += step >> 2;
+      }
+      pred += (nibble & 8) ? -diff : diff;
+      if (pred > 32767) {
+        pred = 32767;
+      } else if (pred < -32768) {
+        pred = -32768;
+      }
+      index += imaIndex[nibble];
+      if (index < 0) {
+        index = 0;
+      } else if (index > 88) {
+        index = 88;
+      }
+      out[(k+1)*channels+c] = (s_int16)pred;
+    }
+  }
+}
+
+
+static void *HostImaThread(void *arg) {
+  const struct HostImaJob *j = arg;
+  u_int32 frames = (j->blockAlign/j->channels - 4)*2 + 1;
+  u_int32 b;
+
+  for (b=0; b<j->blocks; b++) {
+    HostImaDecodeBlock(j->out + b*frames*j->channels,
+                       j->in + b*j->blockAlign, j->blockAlign, j->channels);
+  }
+  return NULL;
+}
+
+
+/*
+  Decodes blocks IMA ADPCM blocks of blockAlign bytes into interleaved
+  samples, splitting the blocks between threads (0 = one per online
+  CPU, at most HOST_DECODE_THREADS). If a thread can't be started, its
+  blocks are decoded by the caller. Returns the number of frames.
+*/
+u_int32 HostImaDecode(s_int16 *out, const u_int8 *in, u_int32 blocks,
+                      u_int16 blockAlign, int channels, int threads) {
+  struct HostImaJob job[HOST_DECODE_THREADS];
+  pthread_t thread[HOST_DECODE_THREADS];
+  int started[HOST_DECODE_THREADS];
+  u_int32 frames, first = 0;
+  int i;
+
+  if (channels < 1 || blockAlign < 8*channels ||
+      blockAlign % (4*channels)) {
+    return 0;
+  }
+  frames = (blockAlign/channels - 4)*2 + 1;
+
+  if (threads <= 0) {
+    threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (threads > HOST_DECODE_THREADS) {
+    threads = HOST_DECODE_THREADS;
+  }
+  if (threads > (int)blocks) {
+    threads = blocks ? (int)blocks : 1;
+  }
+
+  for (i=0; i<threads; i++) {
+    u_int32 n = blocks/threads + (i < (int)(blocks % threads));
+
+    job[i].out = out + first*frames*channels;
+    job[i].in = in + first*blockAlign;
+    job[i].blocks = n;
+    job[i].blockAlign = blockAlign;
+    job[i].channels = channels;
+    first += n;
+    /* The first part is decoded by the calling thread */
+    started[i] = i && !pthread_create(&thread[i], NULL, HostImaThread,
+                                      &job[i]);
+  }
+  for (i=0; i<threads; i++) {
+    if (started[i]) {
+      pthread_join(thread[i], NULL);
+    } else {
+      HostImaThread(&job[i]);
+    }
+  }
+
+  return blocks*frames;
+}
@@ -0,0 +1,53 @@
+/*
+
+  Host (Linux) support functions for the VS1063 example player / recorder.
+  Only needed if PLAYER_HOST is defined in player1063.h.
+
+*/
+#ifndef PLAYER_HOST_H
+#define PLAYER_HOST_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include "vs10xx_uc.h"
+
+int HostTimerInit(void);
+void HostSleep(u_int32 us);
+int HostCmdPost(int cmd, s_int32 arg);
+int HostCmdGet(int *cmd, s_int32 *arg);
+void HostSnapshotPublish(const void *data, u_int32 bytes);
+int HostSnapshotRead(void *data, u_int32 bytes);
+u_int32 HostCpuMicroseconds(void);
+int HostWriterStart(FILE *fp);
+void HostWriterSegments(const char *pattern, int index);
+int HostWriterAddSink(int fd);
+void HostWriterRemoveSinks(void);
+int HostWriterSinkStats(int i, u_int32 *sent, u_int32 *dropped);
+u_int8 *HostWriterSpace(u_int32 *bytes);
+void HostWriterCommit(u_int32 bytes);
+u_int32 HostWriterFill(void);
+u_int32 HostWriterSize(void);
+int HostWriterSplit(const u_int8 *fixup, u_int32 fixupBytes);
+int HostWriterStop(void);
+FILE *HostWriterFile(void);
+int HostFilePatch(FILE *fp, const void *data, u_int32 bytes, u_int32 offset);
+long HostInputQueued(FILE *fp);
+int HostRtRun(void (*func)(void *), void *arg, int cpu, int priority);
+int HostReaderStart(FILE *fp);
+long HostReaderRead(u_int8 *buf, u_int32 bytes);
+int HostReaderSeek(long pos);
+long HostReaderQueued(void);
+void HostReaderStop(void);
+int HostUiStart(int (*poll)(void), u_int32 us);
+int HostUiGet(void);
+void HostUiStop(void);
+int HostLogStart(const char *const *formats, int events, FILE *fp);
+void HostLogPrintfV(u_int32 time, const char *format, va_list ap);
+void HostLogV(u_int32 time, int event, va_list ap);
+u_int32 HostLogFlush(void);
+void HostLogStop(void);
+void HostG711Decode(s_int16 *out, const u_int8 *in, u_int32 n, int alaw);
+u_int32 HostImaDecode(s_int16 *out, const u_int8 *in, u_int32 blocks,
+                      u_int16 blockAlign, int channels, int threads);
+
+#endif
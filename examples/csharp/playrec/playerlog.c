@@ -0,0 +1,110 @@
+/*
+
+  VLSI Solution generic microcontroller example player / recorder for
+  VS1063: logging.
+
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include "player1063.h"
+
+
+/*
+
+  Logging.
+
+  Messages from the playback and recording loops are events with a
+  fixed printf format. Without ASYNC_LOG, LogEvent() just prints them.
+  With ASYNC_LOG, the loop only stores the event and its arguments,
+  and a background thread prints them later, see HostLogV(). LogFlush()
+  must then be called before other output, so that it stays in order.
+  LogStop() stops the thread when a file has been handled, and the next
+  LogStart() starts it again.
+
+*/
+const char *const logFormat[leEvents] = {
+  "\r%ldKiB %1ds %1.1fkb/s %dHz %s %s %04x   ",
+  "%2d %2d ",
+  "\nJumped to file offset %ld\n",
+  "\nSetting SM_CANCEL at file offset %ld\n",
+  "SM_CANCEL has cleared at file offset %ld\n",
+  "\r%ldKiB %lds %uHz %s %s ",
+  "\nSegment %lu\n",
+  "\nOverrun! VS10xx encoder buffer overflowed, data lost\n",
+  "\r%ldKiB play %3lu ms rec %3lu ms ",
+};
+
+#ifdef ASYNC_LOG
+int logAsync = 0;               // Log thread is running
+#endif
+
+
+void LogStart(void) {
+#ifdef ASYNC_LOG
+  logAsync = !HostLogStart(logFormat, leEvents, stdout);
+#endif
+}
+
+
+void LogEvent(int id, ...) {
+  va_list ap;
+
+  va_start(ap, id);
+#ifdef ASYNC_LOG
+  if (logAsync) {
+    HostLogV(GetMicroseconds(), id, ap);
+    va_end(ap);
+    return;
+  }
+#endif
+  vprintf(logFormat[id], ap);
+  fflush(stdout);
+  va_end(ap);
+}
+
+
+/*
+  Like printf(), but with ASYNC_LOG the message goes through the log
+  ring, so that it stays in order with the events and the loops never
+  wait for the terminal. As the message is formatted later, format
+  must be a string literal, and %s arguments must stay valid too.
+*/
+void LogPrintf(const char *format, ...) {
+  va_list ap;
+
+  va_start(ap, format);
+#ifdef ASYNC_LOG
+  if (logAsync) {
+    HostLogPrintfV(GetMicroseconds(), format, ap);
+    va_end(ap);
+    return;
+  }
+#endif
+  vprintf(format, ap);
+  fflush(stdout);
+  va_end(ap);
+}
+
+
+void LogFlush(void) {
+#ifdef ASYNC_LOG
+  if (logAsync) {
+    u_int32 dropped = HostLogFlush();
+    if (dropped) {
+      printf("\n%lu log entries dropped\n", dropped);
+    }
+  }
+#endif
+}
+
+
+void LogStop(void) {
+#ifdef ASYNC_LOG
+  if (logAsync) {
+    LogFlush();
+    HostLogStop();
+    logAsync = 0;
+  }
+#endif
+}
@@ -0,0 +1,298 @@
+/*
+
+  VLSI Solution generic microcontroller example player / recorder for
+  VS1063: recording meter.
+
+*/
+
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "player1063.h"
+
+
+#ifdef RECORD_METER
+/*
+
+  Recording meter.
+
+  For PCM recordings, levels are measured from the recorded data as it
+  is read, so no VS10xx registers need to be polled. After every block
+  of METER_BLOCK_MS, the peak and RMS levels of each channel and the
+  short-term loudness are put into the telemetry snapshot, which is
+  then published.
+
+  Peaks and sums of squares are taken 16 samples at a time with AVX2
+  or NEON on little-endian hosts. Loudness is measured as in ITU-R
+  BS.1770: both channels go through the K-weighting filters, a high
+  shelf and a high-pass, and the mean square of the last
+  METER_WINDOW_BLOCKS blocks is given in LUFS. The filters are IIR, so
+  they are run one sample at a time.
+  metertest.c checks that the levels don't depend on how the data is
+  split into chunks.
+
+  Compressed recordings can't be measured this way. For them the
+  snapshot is taken from VS10xx, with its VU meter enabled.
+
+  struct Meter is in player1063.h, as the recorder keeps one.
+
+*/
+/*
+  Sets up m for a recording with recMode (SCI_RECMODE) at sampleRate.
+  Only PCM recordings are metered.
+*/
+void MeterInit(struct Meter *m, u_int16 recMode, u_int16 sampleRate) {
+  int adcMode = recMode & RM_63_ADCMODE_MASK;
+  double k, q, vh, vb, a0;
+
+  memset(m, 0, sizeof(*m));
+  if ((recMode & RM_63_FORMAT_MASK) != RM_63_FORMAT_PCM || !sampleRate) {
+    return;
+  }
+  m->channels = (adcMode == RM_63_ADC_MODE_JOINT_AGC_STEREO ||
+                 adcMode == RM_63_ADC_MODE_DUAL_AGC_STEREO) ? 2 : 1;
+  m->blockFrames = (u_int32)sampleRate * METER_BLOCK_MS / 1000;
+  if (!(recMode & RM_63_NO_RIFF)) {
+    m->skip = RIFF_HEADER_SIZE;
+  }
+
+  /* K-weighting filters for sampleRate, as in BS.1770 for 48 kHz */
+  k = tan(METER_PI * 1681.974450955533 / sampleRate);
+  q = 0.7071752369554196;
+  vh = pow(10.0, 3.999843853973347 / 20.0);
+  vb = pow(vh, 0.4996667741545416);
+  a0 = 1.0 + k/q + k*k;
+  m->coef[0][0] = (vh + vb*k/q + k*k) / a0;
+  m->coef[0][1] = 2.0 * (k*k - vh) / a0;
+  m->coef[0][2] = (vh - vb*k/q + k*k) / a0;
+  m->coef[0][3] = 2.0 * (k*k - 1.0) / a0;
+  m->coef[0][4] = (1.0 - k/q + k*k) / a0;
+
+  k = tan(METER_PI * 38.13547087602444 / sampleRate);
+  q = 0.5003270373238773;
+  a0 = 1.0 + k/q + k*k;
+  m->coef[1][0] = 1.0;
+  m->coef[1][1] = -2.0;
+  m->coef[1][2] = 1.0;
+  m->coef[1][3] = 2.0 * (k*k - 1.0) / a0;
+  m->coef[1][4] = (1.0 - k/q + k*k) / a0;
+}
+
+
+static void MeterSample(u_int16 *peak, uint64_t *sumSq, const u_int8 *p) {
+  s_int32 x = (s_int16)(p[0] | (p[1] << 8));
+  u_int16 a = (u_int16)((x < 0) ? -x : x);
+
+  if (a > *peak) {
+    *peak = a;
+  }
+  *sumSq += (uint64_t)(x*x);
+}
+
+
+/*
+  Adds the peaks and sums of squares of n little-endian 16-bit samples
+  in d to m. The channel of d[0] is m->next.
+*/
+static void MeterLevels(struct Meter *m, const u_int8 *d, u_int32 n) {
+  u_int16 peak[2] = {0, 0};
+  uint64_t sumSq[2] = {0, 0};
+  int c = m->next;
+  u_int32 i = c;        // The vector loops start at a left sample
+
+  if (c && n) {
+    MeterSample(&peak[1], &sumSq[1], d);
+  }
+
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  {
+#if defined(__AVX2__)
+    __m256i pk = _mm256_setzero_si256();
+    __m256i even = _mm256_setzero_si256(), odd = _mm256_setzero_si256();
+    const __m256i evenMask = _mm256_set1_epi32(0x0000FFFF);
+    u_int16 p[16];
+    uint64_t s[4];
+    int j;
+
+    for (; i+16 <= n; i += 16) {
+      __m256i x = _mm256_loadu_si256((const __m256i *)(d+2*i));
+      /* Each 32-bit lane gets the square of one of its two samples */
+      __m256i e = _mm256_madd_epi16(x, _mm256_and_si256(x, evenMask));
+      __m256i o = _mm256_madd_epi16(x, _mm256_andnot_si256(evenMask, x));
+
+      pk = _mm256_max_epu16(pk, _mm256_abs_epi16(x));
+      even = _mm256_add_epi64(even, _mm256_add_epi64(
+        _mm256_cvtepu32_epi64(_mm256_castsi256_si128(e)),
+        _mm256_cvtepu32_epi64(_mm256_extracti128_si256(e, 1))));
+      odd = _mm256_add_epi64(odd, _mm256_add_epi64(
+        _mm256_cvtepu32_epi64(_mm256_castsi256_si128(o)),
+        _mm256_cvtepu32_epi64(_mm256_extracti128_si256(o, 1))));
+    }
+    _mm256_storeu_si256((__m256i *)p, pk);
+    for (j=0; j<16; j++) {
+      peak[j & 1] = max(peak[j & 1], p[j]);
+    }
+    _mm256_storeu_si256((__m256i *)s, even);
+    sumSq[0] += s[0] + s[1] + s[2] + s[3];
+    _mm256_storeu_si256((__m256i *)s, odd);
+    sumSq[1] += s[0] + s[1] + s[2] + s[3];
+#elif defined(__ARM_NEON)
+    uint16x8_t pk = vdupq_n_u16(0);
+    uint64x2_t acc = vdupq_n_u64(0);    // Lanes: even, odd samples
+    u_int16 p[8];
+    int j;
+
+    for (; i+16 <= n; i += 16) {
+      int16x8_t x = vreinterpretq_s16_u8(vld1q_u8(d+2*i));
+      int16x8_t y = vreinterpretq_s16_u8(vld1q_u8(d+2*i+16));
+      uint32x4_t sx = vreinterpretq_u32_s32(vmull_s16(vget_low_s16(x),
+                                                      vget_low_s16(x)));
+      uint32x4_t sy = vreinterpretq_u32_s32(vmull_s16(vget_low_s16(y),
+                                                      vget_low_s16(y)));
+
+      pk = vmaxq_u16(pk, vreinterpretq_u16_s16(vabsq_s16(x)));
+      pk = vmaxq_u16(pk, vreinterpretq_u16_s16(vabsq_s16(y)));
+      acc = vaddw_u32(acc, vget_low_u32(sx));
+      acc = vaddw_u32(acc, vget_high_u32(sx));
+      acc = vaddw_u32(acc, vget_low_u32(sy));
+      acc = vaddw_u32(acc, vget_high_u32(sy));
+      sx = vreinterpretq_u32_s32(vmull_s16(vget_high_s16(x),
+                                           vget_high_s16(x)));
+      sy = vreinterpretq_u32_s32(vmull_s16(vget_high_s16(y),
+                                           vget_high_s16(y)));
+      acc = vaddw_u32(acc, vget_low_u32(sx));
+      acc = vaddw_u32(acc, vget_high_u32(sx));
+      acc = vaddw_u32(acc, vget_low_u32(sy));
+      acc = vaddw_u32(acc, vget_high_u32(sy));
+    }
+    vst1q_u16(p, pk);
+    for (j=0; j<8; j++) {
+      peak[j & 1] = max(peak[j & 1], p[j]);
+    }
+    sumSq[0] += vgetq_lane_u64(acc, 0);
+    sumSq[1] += vgetq_lane_u64(acc, 1);
+#endif
+  }
+#endif /* little-endian */
+
+  for (; i<n; i++) {
+    int j = (i & 1) ^ c;
+
+    MeterSample(&peak[j], &sumSq[j], d+2*i);
+  }
+
+  /* With mono, odd samples are of the same channel */
+  if (m->channels == 1) {
+    peak[0] = max(peak[0], peak[1]);
+    sumSq[0] += sumSq[1];
+  }
+  for (c=0; c<m->channels; c++) {
+    m->peak[c] = max(m->peak[c], peak[c]);
+    m->sumSq[c] += (double)sumSq[c];
+  }
+}
+
+
+/*
+  Returns power, relative to full scale, in 0.1 dB steps.
+*/
+static s_int16 MeterDb(double power) {
+  double db = 100.0 * log10(power + 1e-30);
+
+  return (s_int16)((db < METER_FLOOR) ? METER_FLOOR : floor(db + 0.5));
+}
+
+
+/*
+  Puts the levels of a finished block into t, publishes it, and starts
+  the next block.
+*/
+static void MeterBlock(struct Meter *m, struct Telemetry *t) {
+  double full = 32768.0 * 32768.0 * m->blockFrames;
+  double kPower = 0.0, sum = 0.0;
+  s_int16 peak[2], rms[2];
+  int c, i;
+
+  for (c=0; c<m->channels; c++) {
+    peak[c] = MeterDb((double)m->peak[c] * m->peak[c] / (32768.0*32768.0));
+    rms[c] = MeterDb(m->sumSq[c] / full);
+    kPower += m->kSumSq[c] / m->blockFrames;
+  }
+  m->window[m->windowPos] = kPower;
+  m->windowPos = (m->windowPos + 1) % METER_WINDOW_BLOCKS;
+  if (m->windowBlocks < METER_WINDOW_BLOCKS) {
+    m->windowBlocks++;
+  }
+  for (i=0; i<m->windowBlocks; i++) {
+    sum += m->window[i];
+  }
+
+  t->peakLeft = peak[0];
+  t->rmsLeft = rms[0];
+  t->peakRight = peak[m->channels-1];
+  t->rmsRight = rms[m->channels-1];
+  /* BS.1770: -0.691 + 10*log10(mean square) */
+  t->loudness = MeterDb(sum / m->windowBlocks * pow(10.0, -0.0691));
+  t->sampleCounter += m->blockFrames;
+  TelemetryPublish(t);
+
+  m->frames = 0;
+  memset(m->peak, 0, sizeof(m->peak));
+  memset(m->sumSq, 0, sizeof(m->sumSq));
+  memset(m->kSumSq, 0, sizeof(m->kSumSq));
+}
+
+
+/*
+  Meters bytes of recorded data, publishing t after every block.
+*/
+void MeterPut(struct Meter *m, const u_int8 *d, u_int32 bytes,
+              struct Telemetry *t) {
+  u_int32 skip = min(m->skip, bytes);
+
+  if (!m->channels) {
+    return;
+  }
+  m->skip -= skip;
+  d += skip;
+  bytes -= skip;
+
+  while (bytes >= 2) {
+    /* Samples up to the end of the block */
+    u_int32 n = (m->blockFrames - m->frames) * m->channels - m->next;
+    u_int32 i;
+
+    n = min(n, bytes/2);
+    MeterLevels(m, d, n);
+    for (i=0; i<n; i++) {
+      double x = (s_int16)(d[2*i] | (d[2*i+1] << 8)) / 32768.0;
+      int s;
+
+      for (s=0; s<2; s++) {
+        const double *k = m->coef[s];
+        double *z = m->state[m->next][s];
+        double y = k[0]*x + z[0];
+
+        z[0] = k[1]*x - k[3]*y + z[1];
+        z[1] = k[2]*x - k[4]*y;
+        x = y;
+      }
+      m->kSumSq[m->next] += x*x;
+      if (++m->next == m->channels) {
+        m->next = 0;
+        m->frames++;
+      }
+    }
+    d += 2*n;
+    bytes -= 2*n;
+    if (m->frames == m->blockFrames) {
+      MeterBlock(m, t);
+    }
+  }
+}
+#endif /* RECORD_METER */
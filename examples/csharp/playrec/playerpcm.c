@@ -0,0 +1,192 @@
+/*
+
+  VLSI Solution generic microcontroller example player / recorder for
+  VS1063: PCM input.
+
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "player1063.h"
+
+
+#ifdef PCM_INPUT
+/*
+
+  PCM input.
+
+  An application that produces audio itself can stream it to VS10xx
+  without building RIFF WAV data by hand. VSTestPcmStart() sends a
+  16-bit PCM RIFF WAV header with 0xFFFFFFFF sizes, so that VS10xx
+  decodes whatever follows until the end of the stream. VSTestPcmWrite()
+  takes float (full scale +-1.0), 32-bit or 16-bit samples in host byte
+  order, or packed little-endian 24-bit samples, either interleaved or
+  as separate left and right channels. They are converted to interleaved
+  little-endian 16-bit samples PCM_BLOCK_FRAMES at a time, and sent with
+  the feeder.
+
+  When samples are reduced to 16 bits, they are saturated, and if
+  dither is enabled, TPDF dither of +-1 LSB is added first. The dither
+  comes from a table of PCM_DITHER_SIZE values, so that the conversion
+  kernels in playerpcmconv.c can load it just like the samples.
+
+*/
+
+static const u_int8 pcmSampleBytes[] = {2, 3, 4, 4}; // By enum PcmFormat
+
+struct PcmStream {
+  struct Feeder feeder;         // SDI feeder scheduling
+  int active;                   // Between VSTestPcmStart() and VSTestPcmEnd()
+  int channels;                 // 1 or 2
+  u_int32 ditherPos;            // Next unused value in dither tables
+  u_int32 frames;               // Frames sent
+} pcmIn;
+
+static float pcmDither[PCM_DITHER_SIZE];        // In 16-bit LSBs
+static int32_t pcmDitherS32[PCM_DITHER_SIZE];   // In 32-bit LSBs
+static int32_t pcmWide[2*PCM_BLOCK_FRAMES];     // Expanded 24-bit samples
+static s_int16 pcmPlane[2][PCM_BLOCK_FRAMES];   // Converted left and right
+static s_int16 pcmOut[2*PCM_BLOCK_FRAMES];      // Interleaved output
+
+
+/*
+  Converts n samples in format to 16 bits, using the dither tables from
+  ditherPos on.
+*/
+static void PcmConvert(s_int16 *out, const void *in, u_int32 n, int format,
+                       u_int32 ditherPos) {
+  switch (format) {
+  case pcmS16:
+    memcpy(out, in, 2*n);
+    break;
+  case pcmS24:
+    PcmS24ToS32(pcmWide, in, n);
+    PcmS32ToS16(out, pcmWide, n, pcmDitherS32+ditherPos);
+    break;
+  case pcmS32:
+    PcmS32ToS16(out, in, n, pcmDitherS32+ditherPos);
+    break;
+  case pcmFloat:
+    PcmFloatToS16(out, in, n, pcmDither+ditherPos);
+    break;
+  }
+}
+
+
+static void PcmSend(const u_int8 *data, u_int32 bytes) {
+  struct SdiSegment seg;
+
+  while (bytes) {
+    seg.data = data;
+    seg.bytes = FeederBurst(&pcmIn.feeder, bytes);
+    WriteSdiv(&seg, 1);
+    data += seg.bytes;
+    bytes -= seg.bytes;
+  }
+}
+
+
+/*
+  Starts a PCM stream of channels (1 or 2) at sampleRate. If dither is
+  non-zero, TPDF dither is added when reducing samples to 16 bits.
+  Returns 0 on success, -1 on bad parameters.
+*/
+int VSTestPcmStart(u_int16 sampleRate, int channels, int dither) {
+  u_int8 riff[RIFF_HEADER_SIZE];
+  int i;
+
+  if (channels < 1 || channels > 2 || !sampleRate) {
+    return -1;
+  }
+  MakeRiffHeader(riff, RM_63_FORMAT_PCM | ((channels == 2) ?
+                                           RM_63_ADC_MODE_JOINT_AGC_STEREO :
+                                           RM_63_ADC_MODE_MONO),
+                 sampleRate, 0xFFFFFFFFU);
+
+  /* The difference of two uniform values in [0,1] has a triangular
+     distribution in [-1,1]. */
+  for (i=0; i<PCM_DITHER_SIZE; i++) {
+    float d = dither ? (float)(rand() - rand()) / RAND_MAX : 0.0f;
+
+    pcmDither[i] = d;
+    pcmDitherS32[i] = (int32_t)(d * 65535.0f);
+  }
+
+  pcmIn.active = 1;
+  pcmIn.channels = channels;
+  pcmIn.ditherPos = 0;
+  pcmIn.frames = 0;
+  playerState = psPlayback;
+  FeederInit(&pcmIn.feeder);
+  WriteSci(SCI_DECODE_TIME, 0);         // Reset DECODE_TIME
+  PcmSend(riff, RIFF_HEADER_SIZE);
+  return 0;
+}
+
+
+/*
+  Converts and sends frames of samples in format (enum PcmFormat). If
+  right is NULL, left has interleaved samples of all channels,
+  otherwise left and right have the channels of a stereo stream.
+  Returns 0 on success, -1 if no stream has been started or parameters
+  don't fit it.
+*/
+int VSTestPcmWrite(const void *left, const void *right, u_int32 frames,
+                   int format) {
+  const u_int8 *l = left, *r = right;
+  u_int32 sampleBytes;
+
+  if (!pcmIn.active || format < pcmS16 || format > pcmFloat ||
+      (r && pcmIn.channels != 2)) {
+    return -1;
+  }
+  sampleBytes = pcmSampleBytes[format];
+
+  while (frames) {
+    u_int32 n = min(frames, PCM_BLOCK_FRAMES);
+    u_int32 samples = n*pcmIn.channels;
+
+    if (pcmIn.ditherPos + samples > PCM_DITHER_SIZE) {
+      pcmIn.ditherPos = 0;
+    }
+    if (r) {
+      PcmConvert(pcmPlane[0], l, n, format, pcmIn.ditherPos);
+      PcmConvert(pcmPlane[1], r, n, format, pcmIn.ditherPos+n);
+      PcmInterleave(pcmOut, pcmPlane[0], pcmPlane[1], n);
+      r += n*sampleBytes;
+    } else {
+      PcmConvert(pcmOut, l, samples, format, pcmIn.ditherPos);
+    }
+    l += (r ? n : samples)*sampleBytes;
+    pcmIn.ditherPos += samples;
+
+    SamplesToLittleEndian(pcmOut, samples);
+    PcmSend((const u_int8 *)pcmOut, 2*samples);
+    pcmIn.frames += n;
+    frames -= n;
+  }
+  return 0;
+}
+
+
+/*
+  Ends the PCM stream and makes sure the decoder has exited. Returns
+  0 on success, -1 if no stream has been started.
+*/
+int VSTestPcmEnd(void) {
+  u_int32 stopTime;
+
+  if (!pcmIn.active) {
+    return -1;
+  }
+  pcmIn.active = 0;
+  stopTime = VS1063FinishStream(ReadVS10xxReg(REG_PAR_END_FILL_BYTE) & 0xFF,
+                                SDI_END_FILL_BYTES);
+  LogPrintf("PCM input: %lu frames, stopped in %lu ms\n",
+            pcmIn.frames, stopTime/1000);
+  PrintFeederStats(&pcmIn.feeder);
+  LogFlush();
+  return 0;
+}
+#endif /* PCM_INPUT */
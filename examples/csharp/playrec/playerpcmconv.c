@@ -0,0 +1,225 @@
+/*
+
+  VLSI Solution generic microcontroller example player / recorder for
+  VS1063: sample conversions for the PCM input.
+
+*/
+
+#include <stdint.h>
+#include <math.h>
+#if defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include "player1063.h"
+
+
+#ifdef PCM_INPUT
+/*
+
+  PCM sample conversions.
+
+  With AVX2 or NEON the conversions are done 8 or 16 samples at a time,
+  24-bit samples are expanded with SSSE3 or NEON, and the scalar loops
+  handle the rest and other hosts. The results are the same on all of
+  them. pcmbench.c checks this against plain C references, and shows
+  how much faster the vector loops are.
+
+*/
+
+/*
+  Converts n float samples to 16 bits: in*32768 + dither, rounded to
+  nearest with ties to even, like the SIMD conversions in the default
+  rounding mode, and saturated.
+*/
+void PcmFloatToS16(s_int16 *out, const float *in, u_int32 n,
+                   const float *dither) {
+  u_int32 i = 0;
+
+#if defined(__AVX2__)
+  {
+    const __m256 scale = _mm256_set1_ps(32768.0f);
+    const __m256 lo = _mm256_set1_ps(-32768.0f);
+    const __m256 hi = _mm256_set1_ps(32767.0f);
+
+    for (; i+16 <= n; i += 16) {
+      __m256 a = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(in+i), scale),
+                               _mm256_loadu_ps(dither+i));
+      __m256 b = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(in+i+8), scale),
+                               _mm256_loadu_ps(dither+i+8));
+      __m256i p;
+
+      /* Out of range values would convert to 0x80000000 */
+      a = _mm256_min_ps(_mm256_max_ps(a, lo), hi);
+      b = _mm256_min_ps(_mm256_max_ps(b, lo), hi);
+      p = _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+      /* packs works within 128-bit lanes, put the quadwords in order */
+      _mm256_storeu_si256((__m256i *)(out+i),
+                          _mm256_permute4x64_epi64(p, 0xD8));
+    }
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  {
+    const float32x4_t lo = vdupq_n_f32(-32768.0f);
+
+    /* vcvtnq and vqmovn both saturate, but vcvtnq turns NaN into 0, so
+       vmaxnmq replaces NaN with the minimum first */
+    for (; i+8 <= n; i += 8) {
+      float32x4_t a = vmlaq_n_f32(vld1q_f32(dither+i), vld1q_f32(in+i),
+                                  32768.0f);
+      float32x4_t b = vmlaq_n_f32(vld1q_f32(dither+i+4), vld1q_f32(in+i+4),
+                                  32768.0f);
+
+      a = vmaxnmq_f32(a, lo);
+      b = vmaxnmq_f32(b, lo);
+      vst1q_s16(out+i, vcombine_s16(vqmovn_s32(vcvtnq_s32_f32(a)),
+                                    vqmovn_s32(vcvtnq_s32_f32(b))));
+    }
+  }
+#endif
+
+  for (; i<n; i++) {
+    float v = in[i]*32768.0f + dither[i];
+
+    if (!(v >= -32768.0f)) {    // Also NaN
+      v = -32768.0f;
+    } else if (v > 32767.0f) {
+      v = 32767.0f;
+    }
+    out[i] = (s_int16)lrintf(v);
+  }
+}
+
+
+/*
+  Converts n 32-bit samples to 16 bits: (in + dither) / 65536, rounded
+  to nearest and saturated. Everything is halved first so that the sum
+  can't overflow.
+*/
+void PcmS32ToS16(s_int16 *out, const int32_t *in, u_int32 n,
+                 const int32_t *dither) {
+  u_int32 i = 0;
+
+#if defined(__AVX2__)
+  {
+    const __m256i round = _mm256_set1_epi32(0x4000);
+
+    for (; i+16 <= n; i += 16) {
+      __m256i a = _mm256_loadu_si256((const __m256i *)(in+i));
+      __m256i b = _mm256_loadu_si256((const __m256i *)(in+i+8));
+      __m256i da = _mm256_loadu_si256((const __m256i *)(dither+i));
+      __m256i db = _mm256_loadu_si256((const __m256i *)(dither+i+8));
+
+      a = _mm256_add_epi32(_mm256_srai_epi32(a, 1), _mm256_srai_epi32(da, 1));
+      b = _mm256_add_epi32(_mm256_srai_epi32(b, 1), _mm256_srai_epi32(db, 1));
+      a = _mm256_srai_epi32(_mm256_add_epi32(a, round), 15);
+      b = _mm256_srai_epi32(_mm256_add_epi32(b, round), 15);
+      _mm256_storeu_si256((__m256i *)(out+i),
+                          _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b),
+                                                   0xD8));
+    }
+  }
+#elif defined(__ARM_NEON)
+  {
+    const int32x4_t round = vdupq_n_s32(0x4000);
+
+    for (; i+8 <= n; i += 8) {
+      int32x4_t a = vaddq_s32(vshrq_n_s32(vld1q_s32(in+i), 1),
+                              vshrq_n_s32(vld1q_s32(dither+i), 1));
+      int32x4_t b = vaddq_s32(vshrq_n_s32(vld1q_s32(in+i+4), 1),
+                              vshrq_n_s32(vld1q_s32(dither+i+4), 1));
+
+      a = vshrq_n_s32(vaddq_s32(a, round), 15);
+      b = vshrq_n_s32(vaddq_s32(b, round), 15);
+      vst1q_s16(out+i, vcombine_s16(vqmovn_s32(a), vqmovn_s32(b)));
+    }
+  }
+#endif
+
+  for (; i<n; i++) {
+    s_int32 v = ((in[i] >> 1) + (dither[i] >> 1) + 0x4000) >> 15;
+
+    out[i] = (s_int16)((v > 32767) ? 32767 : (v < -32768) ? -32768 : v);
+  }
+}
+
+
+/*
+  Expands n packed little-endian 24-bit samples to 32 bits, with the
+  sample in the top 24 bits.
+*/
+void PcmS24ToS32(int32_t *out, const u_int8 *in, u_int32 n) {
+  u_int32 i = 0;
+
+#if defined(__SSSE3__)
+  {
+    const __m128i expand = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5,
+                                         -1, 6, 7, 8, -1, 9, 10, 11);
+
+    /* Each load takes 16 bytes but uses 12 */
+    for (; i+6 <= n; i += 4) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(in+3*i));
+      _mm_storeu_si128((__m128i *)(out+i), _mm_shuffle_epi8(v, expand));
+    }
+  }
+#elif defined(__ARM_NEON)
+  for (; i+8 <= n; i += 8) {
+    uint8x8x3_t b = vld3_u8(in+3*i);
+    uint16x8_t lo = vshll_n_u8(b.val[0], 8);
+    int16x8_t hi = vreinterpretq_s16_u16(vorrq_u16(vmovl_u8(b.val[1]),
+                                                   vshll_n_u8(b.val[2], 8)));
+
+    vst1q_s32(out+i, vorrq_s32(vshll_n_s16(vget_low_s16(hi), 16),
+                               vreinterpretq_s32_u32(
+                                 vmovl_u16(vget_low_u16(lo)))));
+    vst1q_s32(out+i+4, vorrq_s32(vshll_n_s16(vget_high_s16(hi), 16),
+                                 vreinterpretq_s32_u32(
+                                   vmovl_u16(vget_high_u16(lo)))));
+  }
+#endif
+
+  for (; i<n; i++) {
+    const u_int8 *p = in+3*i;
+
+    out[i] = (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 |
+                       (uint32_t)p[2] << 24);
+  }
+}
+
+
+/*
+  Interleaves n left and n right samples.
+*/
+void PcmInterleave(s_int16 *out, const s_int16 *left, const s_int16 *right,
+                   u_int32 n) {
+  u_int32 i = 0;
+
+#if defined(__AVX2__)
+  for (; i+16 <= n; i += 16) {
+    __m256i l = _mm256_loadu_si256((const __m256i *)(left+i));
+    __m256i r = _mm256_loadu_si256((const __m256i *)(right+i));
+    __m256i lo = _mm256_unpacklo_epi16(l, r); // Frames 0-3 and 8-11
+    __m256i hi = _mm256_unpackhi_epi16(l, r); // Frames 4-7 and 12-15
+
+    _mm256_storeu_si256((__m256i *)(out+2*i),
+                        _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256((__m256i *)(out+2*i+16),
+                        _mm256_permute2x128_si256(lo, hi, 0x31));
+  }
+#elif defined(__ARM_NEON)
+  for (; i+8 <= n; i += 8) {
+    int16x8x2_t v;
+
+    v.val[0] = vld1q_s16(left+i);
+    v.val[1] = vld1q_s16(right+i);
+    vst2q_s16(out+2*i, v);
+  }
+#endif
+
+  for (; i<n; i++) {
+    out[2*i] = left[i];
+    out[2*i+1] = right[i];
+  }
+}
+#endif /* PCM_INPUT */
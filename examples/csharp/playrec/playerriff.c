@@ -0,0 +1,87 @@
+/*
+
+  VLSI Solution generic microcontroller example player / recorder for
+  VS1063: RIFF WAV headers.
+
+  Used for recordings with RECORD_HOST_RIFF, and for the files decoded
+  by VSTestDecodeRecording().
+
+*/
+
+#include <string.h>
+#include "player1063.h"
+
+
+static void PutLe16(u_int8 *p, u_int16 x) {
+  p[0] = (u_int8)x;
+  p[1] = (u_int8)(x >> 8);
+}
+
+static void PutLe32(u_int8 *p, u_int32 x) {
+  PutLe16(p, (u_int16)x);
+  PutLe16(p+2, (u_int16)(x >> 16));
+}
+
+
+/*
+  Creates a RIFF WAV header of RIFF_HEADER_SIZE bytes into h, with the
+  same layout that VS1063 uses, for recording with recMode (SCI_RECMODE)
+  and sampleRate. If dataBytes is 0xFFFFFFFF, both size fields are set
+  to 0xFFFFFFFF, which players understand as a stream of unknown length.
+  Returns 0 on success, or -1 if recMode isn't a RIFF WAV format.
+*/
+int MakeRiffHeader(u_int8 *h, u_int16 recMode, u_int16 sampleRate,
+                   u_int32 dataBytes) {
+  int adcMode = recMode & RM_63_ADCMODE_MASK;
+  u_int16 channels = (adcMode == RM_63_ADC_MODE_JOINT_AGC_STEREO ||
+                      adcMode == RM_63_ADC_MODE_DUAL_AGC_STEREO) ? 2 : 1;
+  u_int16 format, bits, blockAlign, samplesPerBlock;
+
+  switch (recMode & RM_63_FORMAT_MASK) {
+  case RM_63_FORMAT_PCM:
+    format = 0x0001;
+    bits = 16;
+    blockAlign = 2*channels;
+    samplesPerBlock = 1;
+    break;
+  case RM_63_FORMAT_G711_ULAW:
+  case RM_63_FORMAT_G711_ALAW:
+    format = ((recMode & RM_63_FORMAT_MASK) == RM_63_FORMAT_G711_ULAW) ?
+      0x0007 : 0x0006;
+    bits = 8;
+    blockAlign = channels;
+    samplesPerBlock = 1;
+    break;
+  case RM_63_FORMAT_IMA_ADPCM:
+    format = 0x0011;
+    bits = 4;
+    blockAlign = 256*channels;
+    samplesPerBlock = 505;
+    break;
+  case RM_63_FORMAT_G722_ADPCM:
+    format = 0x028f;
+    bits = 4;
+    blockAlign = channels;
+    samplesPerBlock = 2;
+    break;
+  default:
+    return -1;
+  }
+
+  memcpy(h, "RIFF", 4);
+  PutLe32(h+4, (dataBytes == 0xFFFFFFFFU) ?
+          0xFFFFFFFFU : dataBytes+RIFF_HEADER_SIZE-8);
+  memcpy(h+8, "WAVEfmt ", 8);
+  PutLe32(h+16, 20);                    // fmt chunk size
+  PutLe16(h+20, format);
+  PutLe16(h+22, channels);
+  PutLe32(h+24, sampleRate);
+  PutLe32(h+28, (u_int32)sampleRate*blockAlign/samplesPerBlock);
+  PutLe16(h+32, blockAlign);
+  PutLe16(h+34, bits);
+  PutLe16(h+36, 2);                     // Extra size
+  PutLe16(h+38, samplesPerBlock);
+  memcpy(h+40, "data", 4);
+  PutLe32(h+44, dataBytes);
+  return 0;
+}
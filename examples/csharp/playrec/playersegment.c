@@ -0,0 +1,283 @@
+/*
+
+  VLSI Solution generic microcontroller example player / recorder for
+  VS1063: segmented recording.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "player1063.h"
+
+#ifdef RECORD_SEGMENTS
+
+/*
+
+  Segmented recording.
+
+  A recording can be split into several files so that each of them can
+  be played on its own. Splits are only made at the boundaries of what
+  the encoder produces: RIFF WAV blocks, MP3 frames, or Ogg pages.
+  Each new RIFF WAV file gets its own header, and each new Ogg file gets
+  a copy of the Vorbis header pages from the start of the recording.
+  MP3 frames need no header.
+
+  Ogg pages are not renumbered, so page sequence numbers in the later
+  files don't start from 0. Players don't mind, but some strict stream
+  checkers do.
+
+  struct Segmenter is in player1063.h, as the recorder keeps one.
+
+*/
+#define SEG_OGG_HEADERS_MAX 16384
+
+const char *segmentPattern;     // Segment file name pattern, or NULL
+u_int32 segmentMaxBytes;        // Split when file is this big, 0 = no limit
+u_int32 segmentMaxSeconds;      // Split after this long, 0 = no limit
+
+static u_int8 segOggHeaders[SEG_OGG_HEADERS_MAX];
+
+
+void SegmenterInit(struct Segmenter *sg, enum AudioFormat format,
+                   u_int16 blockAlign, u_int32 fileSize) {
+  memset(sg, 0, sizeof(*sg));
+  sg->format = format;
+  sg->bytes = fileSize;
+  sg->blockAlign = blockAlign ? blockAlign : 1;
+  sg->left = (format == afRiff) ? sg->blockAlign : 0;
+  sg->hdrNeed = (format == afMp3) ? 4 : OGG_PAGE_HEADER_SIZE;
+  sg->lastTime = GetMicroseconds();
+}
+
+
+/*
+  Keeps a copy of Vorbis header pages, which are needed at the start of
+  every Ogg file.
+*/
+static void SegmenterKeepHeader(struct Segmenter *sg, const u_int8 *d,
+                                u_int32 bytes) {
+  if (sg->headerPage && !sg->oggHeadersDone) {
+    if (sg->oggHeaderBytes + bytes > SEG_OGG_HEADERS_MAX) {
+      sg->headerPage = 0; // Too big, new Ogg files will be headerless
+      sg->oggHeaderBytes = 0;
+      sg->oggHeadersDone = 1;
+      return;
+    }
+    memcpy(segOggHeaders+sg->oggHeaderBytes, d, bytes);
+    sg->oggHeaderBytes += bytes;
+  }
+}
+
+
+/*
+  Parses a complete MP3 frame or Ogg page header in sg->hdr. If there
+  is no valid header, drops the first byte so that we can look for the
+  next sync word.
+*/
+static void SegmenterParseHeader(struct Segmenter *sg) {
+  u_int32 need;
+  u_int32 len = StreamUnitLength(sg->format, sg->hdr, sg->hdrBytes, &need);
+
+  if (len == UNIT_NEED_MORE) {
+    sg->hdrNeed = need;
+    return;
+  }
+  if (len && len >= sg->hdrBytes) {
+    if (sg->format == afOggVorbis) {
+      sg->headerPage = OggHeaderPage(sg->hdr);
+      if (!sg->headerPage) {
+        sg->oggHeadersDone = 1;
+      }
+      SegmenterKeepHeader(sg, sg->hdr, sg->hdrBytes);
+    }
+    sg->left = len - sg->hdrBytes;
+    sg->hdrBytes = 0;
+  } else {
+    /* Resync */
+    memmove(sg->hdr, sg->hdr+1, --sg->hdrBytes);
+  }
+  sg->hdrNeed = (sg->format == afMp3) ? 4 : OGG_PAGE_HEADER_SIZE;
+}
+
+
+/*
+  Scans bytes of recorded data. If split is 0, all data is scanned and
+  bytes is returned. Otherwise, scanning stops after the first block,
+  frame or page that ends in the data, and the number of bytes scanned
+  is returned. *atBoundary tells whether the data returned ends at a
+  point where the recording may be split.
+*/
+u_int32 SegmenterScan(struct Segmenter *sg, const u_int8 *d, u_int32 bytes,
+                      int split, int *atBoundary) {
+  u_int32 pos = 0;
+
+  *atBoundary = 0;
+
+  if (sg->format == afRiff) {
+    if (!split || bytes < sg->left) {
+      sg->left = sg->blockAlign -
+        (sg->blockAlign - sg->left + bytes) % sg->blockAlign;
+      *atBoundary = (sg->left == sg->blockAlign);
+      return bytes;
+    }
+    pos = sg->left;
+    sg->left = sg->blockAlign;
+    *atBoundary = 1;
+    return pos;
+  }
+
+  while (pos < bytes) {
+    if (sg->left) {
+      u_int32 t = min(sg->left, bytes-pos);
+      SegmenterKeepHeader(sg, d+pos, t);
+      pos += t;
+      if (!(sg->left -= t)) {
+        /* Ogg files can't be split between header pages */
+        if (sg->format == afMp3 || !sg->headerPage) {
+          *atBoundary = 1;
+          if (split) {
+            return pos;
+          }
+        }
+      }
+    } else {
+      *atBoundary = 0;
+      while (pos < bytes && sg->hdrBytes < sg->hdrNeed) {
+        sg->hdr[sg->hdrBytes++] = d[pos++];
+      }
+      while (!sg->left && sg->hdrBytes == sg->hdrNeed) {
+        SegmenterParseHeader(sg);
+      }
+    }
+  }
+  return pos;
+}
+
+
+/*
+  Keeps track of segment length, and returns 1 if the current segment
+  should be ended at the next boundary.
+*/
+int SegmenterDue(struct Segmenter *sg, int split) {
+  u_int32 now = GetMicroseconds();
+
+  sg->us += now - sg->lastTime;
+  sg->lastTime = now;
+  while (sg->us >= 1000000) {
+    sg->us -= 1000000;
+    sg->seconds++;
+  }
+  return split || (segmentMaxBytes && sg->bytes >= segmentMaxBytes) ||
+    (segmentMaxSeconds && sg->seconds >= segmentMaxSeconds);
+}
+
+
+/*
+  Puts data into the writer ring, waiting for space if needed.
+*/
+void RecordOutput(const u_int8 *d, u_int32 bytes) {
+  while (bytes) {
+    u_int32 space;
+    u_int8 *dst = HostWriterSpace(&space);
+    u_int32 t = min(space, bytes);
+
+    if (t) {
+      memcpy(dst, d, t);
+      HostWriterCommit(t);
+      d += t;
+      bytes -= t;
+    } else {
+      HostSleep(1000);
+    }
+  }
+}
+
+
+/*
+  Ends the current segment file and starts the next one with a header
+  of its own.
+  Returns 0 on success, or -1 if the writer can't take another split
+  yet, in which case the caller should try again at the next boundary.
+*/
+int SegmenterSplit(struct Segmenter *sg, u_int16 recMode, u_int16 recRate) {
+  u_int8 riff[RIFF_HEADER_SIZE];
+
+  if (sg->format == afRiff) {
+    MakeRiffHeader(riff, recMode, recRate, sg->bytes-RIFF_HEADER_SIZE);
+    if (HostWriterSplit(riff, RIFF_HEADER_SIZE)) {
+      return -1;
+    }
+    MakeRiffHeader(riff, recMode, recRate, 0xFFFFFFFFU);
+    RecordOutput(riff, RIFF_HEADER_SIZE);
+    sg->bytes = RIFF_HEADER_SIZE;
+  } else {
+    if (HostWriterSplit(NULL, 0)) {
+      return -1;
+    }
+    RecordOutput(segOggHeaders, sg->oggHeaderBytes);
+    sg->bytes = sg->oggHeaderBytes;
+  }
+
+  sg->index++;
+  sg->seconds = sg->us = 0;
+  if (!rtMode) {
+    LogEvent(leRecSegment, sg->index);
+  }
+  return 0;
+}
+
+
+/*
+  Writes recorded data to the writer ring, splitting the recording at
+  the first boundary after a split has become due. *split is a split
+  request, and is cleared when the split has been made.
+*/
+void SegmenterWrite(struct Segmenter *sg, const u_int8 *d, u_int32 bytes,
+                    int *split, u_int16 recMode, u_int16 recRate) {
+  while (bytes) {
+    int due = SegmenterDue(sg, *split);
+    int atBoundary;
+    u_int32 t = SegmenterScan(sg, d, bytes, due, &atBoundary);
+
+    RecordOutput(d, t);
+    sg->bytes += t;
+    d += t;
+    bytes -= t;
+    if (due && atBoundary && !SegmenterSplit(sg, recMode, recRate)) {
+      *split = 0;
+    }
+  }
+}
+
+
+/*
+  Records to a series of files, starting a new file when the current
+  one reaches maxBytes bytes or maxSeconds seconds (0 = no limit), or
+  when asked to with pcSplit or the 's' key. File names are made from
+  the printf() pattern namePattern with a running number starting
+  from 0, e.g. "rec%03d.wav".
+*/
+int VSTestRecordSegments(const char *namePattern, u_int32 maxBytes,
+                         u_int32 maxSeconds) {
+  char fileName[256];
+  FILE *fp;
+
+  snprintf(fileName, sizeof(fileName), namePattern, 0);
+  printf("Record files %s\n", namePattern);
+  if (!(fp = fopen(fileName, "wb"))) {
+    printf("Failed opening %s for writing\n", fileName);
+    return -1;
+  }
+
+  segmentPattern = namePattern;
+  segmentMaxBytes = maxBytes;
+  segmentMaxSeconds = maxSeconds;
+  VS1063RecordFile(fp);
+  segmentPattern = NULL;
+
+  /* The recorder leaves the last segment file open */
+  fclose(HostWriterFile());
+  return 0;
+}
+
+#endif /* RECORD_SEGMENTS */
@@ -0,0 +1,141 @@
+/*
+
+  VLSI Solution generic microcontroller example player / recorder for
+  VS1063: telemetry.
+
+*/
+
+#include "player1063.h"
+
+
+/*
+
+  Telemetry.
+
+  Instead of reading VS10xx registers one by one whenever something
+  needs to be shown, the player takes a snapshot of them every
+  telemetryInterval microseconds. The parametric words needed are read
+  in one burst through the SCI_WRAM_PARAMETRIC_START mirror, and only
+  SCI registers are read separately. 32-bit counters are combined as in
+  ReadVS10xxMem32Counter(): their MSBs are read before the burst, and
+  again inside it right after the LSBs.
+
+  The latest snapshot is published so that other threads can get it
+  with VSTestGetTelemetry() without touching the SCI bus. With
+  PLAYER_HOST this is lock-free.
+
+*/
+#define TELEMETRY_FIRST PAR_CONFIG1
+#define TELEMETRY_LAST  (PAR_POSITION_MSEC+1)
+#define TELEMETRY_WORDS (TELEMETRY_LAST-TELEMETRY_FIRST+1)
+
+u_int32 telemetryInterval = TELEMETRY_INTERVAL;
+#ifndef PLAYER_HOST
+struct Telemetry latestTelemetry;
+#endif
+
+
+static u_int16 TelemetryWord(const u_int8 *b, u_int16 addr) {
+  b += 2*(addr-TELEMETRY_FIRST);
+  return (b[0] << 8) | b[1];
+}
+
+
+/*
+  Timestamps t and publishes it as the latest snapshot.
+*/
+void TelemetryPublish(struct Telemetry *t) {
+  t->time = GetMicroseconds();
+  t->count++;
+#ifdef PLAYER_HOST
+  HostSnapshotPublish(t, sizeof(*t));
+#else
+  latestTelemetry = *t;
+#endif
+}
+
+
+/*
+  Takes a telemetry snapshot into t and publishes it. The snapshot
+  spans several registers, so it is read as one burst from the
+  parametric mirror instead of with ReadVS10xxReg().
+*/
+void TelemetryTake(struct Telemetry *t) {
+  u_int8 b[2*TELEMETRY_WORDS];
+  u_int16 sampleMsb, positionMsb, audata, vu;
+
+  WriteSci(SCI_WRAMADDR, PAR_SAMPLE_COUNTER+1+SCI_WRAM_PARAMETRIC_OFFSET);
+  sampleMsb = ReadSci(SCI_WRAM);
+  WriteSci(SCI_WRAMADDR, PAR_POSITION_MSEC+1+SCI_WRAM_PARAMETRIC_OFFSET);
+  positionMsb = ReadSci(SCI_WRAM);
+  WriteSci(SCI_WRAMADDR, TELEMETRY_FIRST+SCI_WRAM_PARAMETRIC_OFFSET);
+  ReadSciBurst(SCI_WRAM, b, TELEMETRY_WORDS);
+
+  t->mode = ReadSci(SCI_MODE);
+  t->status = ReadSci(SCI_STATUS);
+  /* When recording, reading SCI_HDAT0 takes a word out of the encoder
+     buffer, so it is left for the recording loop */
+  t->hdat0 = (t->mode & SM_ENCODE) ? 0 : ReadSci(SCI_HDAT0);
+  t->hdat1 = ReadSci(SCI_HDAT1);
+  t->decodeTime = ReadSci(SCI_DECODE_TIME);
+  audata = ReadSci(SCI_AUDATA);
+  t->sampleRate = audata & 0xFFFE;
+  t->channels = (audata & 1) ? 2 : 1;
+
+  t->sampleCounter = Counter32(sampleMsb,
+                               TelemetryWord(b, PAR_SAMPLE_COUNTER),
+                               TelemetryWord(b, PAR_SAMPLE_COUNTER+1));
+  t->positionMsec = Counter32(positionMsb,
+                              TelemetryWord(b, PAR_POSITION_MSEC),
+                              TelemetryWord(b, PAR_POSITION_MSEC+1));
+  t->bitRate = TelemetryWord(b, PAR_BITRATE_PER_100) * 100UL;
+  t->config1 = TelemetryWord(b, PAR_CONFIG1);
+  t->playSpeed = TelemetryWord(b, PAR_PLAY_SPEED);
+  t->playMode = TelemetryWord(b, PAR_PLAY_MODE);
+  t->endFillByte = TelemetryWord(b, PAR_END_FILL_BYTE);
+  t->sdiFree = 2*TelemetryWord(b, PAR_SDI_FREE);
+  t->audioFill = TelemetryWord(b, PAR_AUDIO_FILL);
+  vu = TelemetryWord(b, PAR_VU_METER);
+  t->vuLeft = vu >> 8;
+  t->vuRight = vu & 0xFF;
+  /* Only measured by the host, see RECORD_METER */
+  t->peakLeft = t->peakRight = t->rmsLeft = t->rmsRight = t->loudness =
+    TELEMETRY_NO_LEVEL;
+
+  TelemetryPublish(t);
+}
+
+
+/*
+  Takes a new snapshot into t if telemetryInterval has passed since the
+  previous one. Returns 1 if it did.
+*/
+int TelemetryPoll(struct Telemetry *t) {
+  if (t->count && GetMicroseconds() - t->time < telemetryInterval) {
+    return 0;
+  }
+  TelemetryTake(t);
+  return 1;
+}
+
+
+/*
+  Gets the latest telemetry snapshot. Can be called from any thread.
+  Returns 0 on success, or -1 if no snapshot has been taken yet.
+*/
+int VSTestGetTelemetry(struct Telemetry *t) {
+#ifdef PLAYER_HOST
+  return HostSnapshotRead(t, sizeof(*t));
+#else
+  if (!latestTelemetry.count) {
+    return -1;
+  }
+  *t = latestTelemetry;
+  return 0;
+#endif
+}
+
+
+void VSTestSetTelemetryInterval(u_int32 us) {
+  telemetryInterval = us;
+}
@@ -0,0 +1,146 @@
+/*
+
+  VLSI Solution generic microcontroller example player / recorder for
+  VS1063: test and benchmark for the SCI burst byte order conversion.
+
+  Checks that WordsToBigEndian() in playerendian.c gives exactly the
+  same bytes as splitting each word read from SCI into two bytes, which
+  is what ReadSciBurst() used to do, then times both. Compile once with
+  and once without the newer vector instructions:
+
+    cc -O2 -mavx2 swapbench.c playerendian.c
+    cc -O2 swapbench.c playerendian.c
+
+  On x86-64 the second one uses SSE2, on 64-bit ARM NEON is always
+  enabled. Returns 0 if all results match.
+
+*/
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "player1063.h"
+
+#define BENCH_WORDS 4096      /* Words per burst when timing */
+#define BENCH_TOTAL 200000000 /* Words converted per timing */
+#define MAX_WORDS   (BENCH_WORDS+4) /* Room for unaligned offsets */
+#define GUARD       32        /* Bytes after the burst that must not change */
+
+static u_int16 words[MAX_WORDS];
+static u_int8 buf1[2*MAX_WORDS+GUARD], buf2[2*MAX_WORDS+GUARD];
+
+static int errors = 0;
+
+
+/*
+  The loop ReadSciBurst() had before WordsToBigEndian(): each word, as
+  returned by ReadSci(), is split into bytes with shifts.
+*/
+static void SplitWords(u_int8 *data, const u_int16 *w, u_int32 n) {
+  while (n--) {
+    u_int16 v = *w++;
+    *data++ = (u_int8)(v >> 8);
+    *data++ = (u_int8)(v & 0xFF);
+  }
+}
+
+
+static u_int32 rndState = 88172645U;
+
+static u_int32 Rnd(void) {
+  rndState ^= rndState << 13;
+  rndState ^= rndState >> 17;
+  rndState ^= rndState << 5;
+  return rndState;
+}
+
+static double Now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/*
+  Bit-exactness. Every length up to a few vector widths is tried, with
+  the burst starting at all small offsets, so that the vector loops, the
+  scalar tail and unaligned accesses are all covered.
+*/
+static void TestExact(void) {
+  static const u_int32 big[] = {255, 1000, 1023, 1025, BENCH_WORDS};
+  u_int32 n, off, k;
+
+  for (k=0; k<70+sizeof(big)/sizeof(big[0]); k++) {
+    n = (k < 70) ? k : big[k-70];
+    for (off=0; off<4; off++) {
+      memset(buf1, 0x55, sizeof(buf1));
+      memset(buf2, 0x55, sizeof(buf2));
+      /* Land the words in host byte order, as a DMA transfer would */
+      memcpy(buf1+off, words, 2*n);
+      WordsToBigEndian(buf1+off, n);
+      SplitWords(buf2+off, words, n);
+      if (memcmp(buf1, buf2, sizeof(buf1))) {
+        if (errors++ < 10) {
+          printf("WordsToBigEndian: mismatch with n %lu, offset %lu\n",
+                 (unsigned long)n, (unsigned long)off);
+        }
+      }
+    }
+  }
+}
+
+
+/*
+  Timing. Each conversion is run over a burst of BENCH_WORDS words,
+  which fits in the cache, until BENCH_TOTAL words have been converted.
+*/
+
+#define TIME(t, call) do {                                      \
+    u_int32 done_;                                              \
+    double start_ = Now();                                      \
+    for (done_=0; done_<BENCH_TOTAL; done_ += BENCH_WORDS) {    \
+      call;                                                     \
+      __asm__ __volatile__("" : : : "memory");                  \
+    }                                                           \
+    t = (Now() - start_) * 1e9 / BENCH_TOTAL;                   \
+  } while (0)
+
+static void Bench(void) {
+  double t1, t2;
+
+  memcpy(buf1, words, 2*BENCH_WORDS);
+  TIME(t1, WordsToBigEndian(buf1, BENCH_WORDS));
+  TIME(t2, SplitWords(buf2, words, BENCH_WORDS));
+  printf("WordsToBigEndian %7.3f ns/word, splitting words %7.3f ns/word, "
+         "%5.2fx\n", t1, t2, t2/t1);
+}
+
+
+int main(void) {
+  u_int32 i;
+
+#if defined(__AVX2__)
+  printf("Vector kernels: AVX2\n");
+#elif defined(__SSSE3__)
+  printf("Vector kernels: SSSE3\n");
+#elif defined(__SSE2__)
+  printf("Vector kernels: SSE2\n");
+#elif defined(__ARM_NEON)
+  printf("Vector kernels: NEON\n");
+#else
+  printf("Vector kernels: none\n");
+#endif
+  for (i=0; i<MAX_WORDS; i++) {
+    words[i] = (u_int16)Rnd();
+  }
+  TestExact();
+  if (errors) {
+    printf("%d mismatches\n", errors);
+    return 1;
+  }
+  printf("All bursts bit-exact\n");
+  Bench();
+  return 0;
+}
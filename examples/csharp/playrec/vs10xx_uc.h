@@ -479,7 +479,7 @@ typedef unsigned long u_int32;
 #define PAR_MIDI_BYTES_LEFT          0x1e2a /*         VS1053, 32 bits */
 
 /* Decoding Vorbis */
-#define PAR_VORBIS_GAIN 0x1e2a       0x1e30 /* VS1063, VS1053 */
+#define PAR_VORBIS_GAIN              0x1e2a /* VS1063, VS1053 */
 
 
 /* Bit definitions for parametric registers with bitfields */
@@ -531,13 +531,16 @@ typedef unsigned long u_int32;
 #define PAR_PLAY_MODE_PAUSE_ENA         (1<<1) /* VS1063 */
 #define PAR_PLAY_MODE_MONO_ENA          (1<<0) /* VS1063 */
 
+#define PAR_VU_METER_LEFT_B  8 /* VS1063 */
+#define PAR_VU_METER_RIGHT_B 0 /* VS1063 */
+
 #define PAR_VU_METER_LEFT_BITS  8      /* VS1063 */
 #define PAR_VU_METER_LEFT_MASK  0xFF00 /* VS1063 */
 #define PAR_VU_METER_RIGHT_BITS 8      /* VS1063 */
 #define PAR_VU_METER_RIGHT_MASK 0x00FF /* VS1063 */
 
 #define PAR_AD_MIXER_CONFIG_MODE_B 2 /* VS1063 */
-#define PAR_AD_MIXER_CONFIG_RATE_B 2 /* VS1063 */
+#define PAR_AD_MIXER_CONFIG_RATE_B 0 /* VS1063 */
 
 #define PAR_AD_MIXER_CONFIG_MODE_BITS 2      /* VS1063 */
 #define PAR_AD_MIXER_CONFIG_MODE_MASK 0x000c /* VS1063 */
@@ -550,9 +553,9 @@ typedef unsigned long u_int32;
 #define PAR_AD_MIXER_CONFIG_RATE_24K  0x0003 /* VS1063 */
 
 #define PAR_AD_MIXER_CONFIG_MODE_STEREO 0x0000 /* VS1063 */
-#define PAR_AD_MIXER_CONFIG_MODE_MONO   0x0040 /* VS1063 */
-#define PAR_AD_MIXER_CONFIG_MODE_LEFT   0x0080 /* VS1063 */
-#define PAR_AD_MIXER_CONFIG_MODE_RIGHT  0x00c0 /* VS1063 */
+#define PAR_AD_MIXER_CONFIG_MODE_MONO   0x0004 /* VS1063 */
+#define PAR_AD_MIXER_CONFIG_MODE_LEFT   0x0008 /* VS1063 */
+#define PAR_AD_MIXER_CONFIG_MODE_RIGHT  0x000c /* VS1063 */
 
 #define PAR_AAC_SBR_AND_PS_STATUS_SBR_PRESENT_B       0 /* VS1063, VS1053 */
 #define PAR_AAC_SBR_AND_PS_STATUS_UPSAMPLING_ACTIVE_B 1 /* VS1063, VS1053 */
@@ -565,4 +568,128 @@ typedef unsigned long u_int32;
 #define PAR_AAC_SBR_AND_PS_STATUS_PS_ACTIVE         (1<<3) /* VS1063, VS1053 */
 
 
+/*
+
+  Register descriptors.
+
+  The plain addresses above say nothing about how a register may be
+  accessed. A descriptor packs the address together with its access
+  properties, so that ReadVS10xxReg() and WriteVS10xxReg() in the player
+  can pick the right transfer when the descriptor is a constant:
+
+  REG_WRAM      Parametric/WRAM register behind SCI_WRAMADDR, else SCI.
+  REG_32        32-bit value, LSB at the lower address.
+  REG_VOLATILE  Written by the VS10xx itself, so it must be re-read
+                every time. 32-bit volatile registers are counters that
+                need the MSB-LSB-MSB read sequence; 16-bit volatile
+                parametric registers are read through the
+                SCI_WRAM_PARAMETRIC_START mirror.
+
+  Registers without REG_VOLATILE are only changed by the host, so their
+  value may be cached by the caller.
+
+*/
+#define REG_WRAM      0x10000UL
+#define REG_32        0x20000UL
+#define REG_VOLATILE  0x40000UL
+
+#define REG_DESC(addr, flags) ((u_int32)(addr) | (flags))
+#define REG_ADDR(r)           ((u_int16)((r) & 0xFFFFU))
+
+#define REG_SCI_MODE        REG_DESC(SCI_MODE,        0)
+#define REG_SCI_STATUS      REG_DESC(SCI_STATUS,      REG_VOLATILE)
+#define REG_SCI_BASS        REG_DESC(SCI_BASS,        0)
+#define REG_SCI_CLOCKF      REG_DESC(SCI_CLOCKF,      0)
+#define REG_SCI_DECODE_TIME REG_DESC(SCI_DECODE_TIME, REG_VOLATILE)
+#define REG_SCI_AUDATA      REG_DESC(SCI_AUDATA,      REG_VOLATILE)
+#define REG_SCI_HDAT0       REG_DESC(SCI_HDAT0,       REG_VOLATILE)
+#define REG_SCI_HDAT1       REG_DESC(SCI_HDAT1,       REG_VOLATILE)
+#define REG_SCI_VOL         REG_DESC(SCI_VOL,         0)
+
+#define REG_PAR_CHIP_ID         REG_DESC(PAR_CHIP_ID,   REG_WRAM|REG_32)
+#define REG_PAR_VERSION         REG_DESC(PAR_VERSION,   REG_WRAM)
+#define REG_PAR_CONFIG1         REG_DESC(PAR_CONFIG1,   REG_WRAM)
+#define REG_PAR_PLAY_SPEED      REG_DESC(PAR_PLAY_SPEED, REG_WRAM)
+#define REG_PAR_BITRATE_PER_100 \
+  REG_DESC(PAR_BITRATE_PER_100, REG_WRAM|REG_VOLATILE)
+#define REG_PAR_END_FILL_BYTE \
+  REG_DESC(PAR_END_FILL_BYTE, REG_WRAM|REG_VOLATILE)
+#define REG_PAR_RATE_TUNE       REG_DESC(PAR_RATE_TUNE, REG_WRAM|REG_32)
+#define REG_PAR_PLAY_MODE       REG_DESC(PAR_PLAY_MODE, REG_WRAM)
+#define REG_PAR_SAMPLE_COUNTER \
+  REG_DESC(PAR_SAMPLE_COUNTER, REG_WRAM|REG_32|REG_VOLATILE)
+#define REG_PAR_VU_METER        REG_DESC(PAR_VU_METER, REG_WRAM|REG_VOLATILE)
+#define REG_PAR_AD_MIXER_GAIN   REG_DESC(PAR_AD_MIXER_GAIN, REG_WRAM)
+#define REG_PAR_AD_MIXER_CONFIG REG_DESC(PAR_AD_MIXER_CONFIG, REG_WRAM)
+#define REG_PAR_PCM_MIXER_RATE  REG_DESC(PAR_PCM_MIXER_RATE, REG_WRAM)
+#define REG_PAR_PCM_MIXER_FREE \
+  REG_DESC(PAR_PCM_MIXER_FREE, REG_WRAM|REG_VOLATILE)
+#define REG_PAR_PCM_MIXER_VOL   REG_DESC(PAR_PCM_MIXER_VOL, REG_WRAM)
+#define REG_PAR_EQ5_UPDATED \
+  REG_DESC(PAR_EQ5_UPDATED, REG_WRAM|REG_VOLATILE)
+#define REG_PAR_SPEED_SHIFTER   REG_DESC(PAR_SPEED_SHIFTER, REG_WRAM)
+#define REG_PAR_EARSPEAKER_LEVEL REG_DESC(PAR_EARSPEAKER_LEVEL, REG_WRAM)
+#define REG_PAR_SDI_FREE        REG_DESC(PAR_SDI_FREE, REG_WRAM|REG_VOLATILE)
+#define REG_PAR_AUDIO_FILL \
+  REG_DESC(PAR_AUDIO_FILL, REG_WRAM|REG_VOLATILE)
+#define REG_PAR_LATEST_SOF \
+  REG_DESC(PAR_LATEST_SOF, REG_WRAM|REG_32|REG_VOLATILE)
+#define REG_PAR_POSITION_MSEC \
+  REG_DESC(PAR_POSITION_MSEC, REG_WRAM|REG_32|REG_VOLATILE)
+#define REG_PAR_RESYNC          REG_DESC(PAR_RESYNC, REG_WRAM)
+#define REG_PAR_ENC_AEC_ADAPT_MULTIPLIER \
+  REG_DESC(PAR_ENC_AEC_ADAPT_MULTIPLIER, REG_WRAM)
+#define REG_PAR_ENC_SERIAL_NUMBER \
+  REG_DESC(PAR_ENC_SERIAL_NUMBER, REG_WRAM|REG_32)
+
+/* 16-bit volatile parametric registers are read through the mirror.
+   REG_READ_ADDR(r) is the address to write to SCI_WRAMADDR before
+   reading r, or r and the registers after it, from SCI_WRAM. */
+#define REG_IS_MIRRORED(r) \
+  (((r) & (REG_WRAM|REG_32|REG_VOLATILE)) == (REG_WRAM|REG_VOLATILE) && \
+   REG_ADDR(r) >= PAR_CHIP_ID && \
+   REG_ADDR(r) < PAR_CHIP_ID+0x40)
+#define REG_READ_ADDR(r) \
+  ((u_int16)(REG_ADDR(r) + \
+             (REG_IS_MIRRORED(r) ? SCI_WRAM_PARAMETRIC_OFFSET : 0)))
+
+
+/*
+
+  Bitfield descriptors.
+
+  A field descriptor packs the _B and _BITS definitions of a bitfield,
+  so that a field can be passed around as one constant:
+  FIELD_GET(ReadVS10xxReg(REG_SCI_STATUS), SS_VER_F) is the chip version and
+  FIELD_SET(clockF, SC_MULT_F, 4) replaces the clock multiplier.
+
+*/
+#define REG_FIELD(b, bits)   ((b) | ((bits) << 8))
+#define FIELD_SHIFT(f)       ((f) & 0xFF)
+#define FIELD_MAX(f)         ((1UL << ((f) >> 8)) - 1)
+#define FIELD_MASK(f)        (FIELD_MAX(f) << FIELD_SHIFT(f))
+
+#define FIELD_GET(v, f)      (((v) >> FIELD_SHIFT(f)) & FIELD_MAX(f))
+#define FIELD_SET(v, f, x)   (((v) & ~FIELD_MASK(f)) | \
+                              (((x) & FIELD_MAX(f)) << FIELD_SHIFT(f)))
+
+#define SS_VER_F          REG_FIELD(SS_VER_B,          SS_VER_BITS)
+#define SS_SWING_F        REG_FIELD(SS_SWING_B,        SS_SWING_BITS)
+#define SC_MULT_F         REG_FIELD(SC_MULT_B,         SC_MULT_BITS)
+#define SC_ADD_F          REG_FIELD(SC_ADD_B,          SC_ADD_BITS)
+#define SC_FREQ_F         REG_FIELD(SC_FREQ_B,         SC_FREQ_BITS)
+#define SV_LEFT_F         REG_FIELD(SV_LEFT_B,         SV_LEFT_BITS)
+#define SV_RIGHT_F        REG_FIELD(SV_RIGHT_B,        SV_RIGHT_BITS)
+#define RM_63_FORMAT_F    REG_FIELD(RM_63_FORMAT_B,    RM_63_FORMAT_BITS)
+#define RM_63_ADC_MODE_F  REG_FIELD(RM_63_ADC_MODE_B,  RM_63_ADCMODE_BITS)
+#define PAR_VU_METER_LEFT_F \
+  REG_FIELD(PAR_VU_METER_LEFT_B, PAR_VU_METER_LEFT_BITS)
+#define PAR_VU_METER_RIGHT_F \
+  REG_FIELD(PAR_VU_METER_RIGHT_B, PAR_VU_METER_RIGHT_BITS)
+#define PAR_AD_MIXER_CONFIG_MODE_F \
+  REG_FIELD(PAR_AD_MIXER_CONFIG_MODE_B, PAR_AD_MIXER_CONFIG_MODE_BITS)
+#define PAR_AD_MIXER_CONFIG_RATE_F \
+  REG_FIELD(PAR_AD_MIXER_CONFIG_RATE_B, PAR_AD_MIXER_CONFIG_RATE_BITS)
+
+
 #endif /* !VS10XX_MICROCONTROLLER_DEFINITIONS_H */